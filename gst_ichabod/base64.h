@@ -9,9 +9,37 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+#include <stddef.h>
+
 unsigned char * base64_encode(const unsigned char *src, size_t len,
                               size_t *out_len);
 unsigned char * base64_decode(const unsigned char *src, size_t len,
                               size_t *out_len);
 
+/*
+ * Incremental decoder. Accepts exactly what base64_decode accepts (characters
+ * outside the alphabet are skipped, decoding ends after the first padded
+ * block) and produces the same bytes, but writes into caller memory and
+ * takes the input in arbitrary chunks.
+ */
+struct base64_decoder_s {
+  unsigned char block[4];
+  int count;    /* characters buffered in block */
+  size_t total; /* valid characters seen, including '=' and trailing input */
+  char done;    /* a padded block ended the data */
+  char error;
+};
+
+/* Upper bound on the bytes one base64_decoder_update call may write */
+#define base64_decode_bound(len) (((len) + 3) / 4 * 3)
+
+void base64_decoder_init(struct base64_decoder_s *dec);
+/* Decodes a chunk into out, which must hold base64_decode_bound(len) bytes.
+ * Returns 0, or -1 on invalid padding. */
+int base64_decoder_update(struct base64_decoder_s *dec,
+                          const unsigned char *src, size_t len,
+                          unsigned char *out, size_t *out_len);
+/* Returns 0 if the input seen so far is a complete, valid encoding. */
+int base64_decoder_finish(struct base64_decoder_s *dec);
+
 #endif /* BASE64_H */
@@ -0,0 +1,487 @@
+//
+//  bench_ichabod.c
+//  gst_ichabod
+//
+
+/**
+ * Microbenchmarks for the screencast ingest hot path: base64 decoding,
+ * horseman envelope receive/parse/dispatch, and wall clock adjustment.
+ *
+ * Payloads are the JPEG files in --frames DIR, or synthetic stand-ins sized
+ * like 720p/1080p/4K screencast frames. Results go to stdout as one JSON
+ * object per line so runs can be diffed across releases:
+ *   {"bench": ..., "payload": ..., "bytes": ..., "iterations": ...,
+ *    "mb_per_s": ..., "ns_per_frame": ..., "allocs_per_frame": ...}
+ * allocs_per_frame counts malloc/calloc/realloc calls process-wide (glibc
+ * only, -1 elsewhere), so the horseman benches include the zmq threads and
+ * the sending side. horseman logs to stdout too; results are the lines that
+ * start with '{'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <zmq.h>
+#include <gst/gst.h>
+#include "base64.h"
+#include "horseman.h"
+#include "ipc_endpoint.h"
+#include "wallclock.h"
+
+#define MAX_PAYLOADS 64
+// frames allowed in flight; stays under the horseman dispatch queue size
+// so nothing is dropped and every frame is measured
+#define HORSEMAN_WINDOW 32
+
+#pragma mark - Allocation counting
+
+static uint64_t alloc_count;
+
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+#define ALLOCS_COUNTED 1
+#else
+#define ALLOCS_COUNTED 0
+#endif
+
+static uint64_t get_alloc_count() {
+  return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Payloads
+
+struct payload_s {
+  char name[64];
+  uint8_t* jpeg;
+  size_t jpeg_length;
+  // as the horseman sends it: no line breaks
+  char* base64;
+  size_t base64_length;
+};
+
+struct bench_result_s {
+  const char* bench;
+  const char* payload;
+  size_t bytes;
+  int iterations;
+  uint64_t elapsed_ns;
+  uint64_t allocs;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_result(struct bench_result_s* result) {
+  double seconds = result->elapsed_ns / 1e9;
+  double mb_per_s = seconds > 0 ?
+  (double)result->bytes * result->iterations / seconds / 1e6 : 0;
+  double allocs = ALLOCS_COUNTED ?
+  (double)result->allocs / result->iterations : -1;
+  printf("{\"bench\": \"%s\", \"payload\": \"%s\", \"bytes\": %zu, "
+         "\"iterations\": %d, \"mb_per_s\": %.1f, \"ns_per_frame\": %.0f, "
+         "\"allocs_per_frame\": %.2f}\n",
+         result->bench, result->payload, result->bytes, result->iterations,
+         mb_per_s, (double)result->elapsed_ns / result->iterations, allocs);
+  fflush(stdout);
+}
+
+static void payload_encode(struct payload_s* payload) {
+  size_t length = 0;
+  char* encoded =
+  (char*)base64_encode(payload->jpeg, payload->jpeg_length, &length);
+  size_t j = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (encoded[i] != '\n') {
+      encoded[j++] = encoded[i];
+    }
+  }
+  encoded[j] = '\0';
+  payload->base64 = encoded;
+  payload->base64_length = j;
+}
+
+/* Roughly what a browser screencast JPEG weighs at each size. The body is
+ * random, which only matters to consumers that actually parse the JPEG.
+ */
+static int synthesize_payloads(struct payload_s* payloads) {
+  static const struct {
+    const char* name;
+    size_t length;
+  } sizes[] = {
+    { "720p", 120 * 1024 },
+    { "1080p", 260 * 1024 },
+    { "4k", 900 * 1024 },
+  };
+  int count = sizeof(sizes) / sizeof(sizes[0]);
+  srand(1);
+  for (int i = 0; i < count; i++) {
+    struct payload_s* payload = &payloads[i];
+    snprintf(payload->name, sizeof(payload->name), "%s", sizes[i].name);
+    payload->jpeg_length = sizes[i].length;
+    payload->jpeg = (uint8_t*)malloc(payload->jpeg_length);
+    for (size_t j = 0; j < payload->jpeg_length; j++) {
+      payload->jpeg[j] = (uint8_t)rand();
+    }
+    // SOI ... EOI
+    payload->jpeg[0] = 0xFF;
+    payload->jpeg[1] = 0xD8;
+    payload->jpeg[payload->jpeg_length - 2] = 0xFF;
+    payload->jpeg[payload->jpeg_length - 1] = 0xD9;
+    payload_encode(payload);
+  }
+  return count;
+}
+
+static int has_jpeg_extension(const char* name) {
+  const char* ext = strrchr(name, '.');
+  return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+static int load_payloads(const char* dir_path, struct payload_s* payloads) {
+  DIR* dir = opendir(dir_path);
+  if (!dir) {
+    fprintf(stderr, "bench_ichabod: cannot open %s\n", dir_path);
+    return 0;
+  }
+  int count = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) && count < MAX_PAYLOADS) {
+    if (!has_jpeg_extension(entry->d_name)) {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+      continue;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    struct payload_s* payload = &payloads[count];
+    payload->jpeg = (uint8_t*)malloc(length > 0 ? length : 1);
+    payload->jpeg_length = fread(payload->jpeg, 1, length, file);
+    fclose(file);
+    if (!payload->jpeg_length) {
+      free(payload->jpeg);
+      continue;
+    }
+    snprintf(payload->name, sizeof(payload->name), "%s", entry->d_name);
+    payload_encode(payload);
+    count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+#pragma mark - Base64
+
+static void bench_base64_decode(struct payload_s* payload, int iterations) {
+  struct bench_result_s result = {
+    "base64_decode", payload->name, payload->base64_length, iterations
+  };
+  uint64_t allocs = get_alloc_count();
+  uint64_t start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    size_t length;
+    unsigned char* out = base64_decode((const unsigned char*)payload->base64,
+                                       payload->base64_length, &length);
+    free(out);
+  }
+  result.elapsed_ns = now_ns() - start;
+  result.allocs = get_alloc_count() - allocs;
+  print_result(&result);
+}
+
+// The streaming decoder as screencast_src uses it, into reused memory
+static void bench_base64_decoder(struct payload_s* payload, int iterations) {
+  struct bench_result_s result = {
+    "base64_decoder", payload->name, payload->base64_length, iterations
+  };
+  unsigned char* out =
+  (unsigned char*)malloc(base64_decode_bound(payload->base64_length));
+  uint64_t allocs = get_alloc_count();
+  uint64_t start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    struct base64_decoder_s decoder;
+    size_t length;
+    base64_decoder_init(&decoder);
+    base64_decoder_update(&decoder, (const unsigned char*)payload->base64,
+                          payload->base64_length, out, &length);
+    base64_decoder_finish(&decoder);
+  }
+  result.elapsed_ns = now_ns() - start;
+  result.allocs = get_alloc_count() - allocs;
+  print_result(&result);
+  free(out);
+}
+
+#pragma mark - Horseman ingest
+
+struct horseman_bench_s {
+  void* zmq_ctx;
+  void* push_socket;
+  struct horseman_s* horseman;
+  uint64_t frames_seen;
+};
+
+static void on_bench_video_frame(struct horseman_s* horseman,
+                                 struct horseman_frame_s* frame, void* p)
+{
+  struct horseman_bench_s* bench = (struct horseman_bench_s*)p;
+  __atomic_add_fetch(&bench->frames_seen, 1, __ATOMIC_RELEASE);
+}
+
+static void on_bench_output_request(struct horseman_s* horseman,
+                                    struct horseman_output_s* output,
+                                    void* p)
+{
+}
+
+static void wait_for_frames(struct horseman_bench_s* bench, uint64_t target) {
+  while (__atomic_load_n(&bench->frames_seen, __ATOMIC_ACQUIRE) < target) {
+    sched_yield();
+  }
+}
+
+static void send_text_frame(struct horseman_bench_s* bench,
+                            struct payload_s* payload, int i)
+{
+  char ts[32];
+  int ts_length = snprintf(ts, sizeof(ts), "%d", i * 33);
+  zmq_send(bench->push_socket, "frame", 5, ZMQ_SNDMORE);
+  zmq_send(bench->push_socket, payload->base64, payload->base64_length,
+           ZMQ_SNDMORE);
+  zmq_send(bench->push_socket, ts, ts_length, 0);
+}
+
+static void send_binary_frame(struct horseman_bench_s* bench,
+                              struct payload_s* payload, int i)
+{
+  uint8_t header[24] = { 0 };
+  uint64_t ts = (uint64_t)i * 33;
+  header[0] = HORSEMAN_FRAME_PROTOCOL_VERSION;
+  header[1] = 1; // JPEG
+  header[2] = sizeof(header);
+  for (int b = 0; b < 4; b++) {
+    header[4 + b] = (uint8_t)((uint32_t)i >> (8 * b));
+  }
+  for (int b = 0; b < 8; b++) {
+    header[8 + b] = (uint8_t)(ts >> (8 * b));
+  }
+  zmq_send(bench->push_socket, "bframe", 6, ZMQ_SNDMORE);
+  zmq_send(bench->push_socket, header, sizeof(header), ZMQ_SNDMORE);
+  zmq_send(bench->push_socket, payload->jpeg, payload->jpeg_length, 0);
+}
+
+static void bench_horseman(struct horseman_bench_s* bench, const char* name,
+                           struct payload_s* payload, int iterations,
+                           void (*send_f)(struct horseman_bench_s* bench,
+                                          struct payload_s* payload, int i))
+{
+  int binary = send_f == send_binary_frame;
+  struct bench_result_s result = {
+    name, payload->name,
+    binary ? payload->jpeg_length : payload->base64_length,
+    iterations
+  };
+  if (binary) {
+    // binary frames are dropped until the peer has announced the protocol
+    char version[16];
+    int version_length = snprintf(version, sizeof(version), "%d",
+                                  HORSEMAN_FRAME_PROTOCOL_VERSION);
+    zmq_send(bench->push_socket, "hello", 5, ZMQ_SNDMORE);
+    zmq_send(bench->push_socket, version, version_length, 0);
+  }
+  // warm the connection up so setup isn't billed to the first payload
+  uint64_t base = __atomic_load_n(&bench->frames_seen, __ATOMIC_ACQUIRE);
+  send_f(bench, payload, 0);
+  wait_for_frames(bench, base + 1);
+  base++;
+
+  uint64_t allocs = get_alloc_count();
+  uint64_t start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    if (i >= HORSEMAN_WINDOW) {
+      wait_for_frames(bench, base + i - HORSEMAN_WINDOW + 1);
+    }
+    send_f(bench, payload, i);
+  }
+  wait_for_frames(bench, base + iterations);
+  result.elapsed_ns = now_ns() - start;
+  result.allocs = get_alloc_count() - allocs;
+  print_result(&result);
+}
+
+static int horseman_bench_start(struct horseman_bench_s* bench) {
+  char session_id[64];
+  snprintf(session_id, sizeof(session_id), "bench-%d", getpid());
+
+  struct horseman_config_s config = { 0 };
+  config.on_video_frame = on_bench_video_frame;
+  config.on_output_request = on_bench_output_request;
+  config.p = bench;
+  config.session_id = session_id;
+  horseman_alloc(&bench->horseman);
+  horseman_load_config(bench->horseman, &config);
+
+  char* pull_endpoint =
+  ipc_endpoint_expand(HORSEMAN_SESSION_PULL_ENDPOINT, session_id);
+
+  bench->zmq_ctx = zmq_ctx_new();
+  bench->push_socket = zmq_socket(bench->zmq_ctx, ZMQ_PUSH);
+  if (zmq_bind(bench->push_socket, pull_endpoint)) {
+    fprintf(stderr, "bench_ichabod: failed to bind %s\n", pull_endpoint);
+    free(pull_endpoint);
+    return -1;
+  }
+  free(pull_endpoint);
+  return horseman_start(bench->horseman);
+}
+
+static void horseman_bench_stop(struct horseman_bench_s* bench) {
+  horseman_stop(bench->horseman);
+  horseman_free(bench->horseman);
+  int linger = 0;
+  zmq_setsockopt(bench->push_socket, ZMQ_LINGER, &linger, sizeof(linger));
+  zmq_close(bench->push_socket);
+  zmq_ctx_destroy(bench->zmq_ctx);
+}
+
+#pragma mark - Wall clock
+
+static void bench_wall_clock_adjust(int iterations) {
+  struct bench_result_s result = {
+    "wall_clock_adjust", "none", 0, iterations
+  };
+  GstClock* clock = gst_wall_clock_new();
+  gst_clock_set_calibration(clock, 0, gst_clock_get_time(clock), 1, 1);
+  GstClockTime sink = 0;
+  uint64_t allocs = get_alloc_count();
+  uint64_t start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    sink += gst_wall_clock_adjust_safe(clock, (GstClockTime)i * GST_MSECOND);
+  }
+  result.elapsed_ns = now_ns() - start;
+  result.allocs = get_alloc_count() - allocs;
+  print_result(&result);
+  gst_object_unref(clock);
+  if (!sink) {
+    fprintf(stderr, "bench_ichabod: unexpected clock result\n");
+  }
+}
+
+#pragma mark -
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--frames DIR] [--iterations N] [--only base64|horseman|"
+          "clock]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  const char* frames_dir = NULL;
+  const char* only = NULL;
+  int iterations = 200;
+
+  static struct option long_options[] =
+  {
+    {"frames", required_argument, 0, 'f'},
+    {"iterations", required_argument, 0, 'n'},
+    {"only", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+  };
+  int c;
+  int option_index = 0;
+  while ((c = getopt_long(argc, argv, "f:n:o:",
+                          long_options, &option_index)) != -1)
+  {
+    switch (c) {
+      case 'f':
+        frames_dir = optarg;
+        break;
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'o':
+        only = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (iterations <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  gst_init(&argc, &argv);
+
+  struct payload_s payloads[MAX_PAYLOADS] = { 0 };
+  int payload_count = frames_dir ?
+  load_payloads(frames_dir, payloads) : synthesize_payloads(payloads);
+  if (!payload_count) {
+    fprintf(stderr, "bench_ichabod: no payloads\n");
+    return 1;
+  }
+
+  if (!only || !strcmp(only, "base64")) {
+    for (int i = 0; i < payload_count; i++) {
+      bench_base64_decode(&payloads[i], iterations);
+      bench_base64_decoder(&payloads[i], iterations);
+    }
+  }
+
+  if (!only || !strcmp(only, "horseman")) {
+    struct horseman_bench_s bench = { 0 };
+    if (horseman_bench_start(&bench)) {
+      return 1;
+    }
+    for (int i = 0; i < payload_count; i++) {
+      bench_horseman(&bench, "horseman_frame", &payloads[i], iterations,
+                     send_text_frame);
+      bench_horseman(&bench, "horseman_bframe", &payloads[i], iterations,
+                     send_binary_frame);
+    }
+    horseman_bench_stop(&bench);
+  }
+
+  if (!only || !strcmp(only, "clock")) {
+    // cheap enough that a frame count of calls says nothing; scale it up
+    bench_wall_clock_adjust(iterations * 10000);
+  }
+
+  for (int i = 0; i < payload_count; i++) {
+    free(payloads[i].jpeg);
+    free(payloads[i].base64);
+  }
+  return 0;
+}
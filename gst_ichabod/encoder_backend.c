@@ -0,0 +1,235 @@
+//
+//  encoder_backend.c
+//  gst_ichabod
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "encoder_backend.h"
+
+// top of the H.264 QP scale that encoder_backend_settings_s.quality uses
+#define H264_QP_MAX 51
+
+struct encoder_backend_s {
+  const char* name;
+  const char* factory;
+  const char* media_type;
+  const char* rtp_payloader;
+  const char* rtp_encoding_name;
+  void (*configure)(GstElement* encoder,
+                    const struct encoder_backend_settings_s* s);
+};
+
+/* Property sets differ between plugin versions (svtav1enc especially), so
+ * anything this build of the element lacks is skipped, not fatal. Values go
+ * through gst_util_set_object_arg so enums can be given by nick and numbers
+ * land in whatever integer type the property has.
+ */
+static void set_property(GstElement* encoder, const char* name,
+                         const char* value)
+{
+  if (!g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), name)) {
+    g_print("encoder_backend: %s has no property %s, skipped\n",
+            GST_OBJECT_NAME(encoder), name);
+    return;
+  }
+  gst_util_set_object_arg(G_OBJECT(encoder), name, value);
+}
+
+static void set_number(GstElement* encoder, const char* name, gint64 value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%" G_GINT64_FORMAT, value);
+  set_property(encoder, name, text);
+}
+
+static int scale_quality(int quality, int max) {
+  return quality * max / H264_QP_MAX;
+}
+
+#pragma mark - Backends
+
+static void configure_x264(GstElement* encoder,
+                           const struct encoder_backend_settings_s* s)
+{
+  set_property(encoder, "speed-preset", "ultrafast");
+  if (s->key_int_max) {
+    set_number(encoder, "key-int-max", s->key_int_max);
+  }
+  if (s->threads) {
+    set_number(encoder, "threads", s->threads);
+  }
+  if (encoder_rate_control_cbr == s->rate_control) {
+    set_property(encoder, "pass", "cbr");
+    set_number(encoder, "bitrate", s->bitrate);
+    // in cbr, the VBV max rate is the bitrate and this is its buffer, in ms
+    set_number(encoder, "vbv-buf-capacity", 1000);
+  } else if (encoder_rate_control_quality == s->rate_control) {
+    set_property(encoder, "pass", "qual");
+    set_number(encoder, "qp-min", 16);
+    set_number(encoder, "qp-max", 22);
+    // in crf, this sets crf. in qp, this sets qp. FUN. :-|
+    set_number(encoder, "quantizer", s->quality);
+    // in crf, bitrate property is just a max limit to prevent runaway filesize
+    if (s->bitrate) {
+      set_number(encoder, "bitrate", s->bitrate);
+    }
+  }
+}
+
+static void configure_openh264(GstElement* encoder,
+                               const struct encoder_backend_settings_s* s)
+{
+  // openh264's equivalent of ultrafast
+  set_property(encoder, "complexity", "low");
+  if (s->key_int_max) {
+    set_number(encoder, "gop-size", s->key_int_max);
+  }
+  if (s->threads) {
+    set_number(encoder, "multi-thread", s->threads);
+  }
+  if (encoder_rate_control_cbr == s->rate_control) {
+    set_property(encoder, "rate-control", "bitrate");
+    set_number(encoder, "bitrate", s->bitrate * 1000);
+  } else if (encoder_rate_control_quality == s->rate_control) {
+    // no CRF: hold the QP near the requested quality instead
+    set_property(encoder, "rate-control", "quality");
+    set_number(encoder, "qp-min", MAX(0, s->quality - 2));
+    set_number(encoder, "qp-max", MIN(H264_QP_MAX, s->quality + 2));
+    if (s->bitrate) {
+      set_number(encoder, "max-bitrate", s->bitrate * 1000);
+    }
+  }
+}
+
+// vp8enc and vp9enc share libvpx's properties
+static void configure_vpx(GstElement* encoder,
+                          const struct encoder_backend_settings_s* s)
+{
+  // the default deadline is "best", far too slow for a live source
+  set_number(encoder, "deadline", 1);
+  set_number(encoder, "cpu-used", 4);
+  if (s->key_int_max) {
+    set_number(encoder, "keyframe-max-dist", s->key_int_max);
+  }
+  if (s->threads) {
+    set_number(encoder, "threads", s->threads);
+  }
+  if (encoder_rate_control_cbr == s->rate_control) {
+    set_property(encoder, "end-usage", "cbr");
+    set_number(encoder, "target-bitrate", s->bitrate * 1000);
+  } else if (encoder_rate_control_quality == s->rate_control) {
+    set_property(encoder, "end-usage", "cq");
+    set_number(encoder, "cq-level", scale_quality(s->quality, 63));
+    if (s->bitrate) {
+      set_number(encoder, "target-bitrate", s->bitrate * 1000);
+    }
+  }
+}
+
+// gst-plugins-bad's svtav1enc. Older builds from SVT-AV1 itself differ.
+static void configure_svtav1(GstElement* encoder,
+                             const struct encoder_backend_settings_s* s)
+{
+  set_number(encoder, "preset", 10);
+  if (s->key_int_max) {
+    set_number(encoder, "intra-period-length", s->key_int_max);
+  }
+  if (s->threads) {
+    set_number(encoder, "logical-processors", s->threads);
+  }
+  if (encoder_rate_control_cbr == s->rate_control) {
+    set_number(encoder, "target-bitrate", s->bitrate);
+  } else if (encoder_rate_control_quality == s->rate_control) {
+    set_number(encoder, "crf", scale_quality(s->quality, 63));
+    if (s->bitrate) {
+      set_number(encoder, "max-bitrate", s->bitrate);
+    }
+  }
+}
+
+// rav1enc, from gst-plugins-rs
+static void configure_rav1e(GstElement* encoder,
+                            const struct encoder_backend_settings_s* s)
+{
+  set_number(encoder, "speed-preset", 10);
+  set_property(encoder, "low-latency", "true");
+  if (s->key_int_max) {
+    set_number(encoder, "max-key-frame-interval", s->key_int_max);
+  }
+  if (s->threads) {
+    set_number(encoder, "threads", s->threads);
+  }
+  if (encoder_rate_control_cbr == s->rate_control) {
+    set_number(encoder, "bitrate", s->bitrate * 1000);
+  } else if (encoder_rate_control_quality == s->rate_control) {
+    set_number(encoder, "quantizer", scale_quality(s->quality, 255));
+  }
+}
+
+static const struct encoder_backend_s backends[] = {
+  { "x264", "x264enc", "video/x-h264", "rtph264pay", "H264",
+    configure_x264 },
+  { "openh264", "openh264enc", "video/x-h264", "rtph264pay", "H264",
+    configure_openh264 },
+  { "vp8", "vp8enc", "video/x-vp8", "rtpvp8pay", "VP8", configure_vpx },
+  { "vp9", "vp9enc", "video/x-vp9", "rtpvp9pay", "VP9", configure_vpx },
+  { "svtav1", "svtav1enc", "video/x-av1", "rtpav1pay", "AV1",
+    configure_svtav1 },
+  { "rav1e", "rav1enc", "video/x-av1", "rtpav1pay", "AV1",
+    configure_rav1e },
+};
+
+#pragma mark - Public
+
+const struct encoder_backend_s* encoder_backend_find(const char* name) {
+  for (size_t i = 0; i < G_N_ELEMENTS(backends); i++) {
+    if (strcmp(name, backends[i].name)) {
+      continue;
+    }
+    GstElementFactory* factory =
+    gst_element_factory_find(backends[i].factory);
+    if (!factory) {
+      g_print("encoder_backend: %s needs %s, which is not installed\n",
+              name, backends[i].factory);
+      return NULL;
+    }
+    gst_object_unref(factory);
+    return &backends[i];
+  }
+  g_print("encoder_backend: unknown encoder %s\n", name);
+  return NULL;
+}
+
+const char* encoder_backend_get_name(const struct encoder_backend_s* backend)
+{
+  return backend->name;
+}
+
+const char* encoder_backend_get_media_type
+(const struct encoder_backend_s* backend)
+{
+  return backend->media_type;
+}
+
+const char* encoder_backend_get_rtp_payloader
+(const struct encoder_backend_s* backend)
+{
+  return backend->rtp_payloader;
+}
+
+const char* encoder_backend_get_rtp_encoding_name
+(const struct encoder_backend_s* backend)
+{
+  return backend->rtp_encoding_name;
+}
+
+GstElement* encoder_backend_make(const struct encoder_backend_s* backend,
+                                 const struct encoder_backend_settings_s* s)
+{
+  GstElement* encoder = gst_element_factory_make(backend->factory, NULL);
+  if (!encoder) {
+    return NULL;
+  }
+  backend->configure(encoder, s);
+  return encoder;
+}
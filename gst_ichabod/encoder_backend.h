@@ -0,0 +1,61 @@
+//
+//  encoder_backend.h
+//  gst_ichabod
+//
+
+/**
+ * The video encoders ichabod knows how to drive, behind one set of settings.
+ * Each backend maps rate control, bitrate, keyframe interval and threads onto
+ * its own element's properties, and knows its codec's caps and RTP
+ * payloader. Backends whose element is not installed are not offered, so
+ * callers can fall back to another.
+ */
+
+#ifndef encoder_backend_h
+#define encoder_backend_h
+
+#include <gst/gst.h>
+
+#define ENCODER_BACKEND_DEFAULT "x264"
+
+struct encoder_backend_s;
+
+enum encoder_rate_control_e {
+  // whatever the element does by default
+  encoder_rate_control_default = 0,
+  // constant quality; bitrate, if set, caps it
+  encoder_rate_control_quality,
+  // constant bitrate
+  encoder_rate_control_cbr,
+};
+
+// 0 leaves the element's default
+struct encoder_backend_settings_s {
+  enum encoder_rate_control_e rate_control;
+  // on the H.264 QP scale (0-51); mapped onto the backend's own
+  int quality;
+  // kbit/s
+  int bitrate;
+  // frames between keyframes
+  int key_int_max;
+  int threads;
+};
+
+/* "x264", "openh264", "vp8", "vp9", "svtav1" or "rav1e". NULL if the name is
+ * unknown or its element is not installed.
+ */
+const struct encoder_backend_s* encoder_backend_find(const char* name);
+const char* encoder_backend_get_name(const struct encoder_backend_s* backend);
+// e.g. "video/x-h264"
+const char* encoder_backend_get_media_type
+(const struct encoder_backend_s* backend);
+// payloader element and RTP encoding-name for the codec
+const char* encoder_backend_get_rtp_payloader
+(const struct encoder_backend_s* backend);
+const char* encoder_backend_get_rtp_encoding_name
+(const struct encoder_backend_s* backend);
+// A new, configured encoder element. Floating, like any factory element.
+GstElement* encoder_backend_make(const struct encoder_backend_s* backend,
+                                 const struct encoder_backend_settings_s* s);
+
+#endif /* encoder_backend_h */
@@ -0,0 +1,17 @@
+//
+//  frame_hash.h
+//  gst_ichabod
+//
+
+#ifndef frame_hash_h
+#define frame_hash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XXH64 (seed 0) over a frame payload, a few GB/s per core. Reads words in
+ * host byte order, so only compare hashes computed on the same machine.
+ */
+uint64_t frame_hash(const void* data, size_t length);
+
+#endif /* frame_hash_h */
@@ -0,0 +1,113 @@
+//
+//  framepool.c
+//  gst_ichabod
+//
+
+#include "framepool.h"
+#include <unistd.h>
+#include <gst/video/video.h>
+
+GST_DEBUG_CATEGORY_STATIC (gst_frame_pool_debug_category);
+#define GST_CAT_DEFAULT gst_frame_pool_debug_category
+
+typedef struct _GstFramePool GstFramePool;
+typedef struct _GstFramePoolClass GstFramePoolClass;
+
+struct _GstFramePool
+{
+  GstBufferPool parent;
+};
+
+struct _GstFramePoolClass
+{
+  GstBufferPoolClass parent_class;
+};
+
+#define gst_frame_pool_parent_class parent_class
+
+#define DEBUG_INIT \
+GST_DEBUG_CATEGORY_INIT (gst_frame_pool_debug_category, \
+"framepool", 0, "debug category for gst-framepool");
+
+G_DEFINE_TYPE_WITH_CODE (GstFramePool, gst_frame_pool,
+                         GST_TYPE_BUFFER_POOL, DEBUG_INIT);
+
+static GstFlowReturn gst_frame_pool_alloc_buffer
+(GstBufferPool* pool, GstBuffer** buffer, GstBufferPoolAcquireParams* params);
+
+static void gst_frame_pool_class_init(GstFramePoolClass* klass)
+{
+  GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS(klass);
+
+  pool_class->alloc_buffer = GST_DEBUG_FUNCPTR(gst_frame_pool_alloc_buffer);
+}
+
+static void gst_frame_pool_init(GstFramePool* pool)
+{
+}
+
+GstBufferPool* gst_frame_pool_new()
+{
+  GstBufferPool* pool = g_object_new(GST_TYPE_FRAME_POOL, NULL);
+  // not floating, like gst_buffer_pool_new()
+  gst_object_ref_sink(pool);
+  return pool;
+}
+
+static GstFlowReturn gst_frame_pool_alloc_buffer
+(GstBufferPool* pool, GstBuffer** buffer, GstBufferPoolAcquireParams* params)
+{
+  GstFlowReturn ret =
+  GST_BUFFER_POOL_CLASS(parent_class)->alloc_buffer(pool, buffer, params);
+  if (GST_FLOW_OK != ret) {
+    return ret;
+  }
+  // touch every page now, while nobody is waiting on this buffer
+  GstMapInfo map;
+  if (gst_buffer_map(*buffer, &map, GST_MAP_WRITE)) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (gsize i = 0; i < map.size; i += page_size) {
+      map.data[i] = 0;
+    }
+    gst_buffer_unmap(*buffer, &map);
+  }
+  GST_DEBUG_OBJECT(pool, "allocated %" G_GSIZE_FORMAT " bytes",
+                   gst_buffer_get_size(*buffer));
+  return ret;
+}
+
+static GstPadProbeReturn on_allocation_query
+(GstPad* pad, GstPadProbeInfo* info, gpointer p)
+{
+  GstQuery* query = GST_PAD_PROBE_INFO_QUERY(info);
+  // only once downstream has had its say
+  if (GST_QUERY_ALLOCATION != GST_QUERY_TYPE(query) ||
+      !(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_PULL) ||
+      gst_query_get_n_allocation_pools(query))
+  {
+    return GST_PAD_PROBE_OK;
+  }
+  GstCaps* caps = NULL;
+  gboolean need_pool = FALSE;
+  gst_query_parse_allocation(query, &caps, &need_pool);
+  GstVideoInfo vinfo;
+  if (!caps || !gst_video_info_from_caps(&vinfo, caps)) {
+    return GST_PAD_PROBE_OK;
+  }
+  guint min_buffers = GPOINTER_TO_UINT(p);
+  GstBufferPool* pool = gst_frame_pool_new();
+  GstStructure* config = gst_buffer_pool_get_config(pool);
+  gst_buffer_pool_config_set_params(config, caps, vinfo.size,
+                                    min_buffers, 0);
+  gst_buffer_pool_set_config(pool, config);
+  gst_query_add_allocation_pool(query, pool, vinfo.size, min_buffers, 0);
+  gst_object_unref(pool);
+  return GST_PAD_PROBE_OK;
+}
+
+void gst_frame_pool_offer_on_pad(GstPad* src_pad, guint min_buffers)
+{
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+                    on_allocation_query, GUINT_TO_POINTER(min_buffers),
+                    NULL);
+}
@@ -0,0 +1,39 @@
+//
+//  framepool.h
+//  gst_ichabod
+//
+
+#ifndef framepool_h
+#define framepool_h
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* A plain GstBufferPool whose buffers are pre-faulted when first allocated,
+ * so the page faults are paid once per pooled buffer instead of once per
+ * frame, and recycled frames keep RSS flat over long recordings.
+ */
+
+#define GST_TYPE_FRAME_POOL \
+(gst_frame_pool_get_type())
+
+#define GST_IS_FRAME_POOL(obj) \
+(G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_FRAME_POOL))
+
+GType gst_frame_pool_get_type(void);
+
+/* Unconfigured, like gst_buffer_pool_new(): set params and activate it, or
+ * hand it out in an allocation query.
+ */
+GstBufferPool* gst_frame_pool_new();
+
+/* Answer allocation queries sent out of src_pad with a frame pool of at
+ * least min_buffers, unless downstream already offered a pool. For raw
+ * video producers such as jpegdec that otherwise allocate per frame or
+ * from a pool sized for a single buffer.
+ */
+void gst_frame_pool_offer_on_pad(GstPad* src_pad, guint min_buffers);
+
+G_END_DECLS
+#endif /* framepool_h */
@@ -15,39 +15,156 @@
 #include <uv.h>
 #include <assert.h>
 #include "horseman.h"
-
-#define PUSH_SOCKET_ADDR "ipc:///tmp/ichabod-push"
-#define PULL_SOCKET_ADDR "ipc:///tmp/horseman-push"
+#include "ipc_endpoint.h"
+#include "horseman_capture.h"
 
 #define MESSAGE_TYPE_FRAME "frame"
+#define MESSAGE_TYPE_BINARY_FRAME "bframe"
 #define MESSAGE_TYPE_OUTPUT "output"
+#define MESSAGE_TYPE_HELLO "hello"
+
+/* Flow control, sent from ichabod to the horseman on the push socket:
+ *   ["credit", n]  the horseman may send n more frames
+ *   ["pause"]      stop capturing frames; outstanding credit is kept
+ *   ["resume"]     capture again, within the remaining credit
+ * Credit follows consumption: a frame is consumed once the dispatch loop
+ * has handed it to the pipeline (appsrc) or dropped it, and credit is only
+ * granted up to a window past the frames consumed. A horseman that honors
+ * it never has more than a window of frames between the socket and appsrc.
+ * Past appsrc, pause and resume (appsrc full, encoder lag) hold it back.
+ */
+#define MESSAGE_TYPE_CREDIT "credit"
+#define MESSAGE_TYPE_PAUSE "pause"
+#define MESSAGE_TYPE_RESUME "resume"
+#define CREDIT_WINDOW 16
 
 #define OUTPUT_TYPE_FILE "file"
 #define OUTPUT_TYPE_RTMP "rtmp"
 
+/* Binary frame message, selected by the hello handshake:
+ *   part 0: "bframe"
+ *   part 1: fixed header, little endian. Newer protocol versions may append
+ *           fields; header_size tells older readers how much to skip.
+ *   part 2: raw payload bytes (omitted for end-of-stream)
+ *
+ * offset  size  field
+ *      0     1  protocol version
+ *      1     1  payload format (BFRAME_FORMAT_*)
+ *      2     2  header_size
+ *      4     4  sequence number
+ *      8     8  capture timestamp (millis)
+ *     16     4  flags (BFRAME_FLAG_*)
+ *     20     4  reserved
+ *
+ * Raw pixel formats (protocol 2) extend the header. The payload holds the
+ * planes back to back, each stride * rows bytes; chroma planes of I420 and
+ * NV12 have (height + 1) / 2 rows.
+ *     24     4  width
+ *     28     4  height
+ *     32    12  stride of planes 0-2 in bytes (0 for unused planes)
+ *
+ * Tile updates (protocol 3) use the raw header with the canvas size in width
+ * and height (strides unused). The payload is a list of tiles, each a 24 byte
+ * record followed by its data:
+ *      0     4  x
+ *      4     4  y
+ *      8     4  width
+ *     12     4  height
+ *     16     1  format (BFRAME_FORMAT_JPEG, or BFRAME_FORMAT_BGRA packed at
+ *               4 * width bytes per row)
+ *     17     3  reserved
+ *     20     4  data length
+ */
+#define BFRAME_HEADER_MIN_SIZE 24
+#define BFRAME_RAW_HEADER_MIN_SIZE 44
+#define BFRAME_FORMAT_JPEG 1
+#define BFRAME_FORMAT_I420 2
+#define BFRAME_FORMAT_NV12 3
+#define BFRAME_FORMAT_BGRA 4
+#define BFRAME_FORMAT_TILES 5
+#define BFRAME_TILE_HEADER_SIZE 24
+#define BFRAME_FLAG_EOS (1 << 0)
+
+// Most parts any message type uses. Extra parts are received and dropped.
+#define ENVELOPE_MAX_PARTS 4
+
+// Message parts stay in their zmq_msg_t; nothing is copied on receive.
 struct envelope_s {
-  uint8_t* sz_data;
-  struct envelope_s* next;
+  zmq_msg_t parts[ENVELOPE_MAX_PARTS];
+  int count;
 };
 
 struct msg_dispatch_s {
-  uv_work_t work;
-  struct horseman_s* horseman;
   void* data;
   void (*callback_f)(struct horseman_s* horseman, void* data);
   void (*after_callback_f)(void* data);
+  // video frames may be dropped under load. EOS, outputs and tile updates
+  // (deltas onto a persistent canvas) may not.
+  char droppable;
+  // counts toward frames_consumed once handled or dropped
+  char is_frame;
+};
+
+// Must be a power of two; slot indices wrap with a mask
+#define DISPATCH_QUEUE_SIZE 64
+#define DISPATCH_QUEUE_MASK (DISPATCH_QUEUE_SIZE - 1)
+
+/* Bounded single-producer/single-consumer ring between the zmq thread
+ * (producer) and the dispatch loop thread (consumer). Messages come out in
+ * the order zmq delivered them. head is only written by the consumer, tail
+ * only by the producer; each side reads the other's index with acquire
+ * semantics, so no lock is needed.
+ */
+struct dispatch_queue_s {
+  struct msg_dispatch_s slots[DISPATCH_QUEUE_SIZE];
+  uint32_t head;
+  // keep the producer and consumer indices off the same cache line
+  char pad[64];
+  uint32_t tail;
 };
 
 struct horseman_s {
   void* zmq_ctx;
   void* pull_socket;
   void* push_socket;
+  char* pull_endpoint;
+  char* push_endpoint;
   char is_interrupted;
   uv_thread_t zmq_thread;
+  // zmq thread runloop: wakes on pull socket readiness or a stop request
+  uv_loop_t zmq_loop;
+  uv_poll_t zmq_poll;
+  uv_async_t zmq_async;
+
+  // every received message is recorded here when capture_path is set.
+  // zmq thread only.
+  char* capture_path;
+  struct horseman_capture_s* capture;
+
+  // frame protocol version announced by the horseman, 0 until it says hello.
+  // Binary frames newer than this are dropped. zmq thread only.
+  int frame_protocol;
+
+  // requested flow state, set from any thread by horseman_set_paused
+  char flow_paused;
+  // flow state as last told to the horseman. zmq thread only.
+  char sent_paused;
+  // frames the horseman may have sent in total: consumed plus the credit
+  // it still holds. zmq thread only.
+  uint64_t credit_limit;
+  // frames handled or dropped; credit is refilled against this
+  uint64_t frames_consumed;
   
-  // Atomic integer counts active jobs queued to uv loop
-  uv_mutex_t work_lock;
-  int64_t work_count;
+  struct dispatch_queue_s queue;
+  uv_async_t dispatch_async;
+
+  // written by the zmq thread, read anywhere with __atomic loads
+  uint64_t frames_received;
+  uint64_t frames_dropped;
+  uint32_t queue_high_water;
+  // written by the loop thread
+  uint64_t frames_coalesced;
+  char coalesce_frames;
 
   void (*on_video_frame)(struct horseman_s* horseman,
                        struct horseman_frame_s* frame, void* p);
@@ -55,27 +172,85 @@ struct horseman_s {
                             struct horseman_output_s* output, void* p);
   void* callback_p;
 
-  // Separate runloop for dispatching callbacks.
+  // Separate runloop for dispatching callbacks. Drains the queue.
   uv_loop_t* loop;
   uv_thread_t loop_thread;
   char is_running;
 };
 
-static void envelope_free(struct envelope_s* p) {
-  while (p) {
-    free(p->sz_data);
-    p->sz_data = NULL;
-    struct envelope_s* q = p;
-    p = p->next;
-    free(q);
+static void envelope_close(struct envelope_s* env) {
+  for (int i = 0; i < env->count; i++) {
+    zmq_msg_close(&env->parts[i]);
+  }
+  env->count = 0;
+}
+
+static const uint8_t* envelope_data(struct envelope_s* env, int i) {
+  return (const uint8_t*)zmq_msg_data(&env->parts[i]);
+}
+
+static size_t envelope_size(struct envelope_s* env, int i) {
+  return zmq_msg_size(&env->parts[i]);
+}
+
+static char envelope_part_is(struct envelope_s* env, int i, const char* sz) {
+  size_t len = strlen(sz);
+  return i < env->count && len == envelope_size(env, i) &&
+  !memcmp(sz, envelope_data(env, i), len);
+}
+
+// Copy a short text part to a heap C string
+static char* envelope_strdup(struct envelope_s* env, int i) {
+  size_t len = envelope_size(env, i);
+  char* sz = (char*)malloc(len + 1);
+  memcpy(sz, envelope_data(env, i), len);
+  sz[len] = '\0';
+  return sz;
+}
+
+static double envelope_atof(struct envelope_s* env, int i) {
+  char sz[64];
+  size_t len = envelope_size(env, i);
+  if (len >= sizeof(sz)) {
+    len = sizeof(sz) - 1;
   }
+  memcpy(sz, envelope_data(env, i), len);
+  sz[len] = '\0';
+  return atof(sz);
+}
+
+// Move a part out of the envelope so its data can outlive the message
+static zmq_msg_t* envelope_take_part(struct envelope_s* env, int i) {
+  zmq_msg_t* msg = (zmq_msg_t*)malloc(sizeof(zmq_msg_t));
+  zmq_msg_init(msg);
+  zmq_msg_move(msg, &env->parts[i]);
+  return msg;
+}
+
+static void frame_set_payload(struct horseman_frame_s* frame,
+                              zmq_msg_t* payload)
+{
+  frame->payload = payload;
+  frame->data = (const uint8_t*)zmq_msg_data(payload);
+  frame->data_length = zmq_msg_size(payload);
+}
+
+void* horseman_frame_take_payload(struct horseman_frame_s* frame) {
+  void* payload = frame->payload;
+  frame->payload = NULL;
+  return payload;
+}
+
+void horseman_payload_free(void* payload) {
+  zmq_msg_close((zmq_msg_t*)payload);
+  free(payload);
 }
 
 static void video_frame_free(void* p) {
   struct horseman_frame_s* frame = (struct horseman_frame_s*)p;
-  if (frame->sz_data) {
-    free((void*)frame->sz_data);
-    frame->sz_data = NULL;
+  if (frame->payload) {
+    horseman_payload_free(frame->payload);
+    frame->payload = NULL;
   }
   free(frame);
 }
@@ -85,6 +260,9 @@ static void output_free(void* p) {
   if (output->location) {
     free((void*)output->location);
   }
+  if (output->encoder) {
+    free((void*)output->encoder);
+  }
   free(output);
 }
 
@@ -98,208 +276,517 @@ static void async_output_callback(struct horseman_s* pthis, void* data) {
   pthis->on_output_request(pthis, output, pthis->callback_p);
 }
 
-// Warning: to prevent excess copying, parsers consume and free the envelope
-static struct horseman_frame_s* envelope_parse_frame(struct envelope_s** p) {
-  assert(*p);
+// Parsers move out the parts they keep. The caller still closes the envelope.
+static struct horseman_frame_s* envelope_parse_frame(struct envelope_s* env) {
+  if (env->count < 2) {
+    return NULL;
+  }
   struct horseman_frame_s* f = (struct horseman_frame_s*)
   calloc(1, sizeof(struct horseman_frame_s));
-  if (!strcmp("EOS", (const char*)(*p)->sz_data)) {
+  if (envelope_part_is(env, 1, "EOS")) {
     f->eos = 1;
+  } else if (env->count < 3) {
+    free(f);
+    f = NULL;
   } else {
-    assert((*p)->sz_data);
-    f->sz_data = (const char*)(*p)->sz_data;
-    // transfer ownership of frame data string
-    (*p)->sz_data = NULL;
-    assert((*p)->next);
-    assert((*p)->next->sz_data);
-    f->timestamp = atof((char*)(*p)->next->sz_data);
-  }
-  envelope_free(*p);
-  *p = NULL;
+    f->format = horseman_frame_format_base64_jpeg;
+    f->timestamp = envelope_atof(env, 2);
+    frame_set_payload(f, envelope_take_part(env, 1));
+  }
+  return f;
+}
+
+static uint16_t read_le16(const uint8_t* p) {
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+  return (uint32_t)read_le16(p) | ((uint32_t)read_le16(p + 2) << 16);
+}
+
+static uint64_t read_le64(const uint8_t* p) {
+  return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+// Returns NULL if the message is malformed, carries a payload format we
+// don't understand, or uses a protocol newer than the hello negotiated.
+static struct horseman_frame_s* envelope_parse_binary_frame
+(struct envelope_s* env, int protocol)
+{
+  if (env->count < 2 || envelope_size(env, 1) < BFRAME_HEADER_MIN_SIZE ||
+      read_le16(envelope_data(env, 1) + 2) < BFRAME_HEADER_MIN_SIZE)
+  {
+    printf("horseman: dropping binary frame with bad header\n");
+    return NULL;
+  }
+  const uint8_t* h = envelope_data(env, 1);
+  uint8_t format = h[1];
+  uint32_t flags = read_le32(h + 16);
+  struct horseman_frame_s* f = (struct horseman_frame_s*)
+  calloc(1, sizeof(struct horseman_frame_s));
+  f->sequence = read_le32(h + 4);
+  f->timestamp = (double)read_le64(h + 8);
+  if (flags & BFRAME_FLAG_EOS) {
+    f->eos = 1;
+    return f;
+  }
+  char known = 1;
+  char raw = 1;
+  // raw pixel formats arrived in protocol 2, tiles in 3
+  int required = 2;
+  switch (format) {
+    case BFRAME_FORMAT_JPEG:
+      f->format = horseman_frame_format_jpeg;
+      raw = 0;
+      required = 1;
+      break;
+    case BFRAME_FORMAT_I420:
+      f->format = horseman_frame_format_i420;
+      break;
+    case BFRAME_FORMAT_NV12:
+      f->format = horseman_frame_format_nv12;
+      break;
+    case BFRAME_FORMAT_BGRA:
+      f->format = horseman_frame_format_bgra;
+      break;
+    case BFRAME_FORMAT_TILES:
+      f->format = horseman_frame_format_tiles;
+      required = 3;
+      break;
+    default:
+      known = 0;
+      break;
+  }
+  if (known && (h[0] > protocol || required > protocol)) {
+    printf("horseman: dropping binary frame %u: protocol %d, format %d, "
+           "negotiated %d\n", f->sequence, h[0], format, protocol);
+    free(f);
+    return NULL;
+  }
+  if (!known || env->count < 3 ||
+      (raw && (envelope_size(env, 1) < BFRAME_RAW_HEADER_MIN_SIZE ||
+               read_le16(h + 2) < BFRAME_RAW_HEADER_MIN_SIZE)))
+  {
+    printf("horseman: dropping binary frame %u (format %d)\n",
+           f->sequence, format);
+    free(f);
+    return NULL;
+  }
+  if (raw) {
+    f->width = read_le32(h + 24);
+    f->height = read_le32(h + 28);
+    for (int i = 0; i < 3; i++) {
+      f->strides[i] = read_le32(h + 32 + 4 * i);
+    }
+  }
+  frame_set_payload(f, envelope_take_part(env, 2));
   return f;
 }
 
-static struct horseman_output_s* envelope_parse_output(struct envelope_s** p) {
-  assert(*p);
+int horseman_frame_next_tile(const struct horseman_frame_s* frame,
+                             size_t* offset, struct horseman_tile_s* tile)
+{
+  if (*offset == frame->data_length) {
+    return 0;
+  }
+  if (frame->data_length - *offset < BFRAME_TILE_HEADER_SIZE) {
+    return -1;
+  }
+  const uint8_t* t = frame->data + *offset;
+  size_t length = read_le32(t + 20);
+  if (frame->data_length - *offset - BFRAME_TILE_HEADER_SIZE < length) {
+    return -1;
+  }
+  switch (t[16]) {
+    case BFRAME_FORMAT_JPEG:
+      tile->format = horseman_frame_format_jpeg;
+      break;
+    case BFRAME_FORMAT_BGRA:
+      tile->format = horseman_frame_format_bgra;
+      break;
+    default:
+      return -1;
+  }
+  tile->x = read_le32(t);
+  tile->y = read_le32(t + 4);
+  tile->width = read_le32(t + 8);
+  tile->height = read_le32(t + 12);
+  tile->data = t + BFRAME_TILE_HEADER_SIZE;
+  tile->length = length;
+  *offset += BFRAME_TILE_HEADER_SIZE + length;
+  return 1;
+}
+
+static void envelope_parse_hello(struct horseman_s* pthis,
+                                 struct envelope_s* env)
+{
+  int version = 0;
+  if (env->count > 1) {
+    version = (int)envelope_atof(env, 1);
+  }
+  if (version > HORSEMAN_FRAME_PROTOCOL_VERSION) {
+    version = HORSEMAN_FRAME_PROTOCOL_VERSION;
+  }
+  printf("horseman: peer hello, using frame protocol %d\n", version);
+  pthis->frame_protocol = version;
+}
+
+static struct horseman_output_s* envelope_parse_output(struct envelope_s* env)
+{
+  if (env->count < 3) {
+    return NULL;
+  }
   struct horseman_output_s* output = (struct horseman_output_s*)
   calloc(1, sizeof(struct horseman_output_s));
-  assert((*p)->sz_data);
-  const char* sz_output_type = (const char*)(*p)->sz_data;
-  if (!strcmp(OUTPUT_TYPE_FILE, sz_output_type)) {
+  if (envelope_part_is(env, 1, OUTPUT_TYPE_FILE)) {
     output->output_type = horseman_output_type_file;
-  } else if (!strcmp(OUTPUT_TYPE_RTMP, sz_output_type)) {
+  } else if (envelope_part_is(env, 1, OUTPUT_TYPE_RTMP)) {
     output->output_type = horseman_output_type_rtmp;
   }
-  (*p)->sz_data = NULL;
-  assert((*p)->next);
-  assert((*p)->next->sz_data);
-  output->location = (const char*)(*p)->next->sz_data;
-  (*p)->next->sz_data = NULL;
-  envelope_free(*p);
-  *p = NULL;
+  output->location = envelope_strdup(env, 2);
+  if (env->count > 3) {
+    output->encoder = envelope_strdup(env, 3);
+  }
   return output;
 }
 
 static void horseman_loop_main(void* p) {
   struct horseman_s* pthis = (struct horseman_s*)p;
-  int ret = 0;
-  while (pthis->is_running && 0 == ret) {
-    ret = uv_run(pthis->loop, UV_RUN_DEFAULT);
-    // TODO: should this be a poll instead of a busywait?
-    usleep(1000);
-  }
+  // blocks until horseman_stop closes the dispatch handle
+  uv_run(pthis->loop, UV_RUN_DEFAULT);
   printf("horseman: exiting worker loop\n");
 }
 
-void decrement_work_count(struct horseman_s* pthis) {
-  uv_mutex_lock(&pthis->work_lock);
-  pthis->work_count = 0;
-  uv_mutex_unlock(&pthis->work_lock);
+#pragma mark - Dispatch queue
+
+// Producer side. Returns queue depth after the push, or 0 if the queue is full.
+static uint32_t dispatch_queue_push(struct dispatch_queue_s* q,
+                                    struct msg_dispatch_s* msg)
+{
+  uint32_t tail = q->tail;
+  uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  if (tail - head >= DISPATCH_QUEUE_SIZE) {
+    return 0;
+  }
+  q->slots[tail & DISPATCH_QUEUE_MASK] = *msg;
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return tail + 1 - head;
+}
+
+// Consumer side. Returns nonzero if a message was popped into msg.
+static int dispatch_queue_pop(struct dispatch_queue_s* q,
+                              struct msg_dispatch_s* msg)
+{
+  uint32_t head = q->head;
+  uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return 0;
+  }
+  *msg = q->slots[head & DISPATCH_QUEUE_MASK];
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
 }
 
-void increment_work_count(struct horseman_s* pthis) {
-  uv_mutex_lock(&pthis->work_lock);
-  pthis->work_count++;
-  uv_mutex_unlock(&pthis->work_lock);
+// Consumer side. Next message to be popped, or NULL if the queue is empty.
+static struct msg_dispatch_s* dispatch_queue_peek(struct dispatch_queue_s* q)
+{
+  uint32_t head = q->head;
+  uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return NULL;
+  }
+  return &q->slots[head & DISPATCH_QUEUE_MASK];
 }
 
-int64_t get_work_count(struct horseman_s* pthis) {
-  int64_t ret = 0;
-  uv_mutex_lock(&pthis->work_lock);
-  ret = pthis->work_count;
-  uv_mutex_unlock(&pthis->work_lock);
-  return ret;
+static uint32_t dispatch_queue_depth(struct dispatch_queue_s* q) {
+  uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  return tail - head;
 }
 
-static void issue_callback(uv_work_t* work) {
-  struct msg_dispatch_s* async_msg = (struct msg_dispatch_s*) work->data;
-  struct horseman_s* pthis = async_msg->horseman;
-  if (async_msg->callback_f) {
-    async_msg->callback_f(pthis, async_msg->data);
+// Runs on the loop thread whenever the zmq thread has queued something.
+static void on_dispatch_async(uv_async_t* handle) {
+  struct horseman_s* pthis = (struct horseman_s*)handle->data;
+  struct msg_dispatch_s msg;
+  uint64_t consumed = 0;
+  while (dispatch_queue_pop(&pthis->queue, &msg)) {
+    struct msg_dispatch_s* next = dispatch_queue_peek(&pthis->queue);
+    if (pthis->coalesce_frames && msg.droppable && next && next->droppable) {
+      // a newer frame is already waiting: skip this one before any decoding.
+      // tile updates are never droppable, so every one gets applied.
+      __atomic_add_fetch(&pthis->frames_coalesced, 1, __ATOMIC_RELAXED);
+    } else {
+      msg.callback_f(pthis, msg.data);
+    }
+    msg.after_callback_f(msg.data);
+    consumed += msg.is_frame;
+  }
+  if (consumed) {
+    __atomic_add_fetch(&pthis->frames_consumed, consumed, __ATOMIC_RELEASE);
+    if (!pthis->is_interrupted) {
+      // the zmq thread owns the push socket; let it send the new credit
+      uv_async_send(&pthis->zmq_async);
+    }
+  }
+  if (!pthis->is_running) {
+    // last wakeup: let uv_run return once the handle is gone
+    uv_close((uv_handle_t*)handle, NULL);
   }
 }
 
-static void after_issue_callback(uv_work_t* work, int status) {
-  struct msg_dispatch_s* msg = (struct msg_dispatch_s*) work->data;
-  msg->after_callback_f(msg->data);
-  decrement_work_count(msg->horseman);
+/* Hand a message to the loop thread. Frames are dropped if the queue is
+ * full; control messages (outputs, EOS) and tile updates wait for room
+ * instead.
+ */
+static void dispatch(struct horseman_s* pthis, struct msg_dispatch_s* msg) {
+  uint32_t depth;
+  while (!(depth = dispatch_queue_push(&pthis->queue, msg))) {
+    if (msg->droppable || !pthis->is_running) {
+      __atomic_add_fetch(&pthis->frames_dropped, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pthis->frames_consumed, msg->is_frame,
+                         __ATOMIC_RELEASE);
+      msg->after_callback_f(msg->data);
+      return;
+    }
+    usleep(1000);
+  }
+  if (depth > pthis->queue_high_water) {
+    __atomic_store_n(&pthis->queue_high_water, depth, __ATOMIC_RELAXED);
+  }
+  uv_async_send(&pthis->dispatch_async);
 }
 
-static int receive_message(void* socket, struct envelope_s** msg_p,
+#pragma mark - Message handling
+
+static int receive_message(void* socket, struct envelope_s* env,
                            char* got_message)
 {
-  struct envelope_s* root_env = (struct envelope_s*)
-  calloc(1, sizeof(struct envelope_s));
-  struct envelope_s* env_p = root_env;
-  int ret;
+  int ret = 0;
+  zmq_msg_t overflow;
+  env->count = 0;
+  *got_message = 0;
   while (1) {
-    zmq_msg_t message;
-    ret = zmq_msg_init (&message);
-    ret = zmq_msg_recv (&message, socket, 0);
-    if (ret < 0 && EAGAIN == errno) {
-      *got_message = 0;
-      zmq_msg_close(&message);
+    zmq_msg_t* message = &overflow;
+    if (env->count < ENVELOPE_MAX_PARTS) {
+      message = &env->parts[env->count];
+    }
+    zmq_msg_init(message);
+    ret = zmq_msg_recv(message, socket, ZMQ_DONTWAIT);
+    if (ret < 0) {
+      zmq_msg_close(message);
+      ret = (EAGAIN == errno) ? 0 : ret;
       break;
     }
+    ret = 0;
     *got_message = 1;
 
-    // Copy message frame(s) to C string for easier downstream handling (atof)
-    uint8_t* sz_msg = (uint8_t*)malloc(zmq_msg_size(&message) + 1);
-    memcpy(sz_msg, zmq_msg_data(&message), zmq_msg_size(&message));
-    sz_msg[zmq_msg_size(&message)] = '\0';
-
-    if (env_p->sz_data) {
-      env_p->next = (struct envelope_s*) calloc(1, sizeof(struct envelope_s));
-      env_p = env_p->next;
+    int more = zmq_msg_more(message);
+    if (message == &overflow) {
+      zmq_msg_close(message);
+    } else {
+      env->count++;
     }
-    env_p->sz_data = (uint8_t*)sz_msg;
-
-    zmq_msg_close(&message);
-    if (!zmq_msg_more(&message))
+    if (!more)
       break;      //  Last message frame
   }
 
-  if (*got_message) {
-    *msg_p = root_env;
-  } else {
-    envelope_free(root_env);
-    *msg_p = NULL;
-  }
-
-  return 0;
+  return ret;
 }
 
-static void parse_envelope(struct horseman_s* pthis, struct envelope_s* msg) {
-  int ret = -1;
-  struct msg_dispatch_s* async_msg = (struct msg_dispatch_s*)
-  calloc(1, sizeof(struct msg_dispatch_s));
-  async_msg->horseman = pthis;
-  async_msg->work.data = async_msg;
+static void parse_envelope(struct horseman_s* pthis, struct envelope_s* msg,
+                           uint64_t received_ns)
+{
+  struct msg_dispatch_s async_msg = { 0 };
+  struct horseman_frame_s* frame = NULL;
+  struct horseman_output_s* output = NULL;
+  if (envelope_part_is(msg, 0, MESSAGE_TYPE_FRAME)) {
+    frame = envelope_parse_frame(msg);
+  } else if (envelope_part_is(msg, 0, MESSAGE_TYPE_BINARY_FRAME)) {
+    frame = envelope_parse_binary_frame(msg, pthis->frame_protocol);
+  } else if (envelope_part_is(msg, 0, MESSAGE_TYPE_OUTPUT)) {
+    output = envelope_parse_output(msg);
+  } else if (envelope_part_is(msg, 0, MESSAGE_TYPE_HELLO)) {
+    envelope_parse_hello(pthis, msg);
+  }
 
-  if (!strcmp(MESSAGE_TYPE_FRAME, (char*)msg->sz_data)) {
-    struct horseman_frame_s* frame = envelope_parse_frame(&msg->next);
+  if (frame) {
+    frame->received_ns = received_ns;
+    frame->parsed_ns = uv_hrtime();
+    __atomic_add_fetch(&pthis->frames_received, 1, __ATOMIC_RELAXED);
     if (frame->eos) {
       // let the async callback post, but later break the main receiver loop
       pthis->is_interrupted = 1;
     }
-    async_msg->data = frame;
-    async_msg->callback_f = async_video_frame_callback;
-    async_msg->after_callback_f = video_frame_free;
-  } else if (!strcmp(MESSAGE_TYPE_OUTPUT, (char*)msg->sz_data)) {
-    struct horseman_output_s* output = envelope_parse_output(&msg->next);
-    async_msg->data = output;
-    async_msg->callback_f = async_output_callback;
-    async_msg->after_callback_f = output_free;
-  } else {
-    free(async_msg);
-    async_msg = NULL;
+    async_msg.data = frame;
+    async_msg.callback_f = async_video_frame_callback;
+    async_msg.after_callback_f = video_frame_free;
+    // losing a tile would leave its region stale until it's repainted
+    async_msg.droppable = !frame->eos &&
+    horseman_frame_format_tiles != frame->format;
+    async_msg.is_frame = 1;
+    dispatch(pthis, &async_msg);
+  } else if (output) {
+    async_msg.data = output;
+    async_msg.callback_f = async_output_callback;
+    async_msg.after_callback_f = output_free;
+    dispatch(pthis, &async_msg);
   }
+}
 
-  if (async_msg) {
-    increment_work_count(pthis);
-    ret = uv_queue_work(pthis->loop, &async_msg->work,
-                        issue_callback, after_issue_callback);
+static void capture_envelope(struct horseman_s* pthis, struct envelope_s* env)
+{
+  const void* parts[ENVELOPE_MAX_PARTS];
+  size_t sizes[ENVELOPE_MAX_PARTS];
+  for (int i = 0; i < env->count; i++) {
+    parts[i] = envelope_data(env, i);
+    sizes[i] = envelope_size(env, i);
   }
-
-  if (async_msg && ret) {
-    // job rejected. don't wait for after_msg to fire
-    decrement_work_count(pthis);
-    // force the free function for this callback, since it won't run async
-    async_msg->after_callback_f(async_msg->data);
+  if (horseman_capture_write(pthis->capture, horseman_capture_now_us(),
+                             env->count, parts, sizes))
+  {
+    printf("horseman: capture write failed, capture stopped\n");
+    horseman_capture_close(pthis->capture);
+    pthis->capture = NULL;
   }
 }
 
 static int process_next_message(struct horseman_s* pthis) {
   char got_message = 0;
-  struct envelope_s* msg = NULL;
-  // wait for zmq message
+  struct envelope_s msg;
   int ret = receive_message(pthis->pull_socket, &msg, &got_message);
+  uint64_t received_ns = uv_hrtime();
   // process message
   if (ret) {
     printf("horseman: trouble in zmq? %d %d\n", ret, errno);
   }
+  if (got_message && pthis->capture) {
+    // before parsing: parsers move parts out of the envelope
+    capture_envelope(pthis, &msg);
+  }
   if (got_message) {
-    parse_envelope(pthis, msg);
-    envelope_free(msg);
+    parse_envelope(pthis, &msg, received_ns);
   }
+  envelope_close(&msg);
   return ret;
 }
 
+// Best effort: if the horseman isn't listening there's nobody to tell.
+static int send_message(struct horseman_s* pthis, const char* type,
+                        const char* arg)
+{
+  int ret = zmq_send(pthis->push_socket, type, strlen(type),
+                     ZMQ_DONTWAIT | (arg ? ZMQ_SNDMORE : 0));
+  if (ret >= 0 && arg) {
+    ret = zmq_send(pthis->push_socket, arg, strlen(arg), ZMQ_DONTWAIT);
+  }
+  if (ret < 0) {
+    printf("horseman: failed to send %s. errno %d\n", type, errno);
+  }
+  return ret < 0;
+}
+
+// Advertise the newest frame protocol we understand. The horseman keeps
+// sending text frames until it sees this, so older peers are unaffected.
+static void send_hello(struct horseman_s* pthis) {
+  char sz_version[16];
+  sprintf(sz_version, "%d", HORSEMAN_FRAME_PROTOCOL_VERSION);
+  send_message(pthis, MESSAGE_TYPE_HELLO, sz_version);
+}
+
+// zmq thread only. Tell the horseman about pause changes and refill credit.
+static void update_flow(struct horseman_s* pthis) {
+  char paused = __atomic_load_n(&pthis->flow_paused, __ATOMIC_ACQUIRE);
+  if (paused != pthis->sent_paused &&
+      !send_message(pthis, paused ? MESSAGE_TYPE_PAUSE : MESSAGE_TYPE_RESUME,
+                    NULL))
+  {
+    printf("horseman: flow %s\n", paused ? "paused" : "resumed");
+    pthis->sent_paused = paused;
+  }
+  // top up once half a window has been consumed since the last grant
+  uint64_t limit =
+  __atomic_load_n(&pthis->frames_consumed, __ATOMIC_ACQUIRE) + CREDIT_WINDOW;
+  if (!paused && limit >= pthis->credit_limit + CREDIT_WINDOW / 2) {
+    char sz_credit[32];
+    sprintf(sz_credit, "%lu", (unsigned long)(limit - pthis->credit_limit));
+    if (!send_message(pthis, MESSAGE_TYPE_CREDIT, sz_credit)) {
+      pthis->credit_limit = limit;
+    }
+  }
+}
+
+/* ZMQ_FD only signals edges, so every wakeup has to drain the socket until
+ * it would block; otherwise queued messages sit there until the next one.
+ */
+static void on_pull_socket_ready(uv_poll_t* handle, int status, int events) {
+  struct horseman_s* pthis = (struct horseman_s*)handle->data;
+  int zmq_events;
+  size_t events_size = sizeof(zmq_events);
+  while (!pthis->is_interrupted) {
+    zmq_getsockopt(pthis->pull_socket, ZMQ_EVENTS, &zmq_events, &events_size);
+    if (!(zmq_events & ZMQ_POLLIN)) {
+      break;
+    }
+    if (process_next_message(pthis)) {
+      break;
+    }
+  }
+  update_flow(pthis);
+  if (pthis->is_interrupted) {
+    // end of stream: stop reading, but leave teardown to horseman_stop
+    uv_poll_stop(handle);
+  }
+}
+
+static void on_zmq_async(uv_async_t* handle) {
+  struct horseman_s* pthis = (struct horseman_s*)handle->data;
+  if (pthis->is_interrupted) {
+    uv_close((uv_handle_t*)&pthis->zmq_poll, NULL);
+    uv_close((uv_handle_t*)handle, NULL);
+  } else {
+    update_flow(pthis);
+  }
+}
+
 static void horseman_zmq_main(void* p) {
   int ret;
   printf("media queue is online %p\n", p);
   struct horseman_s* pthis = (struct horseman_s*)p;
-  int t = 10;
-  ret = zmq_connect(pthis->pull_socket, PULL_SOCKET_ADDR);
+  if (pthis->capture_path &&
+      horseman_capture_open_write(&pthis->capture, pthis->capture_path))
+  {
+    printf("horseman: cannot open capture file %s. errno %d\n",
+           pthis->capture_path, errno);
+  }
+  ret = zmq_connect(pthis->pull_socket, pthis->pull_endpoint);
   if (ret) {
-    printf("failed to connect to media queue socket. errno %d\n", errno);
-    return;
+    printf("failed to connect to media queue socket %s. errno %d\n",
+           pthis->pull_endpoint, errno);
+  } else {
+    uv_poll_start(&pthis->zmq_poll, UV_READABLE, on_pull_socket_ready);
+    // messages may have arrived before the poll was armed
+    on_pull_socket_ready(&pthis->zmq_poll, 0, UV_READABLE);
   }
-  ret = zmq_setsockopt(pthis->pull_socket, ZMQ_RCVTIMEO, &t, sizeof(int));
-  while (!pthis->is_interrupted) {
-    ret = process_next_message(pthis);
+  ret = zmq_connect(pthis->push_socket, pthis->push_endpoint);
+  if (ret) {
+    // not fatal: without a back channel the horseman stays on text frames
+    printf("failed to connect to horseman push socket %s. errno %d\n",
+           pthis->push_endpoint, errno);
+  } else {
+    send_hello(pthis);
+    update_flow(pthis);
+  }
+  // runs until horseman_stop closes our handles
+  uv_run(&pthis->zmq_loop, UV_RUN_DEFAULT);
+  uv_loop_close(&pthis->zmq_loop);
+  if (pthis->capture) {
+    horseman_capture_close(pthis->capture);
+    pthis->capture = NULL;
   }
   zmq_close(pthis->pull_socket);
+  zmq_close(pthis->push_socket);
+  pthis->pull_socket = NULL;
+  pthis->push_socket = NULL;
 }
 
 void horseman_load_config(struct horseman_s* pthis,
@@ -308,6 +795,23 @@ void horseman_load_config(struct horseman_s* pthis,
   pthis->on_video_frame = config->on_video_frame;
   pthis->on_output_request = config->on_output_request;
   pthis->callback_p = config->p;
+  pthis->coalesce_frames = config->coalesce_frames;
+  free(pthis->capture_path);
+  pthis->capture_path =
+  config->capture_path ? strdup(config->capture_path) : NULL;
+
+  free(pthis->pull_endpoint);
+  free(pthis->push_endpoint);
+  pthis->pull_endpoint =
+  ipc_endpoint_resolve(config->pull_endpoint,
+                       HORSEMAN_SESSION_PULL_ENDPOINT,
+                       HORSEMAN_DEFAULT_PULL_ENDPOINT,
+                       config->session_id);
+  pthis->push_endpoint =
+  ipc_endpoint_resolve(config->push_endpoint,
+                       HORSEMAN_SESSION_PUSH_ENDPOINT,
+                       HORSEMAN_DEFAULT_PUSH_ENDPOINT,
+                       config->session_id);
 }
 
 int horseman_alloc(struct horseman_s** queue) {
@@ -315,28 +819,54 @@ int horseman_alloc(struct horseman_s** queue) {
   (struct horseman_s*)calloc(1, sizeof(struct horseman_s));
   pthis->zmq_ctx = zmq_ctx_new();
   pthis->pull_socket = zmq_socket(pthis->zmq_ctx, ZMQ_PULL);
-  uv_mutex_init(&pthis->work_lock);
-  
+  pthis->push_socket = zmq_socket(pthis->zmq_ctx, ZMQ_PUSH);
+  // don't hold up shutdown on messages the horseman never picked up
+  int linger = 0;
+  zmq_setsockopt(pthis->push_socket, ZMQ_LINGER, &linger, sizeof(linger));
+
   pthis->loop = (uv_loop_t*) malloc(sizeof(uv_loop_t));
-  uv_loop_init(pthis->loop);
+  pthis->pull_endpoint = strdup(HORSEMAN_DEFAULT_PULL_ENDPOINT);
+  pthis->push_endpoint = strdup(HORSEMAN_DEFAULT_PUSH_ENDPOINT);
 
   *queue = pthis;
   return 0;
 }
 
 void horseman_free(struct horseman_s* pthis) {
-  pthis->is_running = 0;
-  uv_stop(pthis->loop);
+  horseman_stop(pthis);
+  // never started: the sockets are still ours, and would block ctx_destroy
+  if (pthis->pull_socket) {
+    zmq_close(pthis->pull_socket);
+  }
+  if (pthis->push_socket) {
+    zmq_close(pthis->push_socket);
+  }
   free(pthis->loop);
-  uv_thread_join(&pthis->zmq_thread);
+  free(pthis->pull_endpoint);
+  free(pthis->push_endpoint);
+  free(pthis->capture_path);
   zmq_ctx_destroy(pthis->zmq_ctx);
-  uv_mutex_destroy(&pthis->work_lock);
   free(pthis);
 }
 
 int horseman_start(struct horseman_s* pthis) {
   pthis->is_interrupted = 0;
   pthis->is_running = 1;
+  pthis->credit_limit = 0;
+  pthis->frames_consumed = 0;
+  pthis->sent_paused = 0;
+  uv_loop_init(pthis->loop);
+  uv_async_init(pthis->loop, &pthis->dispatch_async, on_dispatch_async);
+  pthis->dispatch_async.data = pthis;
+
+  int fd;
+  size_t fd_size = sizeof(fd);
+  zmq_getsockopt(pthis->pull_socket, ZMQ_FD, &fd, &fd_size);
+  uv_loop_init(&pthis->zmq_loop);
+  uv_async_init(&pthis->zmq_loop, &pthis->zmq_async, on_zmq_async);
+  pthis->zmq_async.data = pthis;
+  uv_poll_init(&pthis->zmq_loop, &pthis->zmq_poll, fd);
+  pthis->zmq_poll.data = pthis;
   int ret = uv_thread_create(&pthis->zmq_thread, horseman_zmq_main, pthis);
   int get = uv_thread_create(&pthis->loop_thread, horseman_loop_main, pthis);
   return ret | get;
@@ -347,21 +877,38 @@ int horseman_stop(struct horseman_s* pthis) {
   if (!pthis->is_running) {
     return -1;
   }
+  // stop the producer first, so nothing lands in the queue after the drain
   pthis->is_interrupted = 1;
-  pthis->is_running = 0;
-  int drain_count = 0;
-  // drain the work queue before calling uv_loop_close.
-  // don't wait for more than a second.
-  // _loop_close will crash if there are executing jobs, but at this point
-  // there's not much we can do about it
-  while (get_work_count(pthis) > 0 && drain_count < 1000) {
-    usleep(1000);
-  }
-  do {
-      ret = uv_loop_close(pthis->loop);
-  } while (UV_EBUSY == ret);
-  pthis->loop = NULL;
+  uv_async_send(&pthis->zmq_async);
   ret = uv_thread_join(&pthis->zmq_thread);
+  // final wakeup drains whatever is left and closes the async handle
+  pthis->is_running = 0;
+  uv_async_send(&pthis->dispatch_async);
   int get = uv_thread_join(&pthis->loop_thread);
+  uv_loop_close(pthis->loop);
   return ret | get;
 }
+
+void horseman_get_stats(struct horseman_s* pthis,
+                        struct horseman_stats_s* stats)
+{
+  stats->frames_received =
+  __atomic_load_n(&pthis->frames_received, __ATOMIC_RELAXED);
+  stats->frames_dropped =
+  __atomic_load_n(&pthis->frames_dropped, __ATOMIC_RELAXED);
+  stats->frames_coalesced =
+  __atomic_load_n(&pthis->frames_coalesced, __ATOMIC_RELAXED);
+  stats->queue_depth = dispatch_queue_depth(&pthis->queue);
+  stats->queue_high_water =
+  __atomic_load_n(&pthis->queue_high_water, __ATOMIC_RELAXED);
+  stats->queue_capacity = DISPATCH_QUEUE_SIZE;
+}
+
+void horseman_set_paused(struct horseman_s* pthis, char paused) {
+  char was_paused =
+  __atomic_exchange_n(&pthis->flow_paused, paused, __ATOMIC_ACQ_REL);
+  if (was_paused != paused && pthis->is_running) {
+    // the push socket belongs to the zmq thread; let it send the update
+    uv_async_send(&pthis->zmq_async);
+  }
+}
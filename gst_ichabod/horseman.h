@@ -12,12 +12,56 @@
  * Message broker between this process and the horseman, via ZMQ.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct horseman_s;
 
+/* Frame protocol version advertised in the hello handshake. Version 0 is the
+ * legacy text protocol (base64 payload, decimal timestamp). Version 1 adds
+ * the binary frame message. Version 2 adds raw pixel payloads to it, and
+ * version 3 tile updates (dirty rectangles of a persistent canvas).
+ */
+#define HORSEMAN_FRAME_PROTOCOL_VERSION 3
+
+/* We connect to the pull endpoint for frames and output requests, and to the
+ * push endpoint for the back channel (hello, flow control). The session
+ * variants are used when a session id is configured; see ipc_endpoint.h.
+ */
+#define HORSEMAN_DEFAULT_PULL_ENDPOINT "ipc:///tmp/horseman-push"
+#define HORSEMAN_DEFAULT_PUSH_ENDPOINT "ipc:///tmp/ichabod-push"
+#define HORSEMAN_SESSION_PULL_ENDPOINT "ipc:///tmp/horseman-push-{session}"
+#define HORSEMAN_SESSION_PUSH_ENDPOINT "ipc:///tmp/ichabod-push-{session}"
+
+enum horseman_frame_format {
+  horseman_frame_format_base64_jpeg = 0,
+  horseman_frame_format_jpeg,
+  // raw pixels, planes back to back; see width, height and strides
+  horseman_frame_format_i420,
+  horseman_frame_format_nv12,
+  horseman_frame_format_bgra,
+  // updated rectangles of a width x height canvas; see horseman_frame_next_tile
+  horseman_frame_format_tiles
+};
+
 struct horseman_frame_s {
-  const char* sz_data;
+  enum horseman_frame_format format;
+  // Payload as received: base64 text for legacy frames, raw bytes otherwise.
+  // Not NUL-terminated. Valid as long as the frame owns its payload.
+  const uint8_t* data;
+  size_t data_length;
+  // opaque owner of data, see horseman_frame_take_payload
+  void* payload;
+  uint32_t sequence;
   double timestamp;
   char eos;
+  // raw formats and tiles (canvas size). unused planes have stride 0.
+  uint32_t width;
+  uint32_t height;
+  uint32_t strides[3];
+  // uv_hrtime() when the message came off the socket and when it was parsed
+  uint64_t received_ns;
+  uint64_t parsed_ns;
 };
 
 enum horseman_output_type {
@@ -29,6 +73,8 @@ enum horseman_output_type {
 struct horseman_output_s {
   enum horseman_output_type output_type;
   const char* location;
+  // optional fourth part: an encoder_backend name for this output's video
+  const char* encoder;
 };
 
 struct horseman_config_s {
@@ -38,6 +84,54 @@ struct horseman_config_s {
   void (*on_output_request)(struct horseman_s* horseman,
                             struct horseman_output_s* output, void* p);
   void* p;
+  /* Latest frame wins: when a newer frame is already queued behind the one
+   * about to be dispatched, drop the older one instead of delivering it.
+   */
+  char coalesce_frames;
+  // optional; endpoint templates may contain {session}
+  const char* session_id;
+  const char* pull_endpoint;
+  const char* push_endpoint;
+  // optional; record every received message here (see horseman_capture.h)
+  const char* capture_path;
+};
+
+/* Take ownership of the received message backing frame->data, so the bytes
+ * can be handed downstream without a copy. Release with horseman_payload_free
+ * (safe to use as a GDestroyNotify).
+ */
+void* horseman_frame_take_payload(struct horseman_frame_s* frame);
+void horseman_payload_free(void* payload);
+
+// One updated rectangle of a tiles frame. data points into the frame payload.
+struct horseman_tile_s {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+  // horseman_frame_format_jpeg, or _bgra packed at 4 * width per row
+  enum horseman_frame_format format;
+  const uint8_t* data;
+  size_t length;
+};
+
+/* Walk the tiles of a horseman_frame_format_tiles frame. Start with *offset
+ * at 0. Returns 1 and fills tile while there are tiles, 0 at the end and -1
+ * if the rest of the payload is malformed.
+ */
+int horseman_frame_next_tile(const struct horseman_frame_s* frame,
+                             size_t* offset, struct horseman_tile_s* tile);
+
+struct horseman_stats_s {
+  uint64_t frames_received;
+  // frames dropped because the dispatch queue was full
+  uint64_t frames_dropped;
+  // frames skipped in favor of a newer one (coalesce_frames)
+  uint64_t frames_coalesced;
+  // frames received but not yet handed to on_video_frame
+  uint32_t queue_depth;
+  uint32_t queue_high_water;
+  uint32_t queue_capacity;
 };
 
 int horseman_alloc(struct horseman_s** queue);
@@ -48,4 +142,12 @@ void horseman_free(struct horseman_s* queue);
 int horseman_start(struct horseman_s* queue);
 int horseman_stop(struct horseman_s* queue);
 
+/* Ask the horseman to stop (or resume) capturing frames. Safe to call from
+ * any thread; the request goes out on the back channel.
+ */
+void horseman_set_paused(struct horseman_s* horseman, char paused);
+
+void horseman_get_stats(struct horseman_s* horseman,
+                        struct horseman_stats_s* stats);
+
 #endif /* horseman_h */
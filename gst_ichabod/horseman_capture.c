@@ -0,0 +1,148 @@
+//
+//  horseman_capture.c
+//  gst_ichabod
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "horseman_capture.h"
+
+// Captures run at screencast bitrates; don't hit the disk per message
+#define CAPTURE_WRITE_BUFFER (1 << 20)
+
+struct horseman_capture_s {
+  FILE* file;
+  char* write_buffer;
+  // read side: holds the current record's parts
+  uint8_t* read_buffer;
+  size_t read_buffer_size;
+};
+
+static void write_le(uint8_t* p, uint64_t value, int size) {
+  for (int i = 0; i < size; i++) {
+    p[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint64_t read_le(const uint8_t* p, int size) {
+  uint64_t value = 0;
+  for (int i = size - 1; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+uint64_t horseman_capture_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int horseman_capture_open_write(struct horseman_capture_s** capture_out,
+                                const char* path)
+{
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+  struct horseman_capture_s* pthis =
+  (struct horseman_capture_s*)calloc(1, sizeof(struct horseman_capture_s));
+  pthis->file = file;
+  pthis->write_buffer = (char*)malloc(CAPTURE_WRITE_BUFFER);
+  setvbuf(file, pthis->write_buffer, _IOFBF, CAPTURE_WRITE_BUFFER);
+  fwrite(HORSEMAN_CAPTURE_MAGIC, 1, strlen(HORSEMAN_CAPTURE_MAGIC), file);
+  *capture_out = pthis;
+  return 0;
+}
+
+int horseman_capture_open_read(struct horseman_capture_s** capture_out,
+                               const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  char magic[sizeof(HORSEMAN_CAPTURE_MAGIC)] = { 0 };
+  size_t magic_length = strlen(HORSEMAN_CAPTURE_MAGIC);
+  if (fread(magic, 1, magic_length, file) != magic_length ||
+      memcmp(magic, HORSEMAN_CAPTURE_MAGIC, magic_length))
+  {
+    fclose(file);
+    return -1;
+  }
+  struct horseman_capture_s* pthis =
+  (struct horseman_capture_s*)calloc(1, sizeof(struct horseman_capture_s));
+  pthis->file = file;
+  *capture_out = pthis;
+  return 0;
+}
+
+void horseman_capture_close(struct horseman_capture_s* pthis) {
+  fclose(pthis->file);
+  free(pthis->write_buffer);
+  free(pthis->read_buffer);
+  free(pthis);
+}
+
+int horseman_capture_write(struct horseman_capture_s* pthis,
+                           uint64_t arrival_us, int count,
+                           const void** parts, const size_t* sizes)
+{
+  uint8_t header[9];
+  if (count > HORSEMAN_CAPTURE_MAX_PARTS) {
+    count = HORSEMAN_CAPTURE_MAX_PARTS;
+  }
+  write_le(header, arrival_us, 8);
+  header[8] = (uint8_t)count;
+  int ok = fwrite(header, sizeof(header), 1, pthis->file) == 1;
+  for (int i = 0; ok && i < count; i++) {
+    uint8_t size[4];
+    write_le(size, sizes[i], 4);
+    ok = fwrite(size, sizeof(size), 1, pthis->file) == 1 &&
+    (!sizes[i] || fwrite(parts[i], sizes[i], 1, pthis->file) == 1);
+  }
+  return ok ? 0 : -1;
+}
+
+int horseman_capture_read(struct horseman_capture_s* pthis,
+                          struct horseman_capture_record_s* record)
+{
+  uint8_t header[9];
+  if (fread(header, sizeof(header), 1, pthis->file) != 1) {
+    return 0;
+  }
+  record->arrival_us = read_le(header, 8);
+  record->count = header[8];
+  if (record->count > HORSEMAN_CAPTURE_MAX_PARTS) {
+    return -1;
+  }
+  size_t used = 0;
+  size_t offsets[HORSEMAN_CAPTURE_MAX_PARTS];
+  for (int i = 0; i < record->count; i++) {
+    uint8_t size[4];
+    if (fread(size, sizeof(size), 1, pthis->file) != 1) {
+      return 0;
+    }
+    record->sizes[i] = read_le(size, 4);
+    if (used + record->sizes[i] > pthis->read_buffer_size) {
+      size_t capacity = (used + record->sizes[i]) * 2;
+      pthis->read_buffer = (uint8_t*)realloc(pthis->read_buffer, capacity);
+      pthis->read_buffer_size = capacity;
+    }
+    if (record->sizes[i] &&
+        fread(pthis->read_buffer + used, record->sizes[i], 1,
+              pthis->file) != 1)
+    {
+      return 0;
+    }
+    offsets[i] = used;
+    used += record->sizes[i];
+  }
+  // parts point into one buffer that may have moved while growing
+  for (int i = 0; i < record->count; i++) {
+    record->parts[i] = pthis->read_buffer + offsets[i];
+  }
+  return 1;
+}
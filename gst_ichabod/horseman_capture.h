@@ -0,0 +1,55 @@
+//
+//  horseman_capture.h
+//  gst_ichabod
+//
+
+/**
+ * Append-only recording of the messages a horseman receives, for replaying
+ * production sessions against new builds (see horseman_replay.c).
+ *
+ * File layout, integers little endian:
+ *   magic    8 bytes, HORSEMAN_CAPTURE_MAGIC
+ *   records until end of file:
+ *     arrival time   u64, microseconds since the epoch
+ *     part count     u8
+ *     per part:      u32 size, then size bytes
+ * Parts are the ZMQ message parts exactly as received (type, payload,
+ * timestamp, ...). A record cut short by a crash ends the capture.
+ */
+
+#ifndef horseman_capture_h
+#define horseman_capture_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HORSEMAN_CAPTURE_MAGIC "ICHBCAP1"
+#define HORSEMAN_CAPTURE_MAX_PARTS 16
+
+struct horseman_capture_s;
+
+struct horseman_capture_record_s {
+  uint64_t arrival_us;
+  int count;
+  // valid until the next read or close
+  const uint8_t* parts[HORSEMAN_CAPTURE_MAX_PARTS];
+  size_t sizes[HORSEMAN_CAPTURE_MAX_PARTS];
+};
+
+// Creates or truncates path. Returns 0 on success.
+int horseman_capture_open_write(struct horseman_capture_s** capture_out,
+                                const char* path);
+int horseman_capture_open_read(struct horseman_capture_s** capture_out,
+                               const char* path);
+void horseman_capture_close(struct horseman_capture_s* capture);
+
+int horseman_capture_write(struct horseman_capture_s* capture,
+                           uint64_t arrival_us, int count,
+                           const void** parts, const size_t* sizes);
+// Returns 1 with the next record, 0 at end of capture, -1 on error.
+int horseman_capture_read(struct horseman_capture_s* capture,
+                          struct horseman_capture_record_s* record);
+
+uint64_t horseman_capture_now_us(void);
+
+#endif /* horseman_capture_h */
@@ -0,0 +1,745 @@
+//
+//  horseman_loadgen.c
+//  gst_ichabod
+//
+
+/**
+ * Stands in for N horseman/browser pairs so ichabod can be load tested
+ * without Chrome. For each session it binds the endpoints an ichabod with
+ * that session id connects to (see HORSEMAN_SESSION_*_ENDPOINT), optionally
+ * requests a file output, then pushes JPEG frames at a fixed rate until
+ * --duration runs out or SIGINT, and finishes with EOS.
+ *
+ * Frames come from --frames DIR, or are rendered up front with
+ * videotestsrc ! jpegenc at the requested resolution. Credit and
+ * pause/resume from ichabod are honored the way the horseman does once the
+ * peer starts sending them, so throttled frames show up separately from
+ * frames lost to a full socket. Every second it prints sustained fps per
+ * session and, given --pid, the CPU used by those ichabod processes.
+ *
+ * --raw FORMAT renders I420, NV12 or BGRA planes instead of JPEG and sends
+ * them as protocol 2 binary frames, for ichabods running with --raw_ingest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <signal.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <zmq.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include "base64.h"
+#include "horseman.h"
+#include "ipc_endpoint.h"
+
+#define MAX_SESSIONS 256
+#define MAX_FRAMES 256
+#define MAX_PIDS 64
+#define BFRAME_HEADER_SIZE 24
+#define BFRAME_RAW_HEADER_SIZE 44
+#define BFRAME_FORMAT_JPEG 1
+#define BFRAME_FORMAT_I420 2
+#define BFRAME_FORMAT_NV12 3
+#define BFRAME_FORMAT_BGRA 4
+#define BFRAME_FLAG_EOS (1 << 0)
+
+struct loadgen_frame_s {
+  // JPEG, or packed planes with --raw
+  uint8_t* image;
+  size_t image_length;
+  char* base64;
+  size_t base64_length;
+};
+
+struct loadgen_session_s {
+  char id[64];
+  // frames out, bound where ichabod's horseman pulls from
+  void* push_socket;
+  // flow control in, bound where ichabod's horseman pushes to
+  void* pull_socket;
+  char* output_path;
+  char live;
+  // ichabod has spoken flow control, so credits apply
+  char flow_aware;
+  char paused;
+  uint32_t credits;
+  uint32_t sequence;
+  uint64_t live_since_ms;
+  uint64_t sent;
+  uint64_t throttled;
+  uint64_t dropped;
+  uint64_t interval_sent;
+};
+
+struct loadgen_config_s {
+  int sessions;
+  const char* session_prefix;
+  const char* pull_endpoint;
+  const char* push_endpoint;
+  const char* frames_dir;
+  const char* output_dir;
+  int fps;
+  int width;
+  int height;
+  int duration;
+  char binary;
+  char ignore_credits;
+  // GStreamer format name (I420, NV12, BGRA) with --raw, else NULL
+  const char* raw_format;
+  int raw_format_code;
+  // plane strides of the rendered raw frames
+  uint32_t raw_strides[3];
+  int pids[MAX_PIDS];
+  int pid_count;
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int sig) {
+  interrupted = 1;
+}
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#pragma mark - Frames
+
+static void frame_encode(struct loadgen_frame_s* frame) {
+  size_t length = 0;
+  char* encoded =
+  (char*)base64_encode(frame->image, frame->image_length, &length);
+  // the browser hands us one unbroken line
+  size_t j = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (encoded[i] != '\n') {
+      encoded[j++] = encoded[i];
+    }
+  }
+  encoded[j] = '\0';
+  frame->base64 = encoded;
+  frame->base64_length = j;
+}
+
+static int has_jpeg_extension(const char* name) {
+  const char* ext = strrchr(name, '.');
+  return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+static int load_frames(const char* dir_path, struct loadgen_frame_s* frames) {
+  DIR* dir = opendir(dir_path);
+  if (!dir) {
+    fprintf(stderr, "loadgen: cannot open %s\n", dir_path);
+    return 0;
+  }
+  int count = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) && count < MAX_FRAMES) {
+    if (!has_jpeg_extension(entry->d_name)) {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+      continue;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    struct loadgen_frame_s* frame = &frames[count];
+    frame->image = (uint8_t*)malloc(length > 0 ? length : 1);
+    frame->image_length = fread(frame->image, 1, length, file);
+    fclose(file);
+    if (!frame->image_length) {
+      free(frame->image);
+      continue;
+    }
+    frame_encode(frame);
+    count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+/* Repack a decoded frame into the bframe raw layout: planes back to back,
+ * stride * rows each, with no padding between them. Raw frames only go out
+ * binary, so there is no base64 copy.
+ */
+static void raw_frame_copy(struct loadgen_config_s* config, GstCaps* caps,
+                           GstBuffer* buffer, struct loadgen_frame_s* frame)
+{
+  GstVideoInfo info;
+  GstVideoFrame vframe;
+  if (!gst_video_info_from_caps(&info, caps) ||
+      !gst_video_frame_map(&vframe, &info, buffer, GST_MAP_READ))
+  {
+    return;
+  }
+  size_t length = 0;
+  for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&vframe); i++) {
+    length += (size_t)GST_VIDEO_FRAME_PLANE_STRIDE(&vframe, i) *
+    GST_VIDEO_FRAME_COMP_HEIGHT(&vframe, i);
+  }
+  frame->image = (uint8_t*)malloc(length);
+  frame->image_length = length;
+  uint8_t* dst = frame->image;
+  for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&vframe) && i < 3; i++) {
+    size_t plane_size = (size_t)GST_VIDEO_FRAME_PLANE_STRIDE(&vframe, i) *
+    GST_VIDEO_FRAME_COMP_HEIGHT(&vframe, i);
+    memcpy(dst, GST_VIDEO_FRAME_PLANE_DATA(&vframe, i), plane_size);
+    dst += plane_size;
+    config->raw_strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&vframe, i);
+  }
+  gst_video_frame_unmap(&vframe);
+}
+
+// A couple of seconds of moving test pattern, so frames differ like a
+// real screencast's would.
+static int render_frames(struct loadgen_config_s* config,
+                         struct loadgen_frame_s* frames)
+{
+  int count = config->fps * 2;
+  if (count > MAX_FRAMES) {
+    count = MAX_FRAMES;
+  }
+  gchar* description = config->raw_format ?
+  g_strdup_printf("videotestsrc pattern=ball num-buffers=%d ! "
+                  "video/x-raw,format=%s,width=%d,height=%d,framerate=%d/1 ! "
+                  "appsink name=sink sync=false",
+                  count, config->raw_format, config->width, config->height,
+                  config->fps) :
+  g_strdup_printf("videotestsrc pattern=ball num-buffers=%d ! "
+                  "video/x-raw,width=%d,height=%d,framerate=%d/1 ! "
+                  "jpegenc ! appsink name=sink sync=false",
+                  count, config->width, config->height, config->fps);
+  GError* error = NULL;
+  GstElement* pipeline = gst_parse_launch(description, &error);
+  g_free(description);
+  if (!pipeline) {
+    fprintf(stderr, "loadgen: cannot build frame pipeline: %s\n",
+            error ? error->message : "unknown error");
+    g_clear_error(&error);
+    return 0;
+  }
+  GstElement* sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+  gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+  int rendered = 0;
+  GstSample* sample;
+  while (rendered < count &&
+         (sample = gst_app_sink_pull_sample(GST_APP_SINK(sink))))
+  {
+    GstBuffer* buffer = gst_sample_get_buffer(sample);
+    struct loadgen_frame_s* frame = &frames[rendered++];
+    if (config->raw_format) {
+      raw_frame_copy(config, gst_sample_get_caps(sample), buffer, frame);
+      gst_sample_unref(sample);
+      continue;
+    }
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_READ);
+    frame->image = (uint8_t*)malloc(map.size);
+    memcpy(frame->image, map.data, map.size);
+    frame->image_length = map.size;
+    gst_buffer_unmap(buffer, &map);
+    gst_sample_unref(sample);
+    frame_encode(frame);
+  }
+
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  gst_object_unref(sink);
+  gst_object_unref(pipeline);
+  return rendered;
+}
+
+#pragma mark - Sessions
+
+static int send_parts(void* socket, const void** parts, size_t* sizes,
+                      int count)
+{
+  for (int i = 0; i < count; i++) {
+    int flags = ZMQ_DONTWAIT | (i + 1 < count ? ZMQ_SNDMORE : 0);
+    // once the first part is queued the rest of the message always fits
+    if (zmq_send(socket, parts[i], sizes[i], flags) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int send_strings(void* socket, const char** parts, int count) {
+  size_t sizes[8];
+  for (int i = 0; i < count; i++) {
+    sizes[i] = strlen(parts[i]);
+  }
+  return send_parts(socket, (const void**)parts, sizes, count);
+}
+
+static void write_le(uint8_t* p, uint64_t value, int size) {
+  for (int i = 0; i < size; i++) {
+    p[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static int send_frame(struct loadgen_config_s* config,
+                      struct loadgen_session_s* session,
+                      struct loadgen_frame_s* frame, char eos)
+{
+  // capture time, as the browser would stamp it
+  uint64_t timestamp = g_get_real_time() / 1000;
+  if (config->binary) {
+    uint8_t header[BFRAME_RAW_HEADER_SIZE] = { 0 };
+    size_t header_size = config->raw_format ?
+    BFRAME_RAW_HEADER_SIZE : BFRAME_HEADER_SIZE;
+    // must not exceed what session_go_live announced
+    header[0] = config->raw_format ? 2 : 1;
+    header[1] = config->raw_format ?
+    config->raw_format_code : BFRAME_FORMAT_JPEG;
+    write_le(header + 2, header_size, 2);
+    write_le(header + 4, session->sequence, 4);
+    write_le(header + 8, timestamp, 8);
+    write_le(header + 16, eos ? BFRAME_FLAG_EOS : 0, 4);
+    if (config->raw_format) {
+      write_le(header + 24, config->width, 4);
+      write_le(header + 28, config->height, 4);
+      for (int i = 0; i < 3; i++) {
+        write_le(header + 32 + 4 * i, config->raw_strides[i], 4);
+      }
+    }
+    const void* parts[] = { "bframe", header, eos ? NULL : frame->image };
+    size_t sizes[] = { 6, header_size, eos ? 0 : frame->image_length };
+    return send_parts(session->push_socket, parts, sizes, eos ? 2 : 3);
+  }
+  if (eos) {
+    const char* parts[] = { "frame", "EOS" };
+    return send_strings(session->push_socket, parts, 2);
+  }
+  char sz_timestamp[32];
+  snprintf(sz_timestamp, sizeof(sz_timestamp), "%lu", timestamp);
+  const void* parts[] = { "frame", frame->base64, sz_timestamp };
+  size_t sizes[] = { 5, frame->base64_length, strlen(sz_timestamp) };
+  return send_parts(session->push_socket, parts, sizes, 3);
+}
+
+// hello and the output request must land before any frame
+static void session_go_live(struct loadgen_config_s* config,
+                            struct loadgen_session_s* session)
+{
+  // raw frames need a peer that speaks protocol 2
+  const char* hello[] = {
+    "hello", config->raw_format ? "2" : config->binary ? "1" : "0"
+  };
+  if (send_strings(session->push_socket, hello, 2)) {
+    // nobody connected yet
+    return;
+  }
+  if (session->output_path) {
+    const char* output[] = { "output", "file", session->output_path };
+    // the hello got through, so there is a peer and this will queue
+    send_strings(session->push_socket, output, 3);
+  }
+  session->live = 1;
+  session->live_since_ms = now_ms();
+  printf("loadgen: session %s is live\n", session->id);
+}
+
+static void session_read_flow(struct loadgen_session_s* session) {
+  while (1) {
+    char type[16];
+    int len = zmq_recv(session->pull_socket, type, sizeof(type) - 1,
+                       ZMQ_DONTWAIT);
+    if (len < 0) {
+      return;
+    }
+    type[len < (int)sizeof(type) ? len : (int)sizeof(type) - 1] = '\0';
+    char arg[32] = { 0 };
+    int more = 0;
+    size_t more_size = sizeof(more);
+    zmq_getsockopt(session->pull_socket, ZMQ_RCVMORE, &more, &more_size);
+    while (more) {
+      len = zmq_recv(session->pull_socket, arg, sizeof(arg) - 1, 0);
+      if (len >= 0) {
+        arg[len < (int)sizeof(arg) ? len : (int)sizeof(arg) - 1] = '\0';
+      }
+      zmq_getsockopt(session->pull_socket, ZMQ_RCVMORE, &more, &more_size);
+    }
+    session->flow_aware = 1;
+    if (!strcmp(type, "credit")) {
+      session->credits += atoi(arg);
+    } else if (!strcmp(type, "pause")) {
+      session->paused = 1;
+    } else if (!strcmp(type, "resume")) {
+      session->paused = 0;
+    }
+  }
+}
+
+static int session_open(struct loadgen_config_s* config, void* zmq_ctx,
+                        struct loadgen_session_s* session)
+{
+  char* pull_endpoint =
+  ipc_endpoint_expand(config->pull_endpoint, session->id);
+  char* push_endpoint =
+  ipc_endpoint_expand(config->push_endpoint, session->id);
+  session->push_socket = zmq_socket(zmq_ctx, ZMQ_PUSH);
+  session->pull_socket = zmq_socket(zmq_ctx, ZMQ_PULL);
+  int linger = 1000;
+  zmq_setsockopt(session->push_socket, ZMQ_LINGER, &linger, sizeof(linger));
+  int ret = zmq_bind(session->push_socket, pull_endpoint);
+  if (ret) {
+    fprintf(stderr, "loadgen: failed to bind %s errno %d\n",
+            pull_endpoint, errno);
+  } else if ((ret = zmq_bind(session->pull_socket, push_endpoint))) {
+    fprintf(stderr, "loadgen: failed to bind %s errno %d\n",
+            push_endpoint, errno);
+  }
+  free(pull_endpoint);
+  free(push_endpoint);
+  if (config->output_dir) {
+    session->output_path =
+    g_strdup_printf("%s/%s.mp4", config->output_dir, session->id);
+  }
+  return ret;
+}
+
+static void session_close(struct loadgen_config_s* config,
+                          struct loadgen_session_s* session)
+{
+  if (session->live && send_frame(config, session, NULL, 1)) {
+    printf("loadgen: session %s: could not send EOS\n", session->id);
+  }
+  zmq_close(session->push_socket);
+  zmq_close(session->pull_socket);
+  g_free(session->output_path);
+}
+
+#pragma mark - Reporting
+
+// utime + stime of a process, in clock ticks. 0 if it's gone.
+static uint64_t process_cpu_ticks(int pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  char buf[1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  buf[len] = '\0';
+  // skip "pid (comm)", comm may contain spaces
+  char* p = strrchr(buf, ')');
+  if (!p) {
+    return 0;
+  }
+  unsigned long utime = 0, stime = 0;
+  sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+         &utime, &stime);
+  return utime + stime;
+}
+
+static uint64_t total_cpu_ticks(struct loadgen_config_s* config) {
+  uint64_t ticks = 0;
+  for (int i = 0; i < config->pid_count; i++) {
+    ticks += process_cpu_ticks(config->pids[i]);
+  }
+  return ticks;
+}
+
+static void report(struct loadgen_config_s* config,
+                   struct loadgen_session_s* sessions, uint64_t start_ms,
+                   uint64_t interval_ms, uint64_t cpu_ticks)
+{
+  if (!interval_ms) {
+    interval_ms = 1;
+  }
+  int live = 0;
+  uint64_t interval_sent = 0, sent = 0, throttled = 0, dropped = 0;
+  double sustained = 0;
+  for (int i = 0; i < config->sessions; i++) {
+    struct loadgen_session_s* session = &sessions[i];
+    interval_sent += session->interval_sent;
+    sent += session->sent;
+    throttled += session->throttled;
+    dropped += session->dropped;
+    session->interval_sent = 0;
+    if (session->live) {
+      live++;
+      uint64_t elapsed = now_ms() - session->live_since_ms;
+      if (elapsed) {
+        sustained += session->sent * 1000.0 / elapsed;
+      }
+    }
+  }
+  double fps = live ? interval_sent * 1000.0 / interval_ms / live : 0;
+  printf("loadgen: t=%lus live=%d/%d fps=%.1f/session "
+         "(sustained %.1f) sent=%lu throttled=%lu dropped=%lu",
+         (now_ms() - start_ms) / 1000, live, config->sessions, fps,
+         live ? sustained / live : 0, sent, throttled, dropped);
+  if (config->pid_count) {
+    double cpu = cpu_ticks * 100.0 / sysconf(_SC_CLK_TCK) /
+    (interval_ms / 1000.0);
+    printf(" cpu=%.1f%% (%.1f%%/session)", cpu, live ? cpu / live : 0);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+#pragma mark -
+
+#define SESSIONS_OPT 1000
+#define SESSION_PREFIX_OPT 1001
+#define PULL_ENDPOINT_OPT 1002
+#define PUSH_ENDPOINT_OPT 1003
+#define FRAMES_OPT 1004
+#define OUTPUT_DIR_OPT 1005
+#define FPS_OPT 1006
+#define WIDTH_OPT 1007
+#define HEIGHT_OPT 1008
+#define DURATION_OPT 1009
+#define BINARY_OPT 1010
+#define IGNORE_CREDITS_OPT 1011
+#define PID_OPT 1012
+#define RAW_OPT 1013
+
+int main(int argc, char* argv[]) {
+  struct loadgen_config_s config = { 0 };
+  config.sessions = 1;
+  config.session_prefix = "load";
+  config.pull_endpoint = HORSEMAN_SESSION_PULL_ENDPOINT;
+  config.push_endpoint = HORSEMAN_SESSION_PUSH_ENDPOINT;
+  config.fps = 30;
+  config.width = 1280;
+  config.height = 720;
+
+  static struct option long_options[] =
+  {
+    {"sessions", required_argument, 0, SESSIONS_OPT},
+    {"session_prefix", required_argument, 0, SESSION_PREFIX_OPT},
+    {"pull_endpoint", required_argument, 0, PULL_ENDPOINT_OPT},
+    {"push_endpoint", required_argument, 0, PUSH_ENDPOINT_OPT},
+    {"frames", required_argument, 0, FRAMES_OPT},
+    {"output_dir", required_argument, 0, OUTPUT_DIR_OPT},
+    {"fps", required_argument, 0, FPS_OPT},
+    {"width", required_argument, 0, WIDTH_OPT},
+    {"height", required_argument, 0, HEIGHT_OPT},
+    {"duration", required_argument, 0, DURATION_OPT},
+    {"binary", no_argument, 0, BINARY_OPT},
+    {"ignore_credits", no_argument, 0, IGNORE_CREDITS_OPT},
+    {"pid", required_argument, 0, PID_OPT},
+    {"raw", required_argument, 0, RAW_OPT},
+    {0, 0, 0, 0}
+  };
+  int c;
+  int option_index = 0;
+  while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1)
+  {
+    switch (c) {
+      case SESSIONS_OPT:
+        config.sessions = atoi(optarg);
+        break;
+      case SESSION_PREFIX_OPT:
+        config.session_prefix = optarg;
+        break;
+      case PULL_ENDPOINT_OPT:
+        config.pull_endpoint = optarg;
+        break;
+      case PUSH_ENDPOINT_OPT:
+        config.push_endpoint = optarg;
+        break;
+      case FRAMES_OPT:
+        config.frames_dir = optarg;
+        break;
+      case OUTPUT_DIR_OPT:
+        config.output_dir = optarg;
+        break;
+      case FPS_OPT:
+        config.fps = atoi(optarg);
+        break;
+      case WIDTH_OPT:
+        config.width = atoi(optarg);
+        break;
+      case HEIGHT_OPT:
+        config.height = atoi(optarg);
+        break;
+      case DURATION_OPT:
+        config.duration = atoi(optarg);
+        break;
+      case BINARY_OPT:
+        config.binary = 1;
+        break;
+      case IGNORE_CREDITS_OPT:
+        config.ignore_credits = 1;
+        break;
+      case PID_OPT:
+        if (config.pid_count < MAX_PIDS) {
+          config.pids[config.pid_count++] = atoi(optarg);
+        }
+        break;
+      case RAW_OPT:
+        config.raw_format = optarg;
+        config.binary = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [--sessions N] [--session_prefix P] "
+                "[--pull_endpoint T] [--push_endpoint T] [--frames DIR] "
+                "[--output_dir DIR] [--fps N] [--width N] [--height N] "
+                "[--duration SECONDS] [--binary] [--ignore_credits] "
+                "[--pid PID]... [--raw I420|NV12|BGRA]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (config.sessions < 1 || config.sessions > MAX_SESSIONS ||
+      config.fps < 1)
+  {
+    fprintf(stderr, "loadgen: bad session count or fps\n");
+    return 1;
+  }
+  if (config.raw_format) {
+    if (!strcmp(config.raw_format, "I420")) {
+      config.raw_format_code = BFRAME_FORMAT_I420;
+    } else if (!strcmp(config.raw_format, "NV12")) {
+      config.raw_format_code = BFRAME_FORMAT_NV12;
+    } else if (!strcmp(config.raw_format, "BGRA")) {
+      config.raw_format_code = BFRAME_FORMAT_BGRA;
+    } else {
+      fprintf(stderr, "loadgen: unknown raw format %s\n", config.raw_format);
+      return 1;
+    }
+    if (config.frames_dir) {
+      fprintf(stderr, "loadgen: --raw renders its own frames, "
+              "drop --frames\n");
+      return 1;
+    }
+  }
+  if (config.sessions > 1 &&
+      (!strstr(config.pull_endpoint, IPC_ENDPOINT_SESSION_TOKEN) ||
+       !strstr(config.push_endpoint, IPC_ENDPOINT_SESSION_TOKEN)))
+  {
+    fprintf(stderr, "loadgen: endpoints need %s for multiple sessions\n",
+            IPC_ENDPOINT_SESSION_TOKEN);
+    return 1;
+  }
+
+  gst_init(&argc, &argv);
+
+  static struct loadgen_frame_s frames[MAX_FRAMES];
+  int frame_count = config.frames_dir ?
+  load_frames(config.frames_dir, frames) : render_frames(&config, frames);
+  if (!frame_count) {
+    fprintf(stderr, "loadgen: no frames\n");
+    return 1;
+  }
+  printf("loadgen: %d frames, %d sessions at %d fps\n",
+         frame_count, config.sessions, config.fps);
+
+  void* zmq_ctx = zmq_ctx_new();
+  static struct loadgen_session_s sessions[MAX_SESSIONS];
+  zmq_pollitem_t poll_items[MAX_SESSIONS];
+  for (int i = 0; i < config.sessions; i++) {
+    snprintf(sessions[i].id, sizeof(sessions[i].id), "%s-%d",
+             config.session_prefix, i);
+    if (session_open(&config, zmq_ctx, &sessions[i])) {
+      return 1;
+    }
+    poll_items[i].socket = sessions[i].pull_socket;
+    poll_items[i].fd = 0;
+    poll_items[i].events = ZMQ_POLLIN;
+    printf("loadgen: session %s waiting for ichabod\n", sessions[i].id);
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  uint64_t start_ms = now_ms();
+  uint64_t next_report_ms = start_ms + 1000;
+  uint64_t last_report_ms = start_ms;
+  uint64_t last_cpu_ticks = total_cpu_ticks(&config);
+  double frame_interval_ms = 1000.0 / config.fps;
+  uint64_t tick = 0;
+  int frame_index = 0;
+
+  while (!interrupted) {
+    uint64_t now = now_ms();
+    if (config.duration && now - start_ms >= (uint64_t)config.duration * 1000)
+    {
+      break;
+    }
+    uint64_t due_ms = start_ms + (uint64_t)(tick * frame_interval_ms);
+    if (now >= due_ms) {
+      struct loadgen_frame_s* frame = &frames[frame_index];
+      frame_index = (frame_index + 1) % frame_count;
+      for (int i = 0; i < config.sessions; i++) {
+        struct loadgen_session_s* session = &sessions[i];
+        session_read_flow(session);
+        if (!session->live) {
+          session_go_live(&config, session);
+          if (!session->live) {
+            continue;
+          }
+        }
+        char honor_flow = session->flow_aware && !config.ignore_credits;
+        if (honor_flow && (session->paused || !session->credits)) {
+          session->throttled++;
+          continue;
+        }
+        if (send_frame(&config, session, frame, 0)) {
+          session->dropped++;
+          continue;
+        }
+        session->sequence++;
+        session->sent++;
+        session->interval_sent++;
+        if (session->credits) {
+          session->credits--;
+        }
+      }
+      tick++;
+      // fell more than a frame behind: skip ahead instead of bursting
+      if (now_ms() > start_ms + (uint64_t)((tick + 1) * frame_interval_ms)) {
+        tick = (uint64_t)((now_ms() - start_ms) / frame_interval_ms);
+      }
+      continue;
+    }
+    if (now >= next_report_ms) {
+      uint64_t cpu_ticks = total_cpu_ticks(&config);
+      report(&config, sessions, start_ms, now - last_report_ms,
+             cpu_ticks - last_cpu_ticks);
+      last_cpu_ticks = cpu_ticks;
+      last_report_ms = now;
+      next_report_ms += 1000;
+    }
+    // wait for the next frame, picking up flow control as it arrives
+    long timeout = (long)(due_ms - now);
+    if (zmq_poll(poll_items, config.sessions, timeout) > 0) {
+      for (int i = 0; i < config.sessions; i++) {
+        if (poll_items[i].revents & ZMQ_POLLIN) {
+          session_read_flow(&sessions[i]);
+        }
+      }
+    }
+  }
+
+  report(&config, sessions, start_ms, now_ms() - last_report_ms,
+         total_cpu_ticks(&config) - last_cpu_ticks);
+  for (int i = 0; i < config.sessions; i++) {
+    session_close(&config, &sessions[i]);
+  }
+  zmq_ctx_destroy(zmq_ctx);
+  for (int i = 0; i < frame_count; i++) {
+    free(frames[i].image);
+    free(frames[i].base64);
+  }
+  return 0;
+}
@@ -0,0 +1,221 @@
+//
+//  horseman_replay.c
+//  gst_ichabod
+//
+
+/**
+ * Plays a horseman capture (ichabod --horseman_capture, see
+ * horseman_capture.h) back into an ichabod, over the same endpoint the real
+ * horseman would use. Messages go out byte for byte at their recorded
+ * spacing, or --speed times faster; --speed 0 sends as fast as ichabod takes
+ * them. With --retime, frame timestamps are rewritten to match the replay
+ * clock, so an accelerated replay looks like a faster capture rather than a
+ * burst of stale frames.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <zmq.h>
+#include "horseman.h"
+#include "horseman_capture.h"
+#include "ipc_endpoint.h"
+
+#define BFRAME_HEADER_MIN_SIZE 24
+
+struct replay_clock_s {
+  double speed;
+  uint64_t start_us;
+  uint64_t first_arrival_us;
+  // first frame timestamp in the capture, and where it lands on replay
+  char have_first_frame;
+  uint64_t first_frame_ms;
+  uint64_t replay_first_frame_ms;
+};
+
+static uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char part_is(struct horseman_capture_record_s* record, int i,
+                    const char* sz)
+{
+  size_t len = strlen(sz);
+  return i < record->count && record->sizes[i] == len &&
+  !memcmp(record->parts[i], sz, len);
+}
+
+static uint64_t retime(struct replay_clock_s* clock, uint64_t frame_ms) {
+  if (!clock->have_first_frame) {
+    clock->have_first_frame = 1;
+    clock->first_frame_ms = frame_ms;
+    clock->replay_first_frame_ms = horseman_capture_now_us() / 1000;
+  }
+  double offset = (double)frame_ms - (double)clock->first_frame_ms;
+  if (clock->speed > 0) {
+    offset /= clock->speed;
+  }
+  return clock->replay_first_frame_ms + (int64_t)offset;
+}
+
+static int send_part(void* socket, const void* data, size_t size, int more) {
+  return zmq_send(socket, data, size, more ? ZMQ_SNDMORE : 0) < 0 ? -1 : 0;
+}
+
+// Blocking sends: a replay must deliver everything to be comparable
+static int send_record(void* socket, struct horseman_capture_record_s* record,
+                       struct replay_clock_s* clock, char do_retime)
+{
+  int ret = 0;
+  for (int i = 0; i < record->count && !ret; i++) {
+    int more = i + 1 < record->count;
+    const void* data = record->parts[i];
+    size_t size = record->sizes[i];
+    char sz_timestamp[32];
+    uint8_t header[256];
+
+    if (do_retime && i == 2 && part_is(record, 0, "frame")) {
+      char original[32] = { 0 };
+      memcpy(original, data, size < sizeof(original) - 1 ?
+             size : sizeof(original) - 1);
+      uint64_t ts = retime(clock, (uint64_t)atof(original));
+      snprintf(sz_timestamp, sizeof(sz_timestamp), "%lu", ts);
+      data = sz_timestamp;
+      size = strlen(sz_timestamp);
+    } else if (do_retime && i == 1 && part_is(record, 0, "bframe") &&
+               size >= BFRAME_HEADER_MIN_SIZE && size <= sizeof(header))
+    {
+      memcpy(header, data, size);
+      uint64_t ts = 0;
+      for (int b = 7; b >= 0; b--) {
+        ts = (ts << 8) | header[8 + b];
+      }
+      ts = retime(clock, ts);
+      for (int b = 0; b < 8; b++) {
+        header[8 + b] = (uint8_t)(ts >> (8 * b));
+      }
+      data = header;
+    }
+    ret = send_part(socket, data, size, more);
+  }
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  const char* capture_path = NULL;
+  const char* session_id = NULL;
+  const char* pull_endpoint = NULL;
+  char do_retime = 0;
+  struct replay_clock_s clock = { 0 };
+  clock.speed = 1.0;
+
+  static struct option long_options[] =
+  {
+    {"capture", required_argument, 0, 'c'},
+    {"session_id", required_argument, 0, 's'},
+    {"pull_endpoint", required_argument, 0, 'e'},
+    {"speed", required_argument, 0, 'x'},
+    {"retime", no_argument, 0, 'r'},
+    {0, 0, 0, 0}
+  };
+  int c;
+  int option_index = 0;
+  while ((c = getopt_long(argc, argv, "c:s:e:x:r",
+                          long_options, &option_index)) != -1)
+  {
+    switch (c) {
+      case 'c':
+        capture_path = optarg;
+        break;
+      case 's':
+        session_id = optarg;
+        break;
+      case 'e':
+        pull_endpoint = optarg;
+        break;
+      case 'x':
+        clock.speed = atof(optarg);
+        break;
+      case 'r':
+        do_retime = 1;
+        break;
+      default:
+        capture_path = NULL;
+        break;
+    }
+  }
+  if (!capture_path || clock.speed < 0) {
+    fprintf(stderr, "usage: %s --capture FILE [--session_id ID] "
+            "[--pull_endpoint T] [--speed X] [--retime]\n", argv[0]);
+    return 1;
+  }
+
+  struct horseman_capture_s* capture;
+  if (horseman_capture_open_read(&capture, capture_path)) {
+    fprintf(stderr, "replay: %s is not a horseman capture\n", capture_path);
+    return 1;
+  }
+
+  // bind where ichabod's horseman connects, exactly as the real one does
+  char* endpoint =
+  ipc_endpoint_resolve(pull_endpoint, HORSEMAN_SESSION_PULL_ENDPOINT,
+                       HORSEMAN_DEFAULT_PULL_ENDPOINT, session_id);
+  void* zmq_ctx = zmq_ctx_new();
+  void* socket = zmq_socket(zmq_ctx, ZMQ_PUSH);
+  if (zmq_bind(socket, endpoint)) {
+    fprintf(stderr, "replay: failed to bind %s errno %d\n", endpoint, errno);
+    return 1;
+  }
+  printf("replay: %s -> %s at %.2fx\n", capture_path, endpoint, clock.speed);
+
+  struct horseman_capture_record_s record;
+  uint64_t records = 0, bytes = 0, max_late_us = 0;
+  int ret;
+  while ((ret = horseman_capture_read(capture, &record)) > 0) {
+    if (!records) {
+      clock.first_arrival_us = record.arrival_us;
+      clock.start_us = monotonic_us();
+    } else if (clock.speed > 0) {
+      uint64_t due_us = clock.start_us +
+      (uint64_t)((record.arrival_us - clock.first_arrival_us) / clock.speed);
+      uint64_t now = monotonic_us();
+      if (due_us > now) {
+        usleep((useconds_t)(due_us - now));
+      } else if (now - due_us > max_late_us) {
+        max_late_us = now - due_us;
+      }
+    }
+    if (send_record(socket, &record, &clock, do_retime)) {
+      fprintf(stderr, "replay: send failed errno %d\n", errno);
+      break;
+    }
+    records++;
+    for (int i = 0; i < record.count; i++) {
+      bytes += record.sizes[i];
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "replay: corrupt record after %lu records\n", records);
+  }
+
+  double elapsed = (monotonic_us() - clock.start_us) / 1e6;
+  printf("replay: sent %lu messages, %lu bytes in %.2fs; "
+         "max %.1fms behind schedule\n",
+         records, bytes, records ? elapsed : 0, max_late_us / 1000.0);
+
+  // let queued messages drain to ichabod before tearing down
+  int linger = 5000;
+  zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+  zmq_close(socket);
+  zmq_ctx_destroy(zmq_ctx);
+  free(endpoint);
+  horseman_capture_close(capture);
+  return ret < 0 ? 1 : 0;
+}
@@ -7,16 +7,32 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include "ichabod_bin.h"
 #include "screencast_src.h"
+#include "jpeg_decoder.h"
+#include "encoder_backend.h"
+#include "framepool.h"
 #include "horseman.h"
 #include "ichabod_sinks.h"
+#include "latency.h"
+#include "metrics.h"
+
+// Decoded frames preallocated for the decoder; videorate and the encoder
+// each keep a few
+#define DECODED_POOL_MIN_BUFFERS 8
+
+// How often per-stage latency is logged while running
+#define LATENCY_REPORT_INTERVAL_SECONDS 10
 
 struct ichabod_bin_s {
   GMainLoop *loop;
   guint bus_watch_id;
+  void (*on_finished)(struct ichabod_bin_s* ichabod_bin, void* p);
+  void* finished_p;
 
   GstElement* pipeline;
   GstElement* asource;
@@ -27,18 +43,41 @@ struct ichabod_bin_s {
   GstElement* mqueue_src;
 
   GstElement* vsource;
+  // jpegdec, jpeg_decoder's bin, or videoconvert for raw ingest
   GstElement* imgdec;
+  char raw_ingest;
+  struct jpeg_decoder_s* jpeg_decoder;
   GstElement* vfps;
-  GstElement* venc;
+  // decoded, constant rate video for the encoders
+  GstElement* video_raw_tee;
 
   GMutex lock;
   gboolean audio_ready;
   gboolean video_ready;
   gboolean pipe_open_requested;
 
+  /* flow control toward the horseman. guarded by lock. */
+  gboolean appsrc_full;
+  gboolean encoder_lagging;
+  gboolean flow_paused;
+  GstClockTime last_raw_pts;
+  // from the video encoder furthest behind
+  GstClockTime last_encoded_pts;
+
+  /* video_encoder_s, one per distinct profile, built as outputs ask for
+   * them. guarded by lock. Outputs attach from the main thread and the
+   * horseman thread, so encoder_setup_lock is held from lookup to insert.
+   */
+  GPtrArray* video_encoders;
+  GMutex encoder_setup_lock;
+  // backend name for outputs that don't ask for one
+  char* video_encoder;
+  // preset already applied. tune is an owned copy.
+  struct ichabod_x264_options_s x264;
+  // faac is fed nothing until an output needs it. atomic.
+  gint audio_encoding;
+
   /* output chain */
-  GstElement* video_out_valve;
-  GstElement* video_tee;
   GstElement* audio_out_valve;
   GstElement* audio_enc_tee;
   GstElement* audio_raw_tee;
@@ -49,6 +88,76 @@ struct ichabod_bin_s {
   struct rtp_relay_s* rtp_relay;
   struct screencast_src_s* screencast_src;
   struct horseman_s* horseman;
+
+  struct latency_tracker_s* latency;
+  char* session_id;
+  guint latency_report_id;
+
+  /* metrics. encoder counters and queue_watches are guarded by lock. */
+  struct metrics_server_s* metrics;
+  guint metrics_source_id;
+  GPtrArray* queue_watches;
+};
+
+/* One encoder through to the tee its outputs hang off. Each is a branch of
+ * the decoded video tee; all but the first sit behind a queue so they encode
+ * on their own threads.
+ */
+struct video_encoder_s {
+  struct ichabod_bin_s* bin;
+  // strings are owned copies. encoder is always set.
+  struct ichabod_encoder_profile_s profile;
+  const struct encoder_backend_s* backend;
+  GstElement* venc;
+  GstElement* valve;
+  GstElement* tee;
+  // fed nothing until an output needs it. atomic.
+  gint encoding;
+
+  /* guarded by the bin lock */
+  GstClockTime last_encoded_pts;
+  guint64 encoded_bytes;
+  guint64 encoded_frames;
+  GstClockTime bitrate_window_start;
+  guint64 bitrate_window_bytes;
+  guint64 bitrate;
+};
+
+const struct ichabod_encoder_profile_s ichabod_encoder_profile_file = {
+  .name = "file",
+  .rate_control = ichabod_rate_control_crf,
+  .quality = 18,
+  .bitrate = 4096,
+  .key_int_max = 60,
+};
+
+const struct ichabod_encoder_profile_s ichabod_encoder_profile_rtmp = {
+  .name = "rtmp",
+  .rate_control = ichabod_rate_control_cbr,
+  .bitrate = 4096,
+  // ingest servers generally want an IDR at least every two seconds
+  .key_int_max = 60,
+  .h264_profile = "main",
+};
+
+/* Fill level of one multiqueue stream, which has no level properties of its
+ * own, from the buffers seen entering and leaving it. Written from streaming
+ * threads with atomics, read when metrics are collected.
+ */
+struct queue_watch_s {
+  char name[64];
+  GstClockTime in_pts;
+  GstClockTime out_pts;
+  guint64 in_buffers;
+  guint64 out_buffers;
+  guint64 in_bytes;
+  guint64 out_bytes;
+};
+
+// One per attached output, for the mux input probe
+struct mux_probe_s {
+  struct ichabod_bin_s* bin;
+  int output;
 };
 
 static int setup_bin(struct ichabod_bin_s* pthis);
@@ -59,12 +168,152 @@ static GstPadProbeReturn on_video_live
 (GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
 static GstPadProbeReturn on_video_downstream
 (GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static GstPadProbeReturn on_raw_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static GstPadProbeReturn on_encoded_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static GstPadProbeReturn on_decoded_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static GstPadProbeReturn on_idle_encoder_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static void video_encoder_free(gpointer p);
+static void apply_x264_preset(struct ichabod_x264_options_s* options);
+static void apply_x264_options(GstElement* venc,
+                               const struct ichabod_x264_options_s* options);
+static GstPadProbeReturn on_output_wait_keyframe
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static GstPadProbeReturn on_mux_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user);
+static void watch_queue_stream(struct ichabod_bin_s* pthis, const char* name,
+                               GstPad* sink_pad, GstPad* src_pad);
+static void on_collect_metrics(struct metrics_s* metrics, void* p);
+
+static void watch_video_decoder(struct ichabod_bin_s* pthis) {
+  GstPad* imgdec_src_pad = gst_element_get_static_pad(pthis->imgdec, "src");
+  gst_pad_add_probe(imgdec_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_decoded_video_buffer, pthis, NULL);
+  // recycle decoded frames instead of allocating each one
+  gst_frame_pool_offer_on_pad(imgdec_src_pad, DECODED_POOL_MIN_BUFFERS);
+  gst_object_unref(imgdec_src_pad);
+}
+
+/* Swap the element between the raw multiqueue and videorate. Only safe
+ * before the pipeline starts.
+ */
+static void replace_video_decoder(struct ichabod_bin_s* pthis,
+                                  GstElement* decoder)
+{
+  GstPad* old_sink = gst_element_get_static_pad(pthis->imgdec, "sink");
+  GstPad* old_src = gst_element_get_static_pad(pthis->imgdec, "src");
+  GstPad* upstream = gst_pad_get_peer(old_sink);
+  GstPad* downstream = gst_pad_get_peer(old_src);
+  gst_object_unref(old_sink);
+  gst_object_unref(old_src);
+  // unlinks and drops the old decoder
+  gst_bin_remove(GST_BIN(pthis->pipeline), pthis->imgdec);
+
+  pthis->imgdec = decoder;
+  gst_bin_add(GST_BIN(pthis->pipeline), decoder);
+  GstPad* sink = gst_element_get_static_pad(decoder, "sink");
+  GstPad* src = gst_element_get_static_pad(decoder, "src");
+  GstPadLinkReturn ret = gst_pad_link(upstream, sink);
+  g_assert(!ret);
+  ret = gst_pad_link(src, downstream);
+  g_assert(!ret);
+  gst_object_unref(sink);
+  gst_object_unref(src);
+  gst_object_unref(upstream);
+  gst_object_unref(downstream);
+  watch_video_decoder(pthis);
+}
+
+// Pause the horseman once the encoder is this far behind the input, and
+// resume once it has caught up to half of that.
+#define MAX_ENCODER_LAG (3 * GST_SECOND)
+
+// call with lock held
+static void update_flow_control(struct ichabod_bin_s* pthis) {
+  gboolean paused = pthis->appsrc_full || pthis->encoder_lagging;
+  if (paused != pthis->flow_paused) {
+    g_print("ichabod_bin: %s horseman (appsrc full: %d, encoder lag: %d)\n",
+            paused ? "pausing" : "resuming",
+            pthis->appsrc_full, pthis->encoder_lagging);
+    pthis->flow_paused = paused;
+    horseman_set_paused(pthis->horseman, paused);
+  }
+}
+
+static void on_screencast_ready_changed(struct screencast_src_s* src,
+                                        char ready, void* p)
+{
+  struct ichabod_bin_s* pthis = (struct ichabod_bin_s*)p;
+  g_mutex_lock(&pthis->lock);
+  pthis->appsrc_full = !ready;
+  update_flow_control(pthis);
+  g_mutex_unlock(&pthis->lock);
+}
+
+static char is_raw_frame(struct horseman_frame_s* frame,
+                         struct screencast_raw_frame_s* raw)
+{
+  switch (frame->format) {
+    case horseman_frame_format_i420:
+      raw->format = screencast_raw_format_i420;
+      return 1;
+    case horseman_frame_format_nv12:
+      raw->format = screencast_raw_format_nv12;
+      return 1;
+    case horseman_frame_format_bgra:
+      raw->format = screencast_raw_format_bgra;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Tiles point into the frame payload, which horseman keeps until we return;
+ * screencast_src composites them before then.
+ */
+static void push_tiles(struct ichabod_bin_s* pthis,
+                       struct horseman_frame_s* frame,
+                       const struct latency_marks_s* marks)
+{
+  GArray* tiles = g_array_new(FALSE, FALSE, sizeof(struct screencast_tile_s));
+  struct horseman_tile_s htile;
+  size_t offset = 0;
+  int ret;
+  while (1 == (ret = horseman_frame_next_tile(frame, &offset, &htile))) {
+    struct screencast_tile_s tile = { 0 };
+    tile.format = horseman_frame_format_jpeg == htile.format ?
+    screencast_tile_format_jpeg : screencast_tile_format_bgra;
+    tile.x = htile.x;
+    tile.y = htile.y;
+    tile.width = htile.width;
+    tile.height = htile.height;
+    tile.data = htile.data;
+    tile.length = htile.length;
+    g_array_append_val(tiles, tile);
+  }
+  if (ret < 0) {
+    g_print("ichabod_bin: malformed tile list in frame %u, using %u tiles\n",
+            frame->sequence, tiles->len);
+  }
+  screencast_src_push_tiles(pthis->screencast_src, frame->timestamp,
+                            frame->width, frame->height,
+                            (const struct screencast_tile_s*)tiles->data,
+                            tiles->len, marks);
+  g_array_free(tiles, TRUE);
+}
 
 static void on_horseman_video_frame(struct horseman_s* queue,
                                     struct horseman_frame_s* frame,
                                     void* p)
 {
   struct ichabod_bin_s* pthis = (struct ichabod_bin_s*)p;
+  struct latency_marks_s marks = { 0 };
+  struct screencast_raw_frame_s raw = { 0 };
+  marks.received_ns = frame->received_ns;
+  marks.parsed_ns = frame->parsed_ns;
   if (frame->eos) {
     g_print("ichabod_bin: sending pipeline end-of-stream\n");
     // We can send EOS to vsrc, but it doesn't seem to be enough to interrupt
@@ -72,10 +321,40 @@ static void on_horseman_video_frame(struct horseman_s* queue,
      screencast_src_send_eos(pthis->screencast_src);
     // So instead, we just eos the whole pipeline.
     //gst_element_send_event(pthis->pipeline, gst_event_new_eos());
+  } else if (horseman_frame_format_tiles == frame->format) {
+    push_tiles(pthis, frame, &marks);
+  } else if (is_raw_frame(frame, &raw)) {
+    raw.width = frame->width;
+    raw.height = frame->height;
+    memcpy(raw.strides, frame->strides, sizeof(raw.strides));
+    void* payload = horseman_frame_take_payload(frame);
+    screencast_src_push_raw(pthis->screencast_src,
+                            frame->timestamp,
+                            &raw,
+                            frame->data,
+                            frame->data_length,
+                            &marks,
+                            horseman_payload_free,
+                            payload);
+  } else if (horseman_frame_format_jpeg == frame->format) {
+    // hand the zmq message itself to the GstBuffer; freed with the buffer
+    void* payload = horseman_frame_take_payload(frame);
+    screencast_src_push_image(pthis->screencast_src,
+                              frame->timestamp,
+                              frame->data,
+                              frame->data_length,
+                              &marks,
+                              horseman_payload_free,
+                              payload);
   } else {
+    void* payload = horseman_frame_take_payload(frame);
     screencast_src_push_frame(pthis->screencast_src,
                               frame->timestamp,
-                              frame->sz_data);
+                              (const char*)frame->data,
+                              frame->data_length,
+                              &marks,
+                              horseman_payload_free,
+                              payload);
   }
 }
 
@@ -88,10 +367,10 @@ static void on_horseman_output_request(struct horseman_s* horseman,
   struct ichabod_bin_s* pthis = (struct ichabod_bin_s*)p;
   switch (output->output_type) {
     case horseman_output_type_file:
-      ichabod_attach_file(pthis, output->location);
+      ichabod_attach_file(pthis, output->location, output->encoder);
       break;
     case horseman_output_type_rtmp:
-      ichabod_attach_rtmp(pthis, output->location);
+      ichabod_attach_rtmp(pthis, output->location, output->encoder);
       break;
     default:
       g_print("ichabod_bin: WARNING: unknown output type request\n");
@@ -108,10 +387,17 @@ void ichabod_bin_alloc(struct ichabod_bin_s** ichabod_bin_out) {
   struct ichabod_bin_s* pthis = (struct ichabod_bin_s*)
   calloc(1, sizeof(struct ichabod_bin_s));
   g_mutex_init(&pthis->lock);
+  g_mutex_init(&pthis->encoder_setup_lock);
   pthis->audio_ready = FALSE;
   pthis->video_ready = FALSE;
-
-  struct horseman_config_s hconf;
+  pthis->last_raw_pts = GST_CLOCK_TIME_NONE;
+  pthis->last_encoded_pts = GST_CLOCK_TIME_NONE;
+  latency_tracker_alloc(&pthis->latency);
+  pthis->queue_watches = g_ptr_array_new_with_free_func(free);
+  pthis->video_encoders = g_ptr_array_new_with_free_func(video_encoder_free);
+  pthis->video_encoder = g_strdup(ENCODER_BACKEND_DEFAULT);
+
+  struct horseman_config_s hconf = { 0 };
   horseman_alloc(&pthis->horseman);
   hconf.p = pthis;
   hconf.on_video_frame = on_horseman_video_frame;
@@ -122,8 +408,99 @@ void ichabod_bin_alloc(struct ichabod_bin_s** ichabod_bin_out) {
   *ichabod_bin_out = pthis;
 }
 
-void ichabod_bin_free(struct ichabod_bin_s* pthis) {
+void ichabod_bin_config(struct ichabod_bin_s* pthis,
+                        struct ichabod_bin_config_s* config)
+{
+  struct horseman_config_s hconf = { 0 };
+  hconf.p = pthis;
+  hconf.on_video_frame = on_horseman_video_frame;
+  hconf.on_output_request = on_horseman_output_request;
+  hconf.coalesce_frames = config->coalesce_frames;
+  hconf.session_id = config->session_id;
+  hconf.pull_endpoint = config->horseman_pull_endpoint;
+  hconf.push_endpoint = config->horseman_push_endpoint;
+  hconf.capture_path = config->horseman_capture_path;
+  horseman_load_config(pthis->horseman, &hconf);
 
+  struct screencast_src_config_s src_config = { 0 };
+  src_config.on_ready_changed = on_screencast_ready_changed;
+  src_config.p = pthis;
+  src_config.coalesce_frames = config->coalesce_frames;
+  src_config.skip_duplicates = config->skip_duplicate_frames;
+  src_config.latency = pthis->latency;
+  src_config.raw_ingest = config->raw_ingest;
+  screencast_src_config(pthis->screencast_src, &src_config);
+
+  if (config->raw_ingest && !pthis->raw_ingest) {
+    // frames arrive as pixels: only a format conversion stands before
+    // videorate, and only if the encoder can't take the format as is
+    GstElement* convert = gst_element_factory_make("videoconvert", NULL);
+    g_assert(convert);
+    replace_video_decoder(pthis, convert);
+    pthis->raw_ingest = 1;
+  } else if (config->jpeg_decode_threads && !pthis->raw_ingest &&
+             !pthis->jpeg_decoder)
+  {
+    // same place in the pipeline, same output, decoded on several cores
+    struct jpeg_decoder_config_s dec_config = { 0 };
+    dec_config.threads =
+    config->jpeg_decode_threads > 0 ? config->jpeg_decode_threads : 0;
+    jpeg_decoder_alloc(&pthis->jpeg_decoder);
+    jpeg_decoder_config(pthis->jpeg_decoder, &dec_config);
+    replace_video_decoder(pthis,
+                          jpeg_decoder_get_element(pthis->jpeg_decoder));
+  }
+
+  free(pthis->session_id);
+  pthis->session_id =
+  config->session_id ? strdup(config->session_id) : NULL;
+
+  struct ichabod_x264_options_s x264 = config->x264;
+  apply_x264_preset(&x264);
+  g_free((char*)pthis->x264.tune);
+  pthis->x264 = x264;
+  pthis->x264.tune = g_strdup(x264.tune);
+  g_print("ichabod_bin: x264 threads %d, sliced %d, lookahead %d, "
+          "b-frames %d, tune %s\n", x264.threads, x264.sliced_threads,
+          x264.rc_lookahead, x264.b_frames, x264.tune ? x264.tune : "default");
+
+  g_free(pthis->video_encoder);
+  pthis->video_encoder = g_strdup(config->video_encoder ?
+                                  config->video_encoder :
+                                  ENCODER_BACKEND_DEFAULT);
+
+  if (config->metrics && !pthis->metrics_source_id) {
+    pthis->metrics = config->metrics;
+    pthis->metrics_source_id =
+    metrics_server_add_source(pthis->metrics, on_collect_metrics, pthis);
+  }
+
+  if (config->audio_device) {
+    g_object_set(G_OBJECT(pthis->asource),
+                 "device", config->audio_device, NULL);
+  }
+
+  pthis->on_finished = config->on_finished;
+  pthis->finished_p = config->p;
+}
+
+void ichabod_bin_free(struct ichabod_bin_s* pthis) {
+  ichabod_bin_stop(pthis);
+  horseman_free(pthis->horseman);
+  screencast_src_free(pthis->screencast_src);
+  latency_tracker_free(pthis->latency);
+  if (pthis->jpeg_decoder) {
+    jpeg_decoder_free(pthis->jpeg_decoder);
+  }
+  free(pthis->session_id);
+  g_free((char*)pthis->x264.tune);
+  g_free(pthis->video_encoder);
+  // after the pipeline is gone: queue and encoder probes point into these
+  g_ptr_array_free(pthis->queue_watches, TRUE);
+  g_ptr_array_free(pthis->video_encoders, TRUE);
+  g_main_loop_unref(pthis->loop);
+  g_mutex_clear(&pthis->lock);
+  g_mutex_clear(&pthis->encoder_setup_lock);
   free(pthis);
 }
 
@@ -135,6 +512,11 @@ int setup_bin(struct ichabod_bin_s* pthis) {
 
   screencast_src_alloc(&pthis->screencast_src);
   pthis->vsource = screencast_src_get_element(pthis->screencast_src);
+  struct screencast_src_config_s src_config = { 0 };
+  src_config.on_ready_changed = on_screencast_ready_changed;
+  src_config.p = pthis;
+  src_config.latency = pthis->latency;
+  screencast_src_config(pthis->screencast_src, &src_config);
 
   pthis->loop = g_main_loop_new(NULL, FALSE);
 
@@ -147,12 +529,10 @@ int setup_bin(struct ichabod_bin_s* pthis) {
   pthis->aenc = gst_element_factory_make("faac", "faaaaac");
   pthis->vfps = gst_element_factory_make("videorate", NULL);
   pthis->imgdec = gst_element_factory_make("jpegdec", NULL);
-  pthis->venc = gst_element_factory_make("x264enc", NULL);
   pthis->audio_out_valve = gst_element_factory_make("valve", NULL);
-  pthis->video_out_valve = gst_element_factory_make("valve", NULL);
   pthis->audio_enc_tee = gst_element_factory_make("tee", NULL);
   pthis->audio_raw_tee = gst_element_factory_make("tee", NULL);
-  pthis->video_tee = gst_element_factory_make("tee", NULL);
+  pthis->video_raw_tee = gst_element_factory_make("tee", NULL);
   //pthis->fake_mux_asink = gst_element_factory_make("fakesink", NULL);
   //pthis->fake_mux_vsink = gst_element_factory_make("fakesink", NULL);
 
@@ -161,7 +541,7 @@ int setup_bin(struct ichabod_bin_s* pthis) {
     return -1;
   }
 
-  if (!pthis->vsource || !pthis->imgdec || !pthis->venc)
+  if (!pthis->vsource || !pthis->imgdec || !pthis->video_raw_tee)
   {
     g_printerr ("Video components missing. Check gst installation.\n");
     return -1;
@@ -194,6 +574,8 @@ int setup_bin(struct ichabod_bin_s* pthis) {
                     GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
                     on_video_downstream,
                     pthis, NULL);
+  gst_pad_add_probe(vsrc_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_raw_video_buffer, pthis, NULL);
 
   // configure audio source pad callback(s)
   GstPad* asrc_pad = gst_element_get_static_pad(pthis->asource, "src");
@@ -210,28 +592,21 @@ int setup_bin(struct ichabod_bin_s* pthis) {
   // when the pipeline runs slowly
   g_object_set(G_OBJECT(pthis->asource), "buffer-time", 5000000, NULL);
 
-  // configure video encoder
-  // TODO: switch encoding settings to bitrate target if RTMP sink is attached.
-  // presets indexed from x264.h x264_preset_names - ** INDEXING STARTS AT 1 **
-  g_object_set(G_OBJECT(pthis->venc), "speed-preset", 1, NULL);
-  // experiment: fixed keyframe rate for rtmp streams
-  g_object_set(G_OBJECT(pthis->venc), "key-int-max", 60, NULL);
-  // x264.tune = zerolatency
-  //g_object_set(G_OBJECT(pthis->venc), "tune", 4, NULL);
-  // pass values indexed from gstx264enc.c. Not sure how to reference the actual
-  // object, so for testing purposes, 5=crf, 4=qp, 0=cbr. :-|
-  g_object_set(G_OBJECT(pthis->venc), "pass", 5, NULL);
-  g_object_set(G_OBJECT(pthis->venc), "qp-min", 16, NULL);
-  g_object_set(G_OBJECT(pthis->venc), "qp-max", 22, NULL);
-  // in crf, this sets crf. in qp, this sets qp. FUN. :-|
-  g_object_set(G_OBJECT(pthis->venc), "quantizer", 18, NULL);
-  // in crf, bitrate property is just a max limit to prevent runaway filesize
-  g_object_set(G_OBJECT(pthis->venc), "bitrate", 4096, NULL);
+  // keep faac idle until the first output is attached. Buffers are dropped
+  // rather than blocked so capture and the raw audio tee keep running. The
+  // video encoders do the same (see add_video_encoder).
+  GstPad* aenc_sink_pad = gst_element_get_static_pad(pthis->aenc, "sink");
+  gst_pad_add_probe(aenc_sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_idle_encoder_buffer, &pthis->audio_encoding, NULL);
+  gst_object_unref(aenc_sink_pad);
+  aenc_sink_pad = NULL;
+
+  watch_video_decoder(pthis);
 
   // configure constant fps filter
   // TODO: Framerate be configurable
 #define OUTPUT_VIDEO_FPS 30
-  // TODO: Periodically dump add/drop stats from videorate while in main loop.
+  // add/drop stats are exported with the metrics (see on_collect_metrics)
   g_object_set (G_OBJECT (pthis->vfps), "max-rate", OUTPUT_VIDEO_FPS, NULL);
   g_object_set (G_OBJECT (pthis->vfps), "silent", TRUE, NULL);
   g_object_set (G_OBJECT (pthis->vfps), "skip-to-first", FALSE, NULL);
@@ -247,9 +622,13 @@ int setup_bin(struct ichabod_bin_s* pthis) {
 
   // start with audio and video flows blocked from multiplexer, to allow full
   // pipeline pre-roll before writing to file
-  g_object_set(G_OBJECT(pthis->video_out_valve), "drop", TRUE, NULL);
   g_object_set(G_OBJECT(pthis->audio_out_valve), "drop", TRUE, NULL);
 
+  // encoder branches come and go with outputs; until the first, decoded
+  // video has nowhere to go and that is fine
+  g_object_set(G_OBJECT(pthis->video_raw_tee),
+               "allow-not-linked", TRUE, NULL);
+
   // Allow output sinks to run even when we have no outputs attached
 //  g_object_set(G_OBJECT(pthis->audio_enc_tee), "allow-not-linked", TRUE, NULL);
 //  g_object_set(G_OBJECT(pthis->video_tee), "allow-not-linked", TRUE, NULL);
@@ -260,7 +639,7 @@ int setup_bin(struct ichabod_bin_s* pthis) {
 
   /* we add a message handler */
   GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE(pthis->pipeline));
-  pthis->bus_watch_id = gst_bus_add_watch(bus, on_gst_bus, pthis->loop);
+  pthis->bus_watch_id = gst_bus_add_watch(bus, on_gst_bus, pthis);
   gst_object_unref(bus);
 
   // add all elements into the pipeline
@@ -268,7 +647,7 @@ int setup_bin(struct ichabod_bin_s* pthis) {
                    pthis->vsource,
                    pthis->vfps,
                    pthis->imgdec,
-                   pthis->venc,
+                   pthis->video_raw_tee,
                    pthis->asource,
                    pthis->afps,
                    pthis->aconv,
@@ -276,9 +655,7 @@ int setup_bin(struct ichabod_bin_s* pthis) {
                    pthis->aenc,
                    pthis->mqueue_src,
                    pthis->audio_out_valve,
-                   pthis->video_out_valve,
                    pthis->audio_enc_tee,
-                   pthis->video_tee,
                    //pthis->fake_mux_asink,
                    //pthis->fake_mux_vsink,
                    NULL);
@@ -292,6 +669,7 @@ int setup_bin(struct ichabod_bin_s* pthis) {
 
   GstPadLinkReturn link_ret = gst_pad_link(vsrc_pad, mqueue_sink_v_pad);
   link_ret = gst_pad_link(mqueue_src_v_pad, imgdec_sink);
+  watch_queue_stream(pthis, "raw_video", mqueue_sink_v_pad, mqueue_src_v_pad);
 
   GstCaps* vcaps_variable_fps =
   gst_caps_new_simple("video/x-raw",
@@ -303,18 +681,14 @@ int setup_bin(struct ichabod_bin_s* pthis) {
                       NULL);
 
   gst_element_link_filtered(pthis->imgdec, pthis->vfps, vcaps_variable_fps);
-  gst_element_link_filtered(pthis->vfps, pthis->venc, vcaps_constant_fps);
+  gst_element_link_filtered(pthis->vfps, pthis->video_raw_tee,
+                            vcaps_constant_fps);
 
   gst_caps_unref(vcaps_variable_fps);
   gst_caps_unref(vcaps_constant_fps);
   vcaps_variable_fps = NULL;
   vcaps_constant_fps = NULL;
 
-  gboolean result = gst_element_link_many(pthis->venc,
-                                          pthis->video_out_valve,
-                                          pthis->video_tee,
-                                          NULL);
-
   // audio element chain
   GstPad* mqueue_sink_a_pad =
   gst_element_get_request_pad(pthis->mqueue_src, "sink_1");
@@ -329,8 +703,9 @@ int setup_bin(struct ichabod_bin_s* pthis) {
                                             mqueue_sink_a_pad, acaps);
   link_ret = gst_pad_link(asrc_pad, mqueue_sink_a_pad);
   link_ret = gst_pad_link(mqueue_src_a_pad, aconv_sink);
+  watch_queue_stream(pthis, "raw_audio", mqueue_sink_a_pad, mqueue_src_a_pad);
 
-  result = gst_element_link_filtered(pthis->aconv, pthis->afps, acaps);
+  gboolean result = gst_element_link_filtered(pthis->aconv, pthis->afps, acaps);
   result = gst_element_link_many(pthis->afps,
                                  pthis->audio_raw_tee,
                                  pthis->aenc,
@@ -356,9 +731,14 @@ int setup_bin(struct ichabod_bin_s* pthis) {
 
 #pragma mark - Statics
 
+// call with lock held
 static void open_pipeline_valves(struct ichabod_bin_s* pthis) {
   g_print("ichabod: open pipeline (sync)\n");
-  g_object_set(G_OBJECT(pthis->video_out_valve), "drop", FALSE, NULL);
+  for (guint i = 0; i < pthis->video_encoders->len; i++) {
+    struct video_encoder_s* encoder =
+    g_ptr_array_index(pthis->video_encoders, i);
+    g_object_set(G_OBJECT(encoder->valve), "drop", FALSE, NULL);
+  }
   g_object_set(G_OBJECT(pthis->audio_out_valve), "drop", FALSE, NULL);
 }
 
@@ -413,18 +793,469 @@ static GstPadProbeReturn on_video_downstream
   return GST_PAD_PROBE_PASS;
 }
 
+static GstPadProbeReturn on_idle_encoder_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  gint* encoding = p_user;
+  if (g_atomic_int_get(encoding)) {
+    return GST_PAD_PROBE_REMOVE;
+  }
+  return GST_PAD_PROBE_DROP;
+}
+
+/* A new branch off the encoded video tee would otherwise open on whatever
+ * delta frame is passing, and the muxer has to wait for the next IDR, up to
+ * key-int-max frames away. Drop on this branch alone until a keyframe
+ * arrives; dropping rather than blocking leaves the other outputs running.
+ */
+static void hold_output_for_keyframe(GstPad* video_tee_src_pad) {
+  gst_pad_add_probe(video_tee_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_output_wait_keyframe, NULL, NULL);
+}
+
+static GstPadProbeReturn on_output_wait_keyframe
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    return GST_PAD_PROBE_DROP;
+  }
+  g_print("ichabod_bin: output starts on keyframe at %" GST_TIME_FORMAT "\n",
+          GST_TIME_ARGS(GST_BUFFER_PTS(buffer)));
+  return GST_PAD_PROBE_REMOVE;
+}
+
+// "dense" trades a little compression for memory and CPU per session
+#define DENSE_RC_LOOKAHEAD 10
+
+static int x264_frame_count(const char* value) {
+  int frames = atoi(value);
+  return frames > 0 ? frames : ICHABOD_X264_NONE;
+}
+
+int ichabod_x264_option_set(struct ichabod_x264_options_s* options,
+                            const char* key, const char* value)
+{
+  if (!strcmp("preset", key)) {
+    options->preset = value;
+  } else if (!strcmp("sessions_per_host", key)) {
+    options->sessions_per_host = atoi(value);
+  } else if (!strcmp("threads", key)) {
+    options->threads = atoi(value);
+  } else if (!strcmp("sliced_threads", key)) {
+    options->sliced_threads = atoi(value) ? 1 : ICHABOD_X264_NONE;
+  } else if (!strcmp("rc_lookahead", key)) {
+    options->rc_lookahead = x264_frame_count(value);
+  } else if (!strcmp("b_frames", key)) {
+    options->b_frames = x264_frame_count(value);
+  } else if (!strcmp("tune", key)) {
+    options->tune = value;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// Fill in whatever the caller left unset from the named preset
+static void apply_x264_preset(struct ichabod_x264_options_s* options) {
+  if (!options->preset) {
+    return;
+  }
+  if (!strcmp("dense", options->preset)) {
+    if (!options->threads) {
+      int cores = g_get_num_processors();
+      int sessions =
+      options->sessions_per_host > 0 ? options->sessions_per_host : cores;
+      options->threads = MAX(1, cores / sessions);
+    }
+    if (!options->rc_lookahead) {
+      options->rc_lookahead = DENSE_RC_LOOKAHEAD;
+    }
+  } else if (!strcmp("low-latency", options->preset)) {
+    // x264enc applies its own property defaults over the tune, so spell out
+    // what zerolatency would otherwise have set
+    if (!options->tune) {
+      options->tune = "zerolatency";
+    }
+    if (!options->sliced_threads) {
+      options->sliced_threads = 1;
+    }
+    if (!options->rc_lookahead) {
+      options->rc_lookahead = ICHABOD_X264_NONE;
+    }
+    if (!options->b_frames) {
+      options->b_frames = ICHABOD_X264_NONE;
+    }
+  } else {
+    g_print("ichabod_bin: WARNING: unknown x264 preset %s\n",
+            options->preset);
+  }
+  options->preset = NULL;
+}
+
+static void apply_x264_options(GstElement* venc,
+                               const struct ichabod_x264_options_s* options)
+{
+  if (options->threads > 0) {
+    g_object_set(G_OBJECT(venc), "threads", (guint)options->threads, NULL);
+  }
+  if (options->sliced_threads) {
+    g_object_set(G_OBJECT(venc), "sliced-threads",
+                 options->sliced_threads > 0, NULL);
+  }
+  if (options->rc_lookahead) {
+    g_object_set(G_OBJECT(venc), "rc-lookahead",
+                 MAX(0, options->rc_lookahead), NULL);
+  }
+  if (options->b_frames) {
+    g_object_set(G_OBJECT(venc), "bframes",
+                 (guint)MAX(0, options->b_frames), NULL);
+  }
+  if (options->tune) {
+    // flags, so let gst parse "zerolatency+fastdecode" and friends
+    gst_util_set_object_arg(G_OBJECT(venc), "tune", options->tune);
+  }
+}
+
+static gboolean same_encoder_profile(const struct ichabod_encoder_profile_s* a,
+                                     const struct ichabod_encoder_profile_s* b)
+{
+  return a->rate_control == b->rate_control &&
+  (ichabod_rate_control_cbr == a->rate_control || a->quality == b->quality) &&
+  a->bitrate == b->bitrate &&
+  a->key_int_max == b->key_int_max &&
+  !g_strcmp0(a->h264_profile, b->h264_profile) &&
+  !g_strcmp0(a->encoder, b->encoder);
+}
+
+static void encoder_settings_from_profile
+(struct ichabod_bin_s* pthis, const struct ichabod_encoder_profile_s* profile,
+ struct encoder_backend_settings_s* settings)
+{
+  settings->rate_control =
+  ichabod_rate_control_cbr == profile->rate_control ?
+  encoder_rate_control_cbr : encoder_rate_control_quality;
+  settings->quality = profile->quality;
+  settings->bitrate = profile->bitrate;
+  settings->key_int_max = profile->key_int_max;
+  // the session's thread budget holds whatever the encoder
+  settings->threads = MAX(0, pthis->x264.threads);
+}
+
+/* Build an encoder branch off the decoded video tee. Works on a running
+ * pipeline: the branch is linked up and brought to the pipeline's state
+ * before the tee pad feeding it exists. profile->encoder must be resolved.
+ */
+static struct video_encoder_s* add_video_encoder
+(struct ichabod_bin_s* pthis, const struct ichabod_encoder_profile_s* profile,
+ const struct encoder_backend_s* backend)
+{
+  g_print("ichabod_bin: adding %s video encoder (%s)\n", profile->name,
+          profile->encoder);
+  struct video_encoder_s* encoder = g_new0(struct video_encoder_s, 1);
+  encoder->bin = pthis;
+  encoder->profile = *profile;
+  encoder->profile.name = g_strdup(profile->name);
+  encoder->profile.h264_profile = g_strdup(profile->h264_profile);
+  encoder->profile.encoder = g_strdup(profile->encoder);
+  encoder->backend = backend;
+  encoder->last_encoded_pts = GST_CLOCK_TIME_NONE;
+  encoder->bitrate_window_start = GST_CLOCK_TIME_NONE;
+
+  struct encoder_backend_settings_s settings = { 0 };
+  encoder_settings_from_profile(pthis, profile, &settings);
+  encoder->venc = encoder_backend_make(backend, &settings);
+  encoder->valve = gst_element_factory_make("valve", NULL);
+  encoder->tee = gst_element_factory_make("tee", NULL);
+  g_assert(encoder->venc && encoder->valve && encoder->tee);
+  if (!strcmp("x264", encoder_backend_get_name(backend))) {
+    apply_x264_options(encoder->venc, &pthis->x264);
+  }
+
+  // keep the encoder idle until an output needs it (see start_encoding).
+  // Buffers are dropped rather than blocked so decode and the other
+  // encoders keep running, and the first frame encoded is a current one.
+  GstPad* venc_sink_pad = gst_element_get_static_pad(encoder->venc, "sink");
+  gst_pad_add_probe(venc_sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_idle_encoder_buffer, &encoder->encoding, NULL);
+  gst_object_unref(venc_sink_pad);
+  GstPad* venc_src_pad = gst_element_get_static_pad(encoder->venc, "src");
+  gst_pad_add_probe(venc_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_encoded_video_buffer, encoder, NULL);
+  gst_object_unref(venc_src_pad);
+
+  GstElement* chain[5];
+  int chain_length = 0;
+  g_mutex_lock(&pthis->lock);
+  if (pthis->video_encoders->len) {
+    // the first encoder runs on videorate's thread; the rest get their own.
+    // Bounded by time alone: a few raw frames would hit the byte limit.
+    GstElement* queue = gst_element_factory_make("queue", NULL);
+    g_object_set(G_OBJECT(queue),
+                 "max-size-time", GST_SECOND,
+                 "max-size-bytes", 0,
+                 "max-size-buffers", 0,
+                 NULL);
+    chain[chain_length++] = queue;
+  }
+  // held closed with the rest until audio and video are both live
+  g_object_set(G_OBJECT(encoder->valve),
+               "drop", !pthis->pipe_open_requested, NULL);
+  g_ptr_array_add(pthis->video_encoders, encoder);
+  g_mutex_unlock(&pthis->lock);
+
+  chain[chain_length++] = encoder->venc;
+  const char* media_type = encoder_backend_get_media_type(backend);
+  if (profile->h264_profile && !strcmp("video/x-h264", media_type)) {
+    // H.264 encoders pick their profile from what downstream accepts
+    GstElement* filter = gst_element_factory_make("capsfilter", NULL);
+    GstCaps* caps = gst_caps_new_simple(media_type,
+                                        "profile", G_TYPE_STRING,
+                                        profile->h264_profile,
+                                        NULL);
+    g_object_set(G_OBJECT(filter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    chain[chain_length++] = filter;
+  }
+  chain[chain_length++] = encoder->valve;
+  chain[chain_length++] = encoder->tee;
+
+  for (int i = 0; i < chain_length; i++) {
+    ichabod_bin_add_element(pthis, chain[i]);
+    if (i > 0) {
+      gboolean linked = gst_element_link(chain[i - 1], chain[i]);
+      g_assert(linked);
+    }
+  }
+  GstPad* raw_tee_src_pad =
+  gst_element_get_request_pad(pthis->video_raw_tee, "src_%u");
+  GstPad* branch_sink_pad = gst_element_get_static_pad(chain[0], "sink");
+  GstPadLinkReturn ret = gst_pad_link(raw_tee_src_pad, branch_sink_pad);
+  g_assert(!ret);
+  gst_object_unref(branch_sink_pad);
+  gst_object_unref(raw_tee_src_pad);
+  return encoder;
+}
+
+static void video_encoder_free(gpointer p) {
+  struct video_encoder_s* encoder = p;
+  g_free((char*)encoder->profile.name);
+  g_free((char*)encoder->profile.h264_profile);
+  g_free((char*)encoder->profile.encoder);
+  g_free(encoder);
+}
+
+/* The encoder for this profile, shared if one exists, using a codec the
+ * output accepts. profile NULL: ichabod_encoder_profile_file.
+ */
+static struct video_encoder_s* get_video_encoder
+(struct ichabod_bin_s* pthis, const struct ichabod_encoder_profile_s* profile,
+ GstCaps* accepted)
+{
+  if (!profile) {
+    profile = &ichabod_encoder_profile_file;
+  }
+  const struct encoder_backend_s* backend =
+  ichabod_bin_resolve_video_encoder(pthis, profile->encoder);
+  g_assert(backend);
+  GstCaps* caps =
+  gst_caps_new_empty_simple(encoder_backend_get_media_type(backend));
+  if (!gst_caps_can_intersect(caps, accepted)) {
+    g_print("ichabod_bin: %s output can't carry %s, using %s\n",
+            profile->name, encoder_backend_get_name(backend),
+            ENCODER_BACKEND_DEFAULT);
+    backend = encoder_backend_find(ENCODER_BACKEND_DEFAULT);
+    g_assert(backend);
+  }
+  gst_caps_unref(caps);
+  struct ichabod_encoder_profile_s resolved = *profile;
+  resolved.encoder = encoder_backend_get_name(backend);
+
+  struct video_encoder_s* encoder = NULL;
+  g_mutex_lock(&pthis->encoder_setup_lock);
+  g_mutex_lock(&pthis->lock);
+  for (guint i = 0; i < pthis->video_encoders->len && !encoder; i++) {
+    struct video_encoder_s* candidate =
+    g_ptr_array_index(pthis->video_encoders, i);
+    if (same_encoder_profile(&candidate->profile, &resolved)) {
+      encoder = candidate;
+    }
+  }
+  g_mutex_unlock(&pthis->lock);
+  if (encoder) {
+    g_print("ichabod_bin: sharing %s video encoder with %s output\n",
+            encoder->profile.name, profile->name);
+  } else {
+    encoder = add_video_encoder(pthis, &resolved, backend);
+  }
+  g_mutex_unlock(&pthis->encoder_setup_lock);
+  return encoder;
+}
+
+/* Let buffers through to the encoders. A video encoder that has not seen a
+ * frame yet opens the stream with a keyframe; one already running is asked
+ * for one now, for the output just attached. faac needs no such care. Call
+ * after the output is linked, or the keyframe may go to an unlinked pad.
+ */
+static void start_encoding(struct ichabod_bin_s* pthis,
+                           struct video_encoder_s* encoder, gboolean audio)
+{
+  if (!g_atomic_int_get(&encoder->encoding)) {
+    g_print("ichabod_bin: starting %s video encoder\n",
+            encoder->profile.name);
+    g_atomic_int_set(&encoder->encoding, 1);
+  } else {
+    g_print("ichabod_bin: requesting keyframe from %s video encoder\n",
+            encoder->profile.name);
+    GstEvent* event =
+    gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE,
+                                                TRUE, 0);
+    GstPad* venc_src_pad = gst_element_get_static_pad(encoder->venc, "src");
+    gst_pad_send_event(venc_src_pad, event);
+    gst_object_unref(venc_src_pad);
+  }
+  if (audio && !g_atomic_int_get(&pthis->audio_encoding)) {
+    g_print("ichabod_bin: starting audio encoder\n");
+    g_atomic_int_set(&pthis->audio_encoding, 1);
+  }
+}
+
+// call with lock held
+static void update_encoder_lag(struct ichabod_bin_s* pthis) {
+  if (!GST_CLOCK_TIME_IS_VALID(pthis->last_raw_pts) ||
+      !GST_CLOCK_TIME_IS_VALID(pthis->last_encoded_pts))
+  {
+    return;
+  }
+  GstClockTimeDiff lag =
+  GST_CLOCK_DIFF(pthis->last_encoded_pts, pthis->last_raw_pts);
+  if (!pthis->encoder_lagging && lag > MAX_ENCODER_LAG) {
+    pthis->encoder_lagging = TRUE;
+    update_flow_control(pthis);
+  } else if (pthis->encoder_lagging && lag < MAX_ENCODER_LAG / 2) {
+    pthis->encoder_lagging = FALSE;
+    update_flow_control(pthis);
+  }
+}
+
+static GstPadProbeReturn on_raw_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  struct ichabod_bin_s* pthis = p_user;
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  g_mutex_lock(&pthis->lock);
+  pthis->last_raw_pts = GST_BUFFER_PTS(buffer);
+  update_encoder_lag(pthis);
+  g_mutex_unlock(&pthis->lock);
+  return GST_PAD_PROBE_OK;
+}
+
+// call with lock held. Bitrate over the last full second of stream time.
+static void update_encoder_bitrate(struct video_encoder_s* encoder,
+                                   GstBuffer* buffer)
+{
+  gsize size = gst_buffer_get_size(buffer);
+  GstClockTime pts = GST_BUFFER_PTS(buffer);
+  encoder->encoded_bytes += size;
+  encoder->encoded_frames++;
+  if (!GST_CLOCK_TIME_IS_VALID(pts)) {
+    return;
+  }
+  if (!GST_CLOCK_TIME_IS_VALID(encoder->bitrate_window_start) ||
+      pts < encoder->bitrate_window_start)
+  {
+    encoder->bitrate_window_start = pts;
+    encoder->bitrate_window_bytes = 0;
+  }
+  GstClockTime elapsed = pts - encoder->bitrate_window_start;
+  if (elapsed >= GST_SECOND) {
+    encoder->bitrate =
+    gst_util_uint64_scale(encoder->bitrate_window_bytes * 8, GST_SECOND,
+                          elapsed);
+    encoder->bitrate_window_start = pts;
+    encoder->bitrate_window_bytes = 0;
+  }
+  encoder->bitrate_window_bytes += size;
+}
+
+// call with lock held. Flow control follows the encoder furthest behind.
+static void update_last_encoded_pts(struct ichabod_bin_s* pthis) {
+  pthis->last_encoded_pts = GST_CLOCK_TIME_NONE;
+  for (guint i = 0; i < pthis->video_encoders->len; i++) {
+    struct video_encoder_s* encoder =
+    g_ptr_array_index(pthis->video_encoders, i);
+    GstClockTime pts = encoder->last_encoded_pts;
+    if (GST_CLOCK_TIME_IS_VALID(pts) &&
+        (!GST_CLOCK_TIME_IS_VALID(pthis->last_encoded_pts) ||
+         pts < pthis->last_encoded_pts))
+    {
+      pthis->last_encoded_pts = pts;
+    }
+  }
+}
+
+static GstPadProbeReturn on_encoded_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  struct video_encoder_s* encoder = p_user;
+  struct ichabod_bin_s* pthis = encoder->bin;
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  g_mutex_lock(&pthis->lock);
+  encoder->last_encoded_pts = GST_BUFFER_PTS(buffer);
+  update_last_encoded_pts(pthis);
+  update_encoder_lag(pthis);
+  update_encoder_bitrate(encoder, buffer);
+  g_mutex_unlock(&pthis->lock);
+  // only the first encode of a frame is recorded
+  latency_tracker_frame_encoded(pthis->latency, GST_BUFFER_PTS(buffer));
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_decoded_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  struct ichabod_bin_s* pthis = p_user;
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  latency_tracker_frame_decoded(pthis->latency, GST_BUFFER_PTS(buffer));
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_mux_video_buffer
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  struct mux_probe_s* probe = p_user;
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  latency_tracker_frame_muxed(probe->bin->latency, probe->output,
+                              GST_BUFFER_PTS(buffer));
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean on_latency_report(gpointer p) {
+  struct ichabod_bin_s* pthis = p;
+  latency_tracker_print(pthis->latency, pthis->session_id);
+  return G_SOURCE_CONTINUE;
+}
+
+// Pipeline reached EOS or failed. Hand control back to whoever runs the loop.
+static void on_pipeline_finished(struct ichabod_bin_s* pthis) {
+  if (pthis->on_finished) {
+    pthis->on_finished(pthis, pthis->finished_p);
+  } else {
+    g_main_loop_quit(pthis->loop);
+  }
+}
 
 static gboolean on_gst_bus(GstBus* bus, GstMessage* msg, gpointer data)
 {
   g_print("ichabod_bin: on_gst_bus\n");
-  GMainLoop* loop = (GMainLoop*)data;
+  struct ichabod_bin_s* pthis = (struct ichabod_bin_s*)data;
 
   switch (GST_MESSAGE_TYPE(msg)) {
 
     case GST_MESSAGE_EOS:
     {
       g_print("End of stream\n");
-      g_main_loop_quit(loop);
+      on_pipeline_finished(pthis);
       break;
     }
     case GST_MESSAGE_ERROR: {
@@ -437,7 +1268,7 @@ static gboolean on_gst_bus(GstBus* bus, GstMessage* msg, gpointer data)
       g_printerr ("Error: %s\n", error->message);
       g_error_free (error);
 
-      g_main_loop_quit (loop);
+      on_pipeline_finished(pthis);
       break;
     }
 
@@ -484,7 +1315,7 @@ static gboolean on_gst_bus(GstBus* bus, GstMessage* msg, gpointer data)
 
 #pragma mark - external bin control
 
-int ichabod_bin_start(struct ichabod_bin_s* pthis) {
+int ichabod_bin_start_async(struct ichabod_bin_s* pthis) {
   GstStateChangeReturn result;
 
   result = gst_bin_sync_children_states(GST_BIN(pthis->pipeline));
@@ -499,31 +1330,68 @@ int ichabod_bin_start(struct ichabod_bin_s* pthis) {
   int horseman_started = horseman_start(pthis->horseman);
   assert(!horseman_started);
 
+  pthis->latency_report_id =
+  g_timeout_add_seconds(LATENCY_REPORT_INTERVAL_SECONDS,
+                        on_latency_report, pthis);
+
   GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(pthis->pipeline),
                             GST_DEBUG_GRAPH_SHOW_ALL,
                             "pipeline");
+  return 0;
+}
+
+int ichabod_bin_start(struct ichabod_bin_s* pthis) {
+  if (ichabod_bin_start_async(pthis)) {
+    return -1;
+  }
 
-  // TODO: This should be in it's own thread and obey stop/start cycles.
   /* Iterate */
   g_print("Running...\n");
   g_main_loop_run(pthis->loop);
 
+  return ichabod_bin_stop(pthis);
+}
+
+int ichabod_bin_stop(struct ichabod_bin_s* pthis) {
+  if (!pthis->pipeline) {
+    return -1;
+  }
+
   horseman_stop(pthis->horseman);
 
+  struct horseman_stats_s hstats;
+  struct screencast_src_stats_s sstats;
+  horseman_get_stats(pthis->horseman, &hstats);
+  screencast_src_get_stats(pthis->screencast_src, &sstats);
+  g_print("ichabod_bin: frames received %lu, dropped %lu, coalesced %lu; "
+          "pushed %lu, skipped %lu, coalesced %lu, duplicate %lu\n",
+          hstats.frames_received, hstats.frames_dropped,
+          hstats.frames_coalesced, sstats.frames_pushed,
+          sstats.frames_skipped, sstats.frames_coalesced,
+          sstats.frames_duplicate);
+  if (pthis->metrics_source_id) {
+    metrics_server_remove_source(pthis->metrics, pthis->metrics_source_id);
+    pthis->metrics_source_id = 0;
+  }
+  if (pthis->latency_report_id) {
+    g_source_remove(pthis->latency_report_id);
+    pthis->latency_report_id = 0;
+  }
+  latency_tracker_print(pthis->latency, pthis->session_id);
+
   /* Out of the main loop, clean up nicely */
   g_print("Returned, stopping playback\n");
   gst_element_set_state(pthis->pipeline, GST_STATE_NULL);
 
   g_print("Deleting pipeline\n");
   gst_object_unref(GST_OBJECT(pthis->pipeline));
+  pthis->pipeline = NULL;
   g_source_remove(pthis->bus_watch_id);
-  g_main_loop_unref(pthis->loop);
+  pthis->bus_watch_id = 0;
 
   return 0;
 }
 
-int ichabod_bin_stop(struct ichabod_bin_s* ichabod_bin);
-
 /* Even internally, this should be preferred over gst_bin_add for any
  * changes that could happen after preflight has finished. Without the sync
  * call, dynamic pipeline changes will not take effect.
@@ -534,13 +1402,35 @@ int ichabod_bin_add_element(struct ichabod_bin_s* bin, GstElement* element) {
   return ret;
 }
 
+const struct encoder_backend_s* ichabod_bin_resolve_video_encoder
+(struct ichabod_bin_s* pthis, const char* name)
+{
+  const struct encoder_backend_s* backend = NULL;
+  if (name) {
+    backend = encoder_backend_find(name);
+  }
+  if (!backend) {
+    backend = encoder_backend_find(pthis->video_encoder);
+  }
+  if (!backend) {
+    backend = encoder_backend_find(ENCODER_BACKEND_DEFAULT);
+  }
+  return backend;
+}
+
 int ichabod_bin_attach_mux_sink_pad
-(struct ichabod_bin_s* pthis, GstPad* audio_sink, GstPad* video_sink)
+(struct ichabod_bin_s* pthis, const struct ichabod_encoder_profile_s* profile,
+ GstPad* audio_sink, GstPad* video_sink)
 {
+  GstCaps* video_caps = gst_pad_query_caps(video_sink, NULL);
+  struct video_encoder_s* encoder =
+  get_video_encoder(pthis, profile, video_caps);
+  gst_caps_unref(video_caps);
   GstPad* a_tee_src_pad =
   gst_element_get_request_pad(pthis->audio_enc_tee, "src_%u");
   GstPad* v_tee_src_pad =
-  gst_element_get_request_pad(pthis->video_tee, "src_%u");
+  gst_element_get_request_pad(encoder->tee, "src_%u");
+  hold_output_for_keyframe(v_tee_src_pad);
 
   GstElement* mqueue = gst_element_factory_make("multiqueue", NULL);
   ichabod_bin_add_element(pthis, mqueue);
@@ -557,8 +1447,27 @@ int ichabod_bin_attach_mux_sink_pad
   GstPadLinkReturn vq_ret = gst_pad_link(v_tee_src_pad, mqueue_v_sink_pad);
   GstPadLinkReturn vs_ret = gst_pad_link(mqueue_v_src_pad, video_sink);
 
+  // measure encoder -> mux input per output, named after the muxer
+  GstElement* mux = gst_pad_get_parent_element(video_sink);
+  gchar* mux_name = mux ? gst_element_get_name(mux) : g_strdup("output");
+  char watch_name[64];
+  snprintf(watch_name, sizeof(watch_name), "%s_video", mux_name);
+  watch_queue_stream(pthis, watch_name, mqueue_v_sink_pad, mqueue_v_src_pad);
+  snprintf(watch_name, sizeof(watch_name), "%s_audio", mux_name);
+  watch_queue_stream(pthis, watch_name, mqueue_a_sink_pad, mqueue_a_src_pad);
+  struct mux_probe_s* probe = g_new0(struct mux_probe_s, 1);
+  probe->bin = pthis;
+  probe->output = latency_tracker_add_output(pthis->latency, mux_name);
+  gst_pad_add_probe(video_sink, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_mux_video_buffer, probe, g_free);
+  g_free(mux_name);
+  if (mux) {
+    gst_object_unref(mux);
+  }
+
   gst_object_unref(a_tee_src_pad);
   gst_object_unref(v_tee_src_pad);
+  start_encoding(pthis, encoder, TRUE);
   return aq_ret & as_ret & vq_ret & vs_ret;
 }
 
@@ -602,8 +1511,10 @@ GstPad* ichabod_bin_create_video_src(struct ichabod_bin_s* pthis, GstCaps* caps)
     g_assert(!strcmp("video/x-h264", name));
   }
 
+  struct video_encoder_s* encoder = get_video_encoder(pthis, NULL, caps);
   GstPad* v_tee_src_pad =
-  gst_element_get_request_pad(pthis->video_tee, "src_%u");
+  gst_element_get_request_pad(encoder->tee, "src_%u");
+  hold_output_for_keyframe(v_tee_src_pad);
 
   gchar* pad_name = gst_pad_get_name(v_tee_src_pad);
   char queue_name[32];
@@ -618,6 +1529,8 @@ GstPad* ichabod_bin_create_video_src(struct ichabod_bin_s* pthis, GstCaps* caps)
 
   GstPadLinkReturn ret = gst_pad_link(v_tee_src_pad, queue_sink_pad);
   g_assert(!ret);
+  // audio for this consumer comes off the raw tee; only video is encoded
+  start_encoding(pthis, encoder, FALSE);
   return queue_src_pad;
 }
 
@@ -629,3 +1542,308 @@ void ichabod_bin_set_rtp_relay(struct ichabod_bin_s* pthis,
   gboolean ret = ichabod_bin_add_element(pthis, relay_element);
   g_assert(ret);
 }
+
+#pragma mark - Metrics
+
+static GstPadProbeReturn on_queue_in
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  struct queue_watch_s* watch = p_user;
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+    __atomic_store_n(&watch->in_pts, GST_BUFFER_PTS(buffer), __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&watch->in_buffers, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&watch->in_bytes, gst_buffer_get_size(buffer),
+                     __ATOMIC_RELAXED);
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_queue_out
+(GstPad *pad, GstPadProbeInfo *info, gpointer p_user)
+{
+  struct queue_watch_s* watch = p_user;
+  GstBuffer* buffer = gst_pad_probe_info_get_buffer(info);
+  if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+    __atomic_store_n(&watch->out_pts, GST_BUFFER_PTS(buffer),
+                     __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&watch->out_buffers, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&watch->out_bytes, gst_buffer_get_size(buffer),
+                     __ATOMIC_RELAXED);
+  return GST_PAD_PROBE_OK;
+}
+
+static void watch_queue_stream(struct ichabod_bin_s* pthis, const char* name,
+                               GstPad* sink_pad, GstPad* src_pad)
+{
+  struct queue_watch_s* watch =
+  (struct queue_watch_s*)calloc(1, sizeof(struct queue_watch_s));
+  snprintf(watch->name, sizeof(watch->name), "%s", name);
+  watch->in_pts = GST_CLOCK_TIME_NONE;
+  watch->out_pts = GST_CLOCK_TIME_NONE;
+  // outputs attach from the horseman thread while scrapes read the array
+  g_mutex_lock(&pthis->lock);
+  g_ptr_array_add(pthis->queue_watches, watch);
+  g_mutex_unlock(&pthis->lock);
+  gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_queue_in, watch, NULL);
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    on_queue_out, watch, NULL);
+}
+
+static void collect_queue_watch(struct metrics_s* metrics,
+                                struct queue_watch_s* watch,
+                                const char* labels)
+{
+  char queue_labels[256];
+  snprintf(queue_labels, sizeof(queue_labels), "%s", labels);
+  metrics_label_append(queue_labels, sizeof(queue_labels),
+                       "queue", watch->name);
+  guint64 in_buffers = __atomic_load_n(&watch->in_buffers, __ATOMIC_RELAXED);
+  guint64 out_buffers =
+  __atomic_load_n(&watch->out_buffers, __ATOMIC_RELAXED);
+  guint64 in_bytes = __atomic_load_n(&watch->in_bytes, __ATOMIC_RELAXED);
+  guint64 out_bytes = __atomic_load_n(&watch->out_bytes, __ATOMIC_RELAXED);
+  GstClockTime in_pts = __atomic_load_n(&watch->in_pts, __ATOMIC_RELAXED);
+  GstClockTime out_pts = __atomic_load_n(&watch->out_pts, __ATOMIC_RELAXED);
+  GstClockTime level_time = 0;
+  if (GST_CLOCK_TIME_IS_VALID(in_pts) && GST_CLOCK_TIME_IS_VALID(out_pts) &&
+      in_pts > out_pts)
+  {
+    level_time = in_pts - out_pts;
+  }
+  metrics_add(metrics, metrics_type_gauge, "ichabod_queue_level_buffers",
+              "Buffers waiting in a queue", queue_labels,
+              in_buffers > out_buffers ? in_buffers - out_buffers : 0);
+  metrics_add(metrics, metrics_type_gauge, "ichabod_queue_level_bytes",
+              "Bytes waiting in a queue", queue_labels,
+              in_bytes > out_bytes ? in_bytes - out_bytes : 0);
+  metrics_add(metrics, metrics_type_gauge, "ichabod_queue_level_seconds",
+              "Stream time waiting in a queue", queue_labels,
+              (double)level_time / GST_SECOND);
+}
+
+// Plain queues (per-output raw and encoded taps) report their own levels
+static void collect_queue_elements(struct ichabod_bin_s* pthis,
+                                   struct metrics_s* metrics,
+                                   const char* labels)
+{
+  GstIterator* it = gst_bin_iterate_recurse(GST_BIN(pthis->pipeline));
+  GValue item = G_VALUE_INIT;
+  while (GST_ITERATOR_OK == gst_iterator_next(it, &item)) {
+    GstElement* element = GST_ELEMENT(g_value_get_object(&item));
+    GstElementFactory* factory = gst_element_get_factory(element);
+    const gchar* factory_name = factory ?
+    gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)) : NULL;
+    if (factory_name && !strcmp("queue", factory_name)) {
+      guint buffers = 0, bytes = 0;
+      guint64 time = 0;
+      g_object_get(G_OBJECT(element),
+                   "current-level-buffers", &buffers,
+                   "current-level-bytes", &bytes,
+                   "current-level-time", &time,
+                   NULL);
+      gchar* name = gst_element_get_name(element);
+      char queue_labels[256];
+      snprintf(queue_labels, sizeof(queue_labels), "%s", labels);
+      metrics_label_append(queue_labels, sizeof(queue_labels), "queue", name);
+      g_free(name);
+      metrics_add(metrics, metrics_type_gauge, "ichabod_queue_level_buffers",
+                  "Buffers waiting in a queue", queue_labels, buffers);
+      metrics_add(metrics, metrics_type_gauge, "ichabod_queue_level_bytes",
+                  "Bytes waiting in a queue", queue_labels, bytes);
+      metrics_add(metrics, metrics_type_gauge, "ichabod_queue_level_seconds",
+                  "Stream time waiting in a queue", queue_labels,
+                  (double)time / GST_SECOND);
+    }
+    g_value_reset(&item);
+  }
+  g_value_unset(&item);
+  gst_iterator_free(it);
+}
+
+static void collect_latency(struct ichabod_bin_s* pthis,
+                            struct metrics_s* metrics, const char* labels)
+{
+  struct latency_summary_s summaries[LATENCY_MAX_SUMMARIES];
+  int count = latency_tracker_snapshot(pthis->latency, summaries,
+                                       LATENCY_MAX_SUMMARIES, 0);
+  static const char* help =
+  "Frame latency per stage over the current reporting window";
+  for (int i = 0; i < count; i++) {
+    char stage_labels[256];
+    snprintf(stage_labels, sizeof(stage_labels), "%s", labels);
+    metrics_label_append(stage_labels, sizeof(stage_labels),
+                         "stage", summaries[i].name);
+    size_t len = strlen(stage_labels);
+    snprintf(stage_labels + len, sizeof(stage_labels) - len,
+             ",quantile=\"0.5\"");
+    metrics_add(metrics, metrics_type_gauge, "ichabod_frame_latency_seconds",
+                help, stage_labels, summaries[i].p50_ns / 1e9);
+    snprintf(stage_labels + len, sizeof(stage_labels) - len,
+             ",quantile=\"0.99\"");
+    metrics_add(metrics, metrics_type_gauge, "ichabod_frame_latency_seconds",
+                help, stage_labels, summaries[i].p99_ns / 1e9);
+    snprintf(stage_labels + len, sizeof(stage_labels) - len,
+             ",quantile=\"1\"");
+    metrics_add(metrics, metrics_type_gauge, "ichabod_frame_latency_seconds",
+                help, stage_labels, summaries[i].max_ns / 1e9);
+  }
+}
+
+static void on_collect_metrics(struct metrics_s* metrics, void* p) {
+  struct ichabod_bin_s* pthis = p;
+  if (!pthis->pipeline) {
+    return;
+  }
+  char labels[128] = "";
+  metrics_label_append(labels, sizeof(labels), "session",
+                       pthis->session_id ? pthis->session_id : "default");
+
+  guint64 in = 0, out = 0, dup = 0, drop = 0;
+  g_object_get(G_OBJECT(pthis->vfps), "in", &in, "out", &out,
+               "duplicate", &dup, "drop", &drop, NULL);
+  metrics_add(metrics, metrics_type_counter, "ichabod_videorate_in_total",
+              "Frames into videorate", labels, in);
+  metrics_add(metrics, metrics_type_counter, "ichabod_videorate_out_total",
+              "Frames out of videorate", labels, out);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_videorate_duplicated_total",
+              "Frames duplicated by videorate to fill gaps", labels, dup);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_videorate_dropped_total",
+              "Frames dropped by videorate", labels, drop);
+
+  guint64 add = 0;
+  drop = 0;
+  g_object_get(G_OBJECT(pthis->afps), "add", &add, "drop", &drop, NULL);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_audiorate_added_samples_total",
+              "Silence samples inserted by audiorate for gaps", labels, add);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_audiorate_dropped_samples_total",
+              "Overlapping samples dropped by audiorate", labels, drop);
+
+  guint64 appsrc_bytes = 0;
+  g_object_get(G_OBJECT(pthis->vsource),
+               "current-level-bytes", &appsrc_bytes, NULL);
+  metrics_add(metrics, metrics_type_gauge, "ichabod_appsrc_level_bytes",
+              "Bytes queued in the screencast appsrc", labels, appsrc_bytes);
+
+  g_mutex_lock(&pthis->lock);
+  for (guint i = 0; i < pthis->video_encoders->len; i++) {
+    struct video_encoder_s* encoder =
+    g_ptr_array_index(pthis->video_encoders, i);
+    char encoder_labels[256];
+    snprintf(encoder_labels, sizeof(encoder_labels), "%s", labels);
+    metrics_label_append(encoder_labels, sizeof(encoder_labels), "profile",
+                         encoder->profile.name);
+    metrics_label_append(encoder_labels, sizeof(encoder_labels), "encoder",
+                         encoder->profile.encoder);
+    metrics_add(metrics, metrics_type_counter,
+                "ichabod_video_encoded_bytes_total",
+                "Bytes out of the video encoder", encoder_labels,
+                encoder->encoded_bytes);
+    metrics_add(metrics, metrics_type_counter,
+                "ichabod_video_encoded_frames_total",
+                "Frames out of the video encoder", encoder_labels,
+                encoder->encoded_frames);
+    metrics_add(metrics, metrics_type_gauge,
+                "ichabod_video_encoder_bitrate_bps",
+                "Encoder output bitrate over the last second of stream time",
+                encoder_labels, encoder->bitrate);
+    metrics_add(metrics, metrics_type_gauge, "ichabod_video_encoder_active",
+                "1 once an output is attached and video is being encoded",
+                encoder_labels, g_atomic_int_get(&encoder->encoding));
+  }
+  double lag = 0;
+  if (GST_CLOCK_TIME_IS_VALID(pthis->last_raw_pts) &&
+      GST_CLOCK_TIME_IS_VALID(pthis->last_encoded_pts))
+  {
+    lag = (double)GST_CLOCK_DIFF(pthis->last_encoded_pts,
+                                 pthis->last_raw_pts) / GST_SECOND;
+  }
+  gboolean flow_paused = pthis->flow_paused;
+  g_mutex_unlock(&pthis->lock);
+  metrics_add(metrics, metrics_type_gauge, "ichabod_video_encoder_lag_seconds",
+              "Stream time between the newest input and the slowest "
+              "encoder's output", labels, lag);
+  metrics_add(metrics, metrics_type_gauge, "ichabod_horseman_paused",
+              "1 while the horseman is asked to pause for backpressure",
+              labels, flow_paused);
+
+  struct horseman_stats_s hstats;
+  horseman_get_stats(pthis->horseman, &hstats);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_horseman_frames_received_total",
+              "Frames received from the horseman", labels,
+              hstats.frames_received);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_horseman_frames_dropped_total",
+              "Frames dropped because the dispatch queue was full", labels,
+              hstats.frames_dropped);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_horseman_frames_coalesced_total",
+              "Frames skipped in favor of a newer one", labels,
+              hstats.frames_coalesced);
+  metrics_add(metrics, metrics_type_gauge,
+              "ichabod_horseman_queue_depth",
+              "Frames received but not yet dispatched", labels,
+              hstats.queue_depth);
+
+  struct screencast_src_stats_s sstats;
+  screencast_src_get_stats(pthis->screencast_src, &sstats);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_screencast_frames_pushed_total",
+              "Frames pushed into appsrc", labels, sstats.frames_pushed);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_screencast_frames_skipped_total",
+              "Frames skipped because appsrc was full", labels,
+              sstats.frames_skipped);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_screencast_frames_duplicate_total",
+              "Frames identical to the previous one, not decoded", labels,
+              sstats.frames_duplicate);
+  metrics_add(metrics, metrics_type_gauge,
+              "ichabod_screencast_clock_drift_ppm",
+              "Capture clock rate against the pipeline clock, from 1:1",
+              labels, sstats.clock_drift_ppm);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_screencast_tiles_applied_total",
+              "Tile updates composited onto the screencast canvas", labels,
+              sstats.tiles_applied);
+  metrics_add(metrics, metrics_type_counter,
+              "ichabod_screencast_tiles_failed_total",
+              "Tile updates dropped as malformed", labels,
+              sstats.tiles_failed);
+
+  if (pthis->jpeg_decoder) {
+    struct jpeg_decoder_stats_s dstats;
+    jpeg_decoder_get_stats(pthis->jpeg_decoder, &dstats);
+    metrics_add(metrics, metrics_type_counter,
+                "ichabod_jpeg_frames_decoded_total",
+                "Frames decoded by the parallel JPEG decoder", labels,
+                dstats.frames_decoded);
+    metrics_add(metrics, metrics_type_counter,
+                "ichabod_jpeg_frames_failed_total",
+                "Frames the parallel JPEG decoder could not decode", labels,
+                dstats.frames_failed);
+    metrics_add(metrics, metrics_type_gauge,
+                "ichabod_jpeg_frames_in_flight",
+                "Frames being decoded or waiting to go out in order", labels,
+                dstats.in_flight);
+  }
+
+  g_mutex_lock(&pthis->lock);
+  for (guint i = 0; i < pthis->queue_watches->len; i++) {
+    collect_queue_watch(metrics, g_ptr_array_index(pthis->queue_watches, i),
+                        labels);
+  }
+  g_mutex_unlock(&pthis->lock);
+  collect_queue_elements(pthis, metrics, labels);
+  collect_latency(pthis, metrics, labels);
+  if (pthis->rtp_relay) {
+    rtp_relay_collect_metrics(pthis->rtp_relay, metrics, labels);
+  }
+}
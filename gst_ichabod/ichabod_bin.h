@@ -16,17 +16,138 @@
 #include <gst/gst.h>
 
 #include "rtp_relay.h"
+#include "metrics.h"
+#include "encoder_backend.h"
 
 struct ichabod_bin_s;
 
+enum ichabod_rate_control_e {
+  // constant quality; bitrate only caps runaway sizes. for files.
+  ichabod_rate_control_crf,
+  // constant bitrate held by a VBV buffer. for live ingest.
+  ichabod_rate_control_cbr,
+};
+
+/* What an output needs from the video encoder. Outputs asking for the same
+ * settings share one encode; a different profile gets an encoder of its own.
+ */
+struct ichabod_encoder_profile_s {
+  // for logs and metric labels. not compared.
+  const char* name;
+  enum ichabod_rate_control_e rate_control;
+  // the CRF. crf only.
+  int quality;
+  // kbit/s: the target for cbr, the cap for crf
+  int bitrate;
+  // frames between IDRs
+  int key_int_max;
+  // "baseline", "main" or "high". H.264 backends only. NULL: their default.
+  const char* h264_profile;
+  // encoder_backend name. NULL: the session's video_encoder.
+  const char* encoder;
+};
+
+extern const struct ichabod_encoder_profile_s ichabod_encoder_profile_file;
+extern const struct ichabod_encoder_profile_s ichabod_encoder_profile_rtmp;
+
+// Explicitly zero or off, where 0 in ichabod_x264_options_s means default
+#define ICHABOD_X264_NONE -1
+
+/* Threading and latency for every x264 encoder in a session; threads also
+ * applies to the other encoder backends. 0 or NULL leaves the encoder's
+ * default; fields set here win over the preset.
+ */
+struct ichabod_x264_options_s {
+  /* "dense": a share of the cores per session (see sessions_per_host), and
+   *   a short lookahead. For packing many sessions onto a host.
+   * "low-latency": tune=zerolatency, sliced threads, no lookahead and no
+   *   B-frames. For sessions that only stream live.
+   */
+  const char* preset;
+  // sessions expected on this host, for "dense". default: one thread each.
+  int sessions_per_host;
+  int threads;
+  // 1: one frame split across threads. ICHABOD_X264_NONE: frame threads.
+  int sliced_threads;
+  // frames. ICHABOD_X264_NONE: no lookahead.
+  int rc_lookahead;
+  // frames. ICHABOD_X264_NONE: no B-frames.
+  int b_frames;
+  // x264enc tune flags, e.g. "zerolatency" or "zerolatency+fastdecode"
+  const char* tune;
+};
+
+/* Set one of the above by name, as the CLI and daemon spell it ("preset",
+ * "threads", "sliced_threads", ...). Numbers are as x264 takes them, so 0
+ * turns lookahead, B-frames or sliced threads off. Strings are not copied.
+ * Returns nonzero for an unknown key.
+ */
+int ichabod_x264_option_set(struct ichabod_x264_options_s* options,
+                            const char* key, const char* value);
+
+struct ichabod_bin_config_s {
+  // drop stale screencast frames in favor of newer ones when we fall behind
+  char coalesce_frames;
+  // don't decode or encode screencast frames identical to the previous one
+  char skip_duplicate_frames;
+  /* Lets several instances share a host: endpoints default to per-session
+   * ipc paths when a session id is set, and explicit endpoints may contain
+   * {session} (see ipc_endpoint.h). All optional.
+   */
+  const char* session_id;
+  const char* horseman_pull_endpoint;
+  const char* horseman_push_endpoint;
+  // record incoming horseman traffic for horseman_replay. optional.
+  const char* horseman_capture_path;
+  /* Screencast frames are raw pixels (I420, NV12 or BGRA) or tile updates
+   * rather than full JPEG frames, so there is no decode ahead of videorate.
+   * Set before starting.
+   */
+  char raw_ingest;
+  /* Decode JPEG on this many worker threads instead of in a single jpegdec
+   * (-1: one per core, 0: jpegdec). Ignored with raw_ingest.
+   */
+  int jpeg_decode_threads;
+  // x264 threading and latency. Set before attaching outputs.
+  struct ichabod_x264_options_s x264;
+  /* encoder_backend for outputs that don't name one. default "x264". An
+   * output that can't carry the codec (flvmux, RTP send) gets x264 anyway.
+   */
+  const char* video_encoder;
+  // pulsesrc device to record from. default source if not set.
+  const char* audio_device;
+  // export this session's pipeline stats here. optional.
+  struct metrics_server_s* metrics;
+
+  /* If set, EOS or a pipeline error calls this instead of quitting the
+   * bin's own main loop. Used when several bins share one loop.
+   */
+  void (*on_finished)(struct ichabod_bin_s* ichabod_bin, void* p);
+  void* p;
+};
+
 void ichabod_bin_alloc(struct ichabod_bin_s** ichabod_bin_out);
 void ichabod_bin_free(struct ichabod_bin_s* ichabod_bin);
+void ichabod_bin_config(struct ichabod_bin_s* ichabod_bin,
+                        struct ichabod_bin_config_s* config);
+// Runs the bin's own main loop until end of stream, then stops the bin.
 int ichabod_bin_start(struct ichabod_bin_s* ichabod_bin);
+// Starts without blocking; the caller iterates the default main context.
+int ichabod_bin_start_async(struct ichabod_bin_s* ichabod_bin);
 int ichabod_bin_stop(struct ichabod_bin_s* ichabod_bin);
 
 int ichabod_bin_add_element(struct ichabod_bin_s* bin, GstElement* element);
+/* The backend an output asking for this encoder gets: the named one if it is
+ * installed, else the session's video_encoder, else x264. name NULL: the
+ * session's video_encoder.
+ */
+const struct encoder_backend_s* ichabod_bin_resolve_video_encoder
+(struct ichabod_bin_s* bin, const char* name);
+
+// profile NULL: ichabod_encoder_profile_file
 int ichabod_bin_attach_mux_sink_pad
-(struct ichabod_bin_s* bin, GstPad* audio_sink, GstPad* video_sink);
+(struct ichabod_bin_s* bin, const struct ichabod_encoder_profile_s* profile,
+ GstPad* audio_sink, GstPad* video_sink);
 
 GstPad* ichabod_bin_create_audio_src(struct ichabod_bin_s* bin, GstCaps* caps);
 GstPad* ichabod_bin_create_video_src(struct ichabod_bin_s* bin, GstCaps* caps);
@@ -0,0 +1,400 @@
+//
+//  ichabod_daemon.c
+//  gst_ichabod
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <zmq.h>
+#include <gst/gst.h>
+#include <glib-unix.h>
+#include "ichabod_daemon.h"
+#include "ichabod_bin.h"
+#include "ichabod_sinks.h"
+#include "metrics.h"
+
+#define CONTROL_MAX_PARTS 32
+// session ids end up in socket endpoint paths
+#define SESSION_ID_MAX_LENGTH 64
+
+struct ichabod_daemon_s {
+  GMainLoop* loop;
+  GHashTable* sessions;
+  char* control_endpoint;
+  void* zmq_ctx;
+  void* control_socket;
+  guint control_watch_id;
+  char* metrics_listen;
+  struct metrics_server_s* metrics;
+};
+
+struct daemon_session_s {
+  struct ichabod_daemon_s* daemon;
+  char* id;
+  struct ichabod_bin_s* bin;
+  guint finished_source_id;
+};
+
+struct control_msg_s {
+  char* parts[CONTROL_MAX_PARTS];
+  int count;
+};
+
+#pragma mark - Sessions
+
+static void session_free(gpointer p) {
+  struct daemon_session_s* session = (struct daemon_session_s*)p;
+  g_print("ichabod_daemon: destroying session %s\n", session->id);
+  if (session->finished_source_id) {
+    g_source_remove(session->finished_source_id);
+  }
+  ichabod_bin_free(session->bin);
+  free(session->id);
+  free(session);
+}
+
+static gboolean on_session_finished_idle(gpointer p) {
+  struct daemon_session_s* session = (struct daemon_session_s*)p;
+  session->finished_source_id = 0;
+  g_hash_table_remove(session->daemon->sessions, session->id);
+  return G_SOURCE_REMOVE;
+}
+
+// Called from the bin's bus watch. Tearing the pipeline down from inside its
+// own bus callback is not safe, so defer to the next loop iteration.
+static void on_session_finished(struct ichabod_bin_s* bin, void* p) {
+  struct daemon_session_s* session = (struct daemon_session_s*)p;
+  g_print("ichabod_daemon: session %s finished\n", session->id);
+  if (!session->finished_source_id) {
+    session->finished_source_id =
+    g_idle_add(on_session_finished_idle, session);
+  }
+}
+
+// [A-Za-z0-9_-] only, so an id can't walk out of /tmp in an ipc endpoint
+static char is_valid_session_id(const char* id) {
+  size_t length = strlen(id);
+  if (length > SESSION_ID_MAX_LENGTH) {
+    return 0;
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (!g_ascii_isalnum(id[i]) && '_' != id[i] && '-' != id[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static const char* create_session(struct ichabod_daemon_s* pthis,
+                                  struct control_msg_s* msg)
+{
+  if (msg->count < 2 || !strlen(msg->parts[1])) {
+    return "missing session id";
+  }
+  if (!is_valid_session_id(msg->parts[1])) {
+    return "invalid session id";
+  }
+  if (msg->count % 2) {
+    return "unpaired option";
+  }
+  const char* id = msg->parts[1];
+  if (g_hash_table_contains(pthis->sessions, id)) {
+    return "session exists";
+  }
+
+  struct daemon_session_s* session =
+  (struct daemon_session_s*)calloc(1, sizeof(struct daemon_session_s));
+  session->daemon = pthis;
+  session->id = strdup(id);
+
+  struct ichabod_bin_config_s bin_opts = { 0 };
+  bin_opts.session_id = session->id;
+  bin_opts.on_finished = on_session_finished;
+  bin_opts.p = session;
+  bin_opts.metrics = pthis->metrics;
+  const char* output_path = NULL;
+  const char* broadcast_url = NULL;
+  for (int i = 2; i < msg->count; i += 2) {
+    const char* key = msg->parts[i];
+    const char* value = msg->parts[i + 1];
+    if (!strcmp("file", key)) {
+      output_path = value;
+    } else if (!strcmp("rtmp", key)) {
+      broadcast_url = value;
+    } else if (!strcmp("audio_device", key)) {
+      bin_opts.audio_device = value;
+    } else if (!strcmp("raw_ingest", key)) {
+      bin_opts.raw_ingest = atoi(value) ? 1 : 0;
+    } else if (!strcmp("video_encoder", key)) {
+      bin_opts.video_encoder = value;
+    } else if (!strcmp("jpeg_decode_threads", key)) {
+      bin_opts.jpeg_decode_threads = atoi(value);
+    } else if (!strcmp("coalesce_frames", key)) {
+      bin_opts.coalesce_frames = atoi(value) ? 1 : 0;
+    } else if (!strcmp("skip_duplicate_frames", key)) {
+      bin_opts.skip_duplicate_frames = atoi(value) ? 1 : 0;
+    } else if (!strcmp("horseman_pull_endpoint", key)) {
+      bin_opts.horseman_pull_endpoint = value;
+    } else if (!strcmp("horseman_push_endpoint", key)) {
+      bin_opts.horseman_push_endpoint = value;
+    } else if (!strcmp("horseman_capture", key)) {
+      bin_opts.horseman_capture_path = value;
+    } else if (g_str_has_prefix(key, "x264_")) {
+      // x264_threads, x264_preset, ... (see ichabod_bin.h)
+      if (ichabod_x264_option_set(&bin_opts.x264, key + strlen("x264_"),
+                                  value))
+      {
+        g_print("ichabod_daemon: ignoring unknown create option %s\n", key);
+      }
+    } else {
+      g_print("ichabod_daemon: ignoring unknown create option %s\n", key);
+    }
+  }
+
+  ichabod_bin_alloc(&session->bin);
+  ichabod_bin_config(session->bin, &bin_opts);
+  if (output_path) {
+    ichabod_attach_file(session->bin, output_path, NULL);
+  }
+  if (broadcast_url) {
+    ichabod_attach_rtmp(session->bin, broadcast_url, NULL);
+  }
+
+  if (ichabod_bin_start_async(session->bin)) {
+    ichabod_bin_free(session->bin);
+    free(session->id);
+    free(session);
+    return "failed to start pipeline";
+  }
+
+  g_hash_table_insert(pthis->sessions, session->id, session);
+  g_print("ichabod_daemon: created session %s (%d active)\n",
+          session->id, g_hash_table_size(pthis->sessions));
+  return NULL;
+}
+
+#pragma mark - Control socket
+
+static void control_msg_clear(struct control_msg_s* msg) {
+  for (int i = 0; i < msg->count; i++) {
+    free(msg->parts[i]);
+  }
+  msg->count = 0;
+}
+
+// Reads one complete multipart request. Returns 0 if nothing was waiting.
+static int recv_control_msg(struct ichabod_daemon_s* pthis,
+                            struct control_msg_s* msg)
+{
+  int more = 1;
+  int got_msg = 0;
+  while (more) {
+    zmq_msg_t part;
+    zmq_msg_init(&part);
+    int ret = zmq_msg_recv(&part, pthis->control_socket,
+                           got_msg ? 0 : ZMQ_DONTWAIT);
+    if (ret < 0) {
+      zmq_msg_close(&part);
+      return got_msg;
+    }
+    got_msg = 1;
+    if (msg->count < CONTROL_MAX_PARTS) {
+      size_t size = zmq_msg_size(&part);
+      char* str = (char*)malloc(size + 1);
+      memcpy(str, zmq_msg_data(&part), size);
+      str[size] = '\0';
+      msg->parts[msg->count++] = str;
+    } else {
+      printf("ichabod_daemon: dropping extra control message part\n");
+    }
+    more = zmq_msg_more(&part);
+    zmq_msg_close(&part);
+  }
+  return got_msg;
+}
+
+static void send_reply(struct ichabod_daemon_s* pthis,
+                       const char** parts, int count)
+{
+  for (int i = 0; i < count; i++) {
+    int flags = (i + 1 < count) ? ZMQ_SNDMORE : 0;
+    zmq_send(pthis->control_socket, parts[i], strlen(parts[i]), flags);
+  }
+}
+
+static void reply_ok(struct ichabod_daemon_s* pthis, const char* id) {
+  const char* parts[] = { "ok", id };
+  send_reply(pthis, parts, id ? 2 : 1);
+}
+
+static void reply_error(struct ichabod_daemon_s* pthis, const char* reason) {
+  const char* parts[] = { "error", reason };
+  send_reply(pthis, parts, 2);
+}
+
+static void reply_list(struct ichabod_daemon_s* pthis) {
+  guint count = g_hash_table_size(pthis->sessions);
+  const char** parts = (const char**)calloc(count + 1, sizeof(char*));
+  int i = 0;
+  parts[i++] = "ok";
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, pthis->sessions);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    parts[i++] = (const char*)key;
+  }
+  send_reply(pthis, parts, i);
+  free(parts);
+}
+
+static void handle_control_msg(struct ichabod_daemon_s* pthis,
+                               struct control_msg_s* msg)
+{
+  const char* type = msg->parts[0];
+  if (!strcmp("create", type)) {
+    const char* error = create_session(pthis, msg);
+    if (error) {
+      g_print("ichabod_daemon: create failed: %s\n", error);
+      reply_error(pthis, error);
+    } else {
+      reply_ok(pthis, msg->parts[1]);
+    }
+  } else if (!strcmp("destroy", type)) {
+    if (msg->count < 2 ||
+        !g_hash_table_remove(pthis->sessions, msg->parts[1]))
+    {
+      reply_error(pthis, "no such session");
+    } else {
+      reply_ok(pthis, msg->parts[1]);
+    }
+  } else if (!strcmp("list", type)) {
+    reply_list(pthis);
+  } else if (!strcmp("shutdown", type)) {
+    reply_ok(pthis, NULL);
+    g_main_loop_quit(pthis->loop);
+  } else {
+    reply_error(pthis, "unknown command");
+  }
+}
+
+// ZMQ_FD is edge triggered: drain every queued request before returning.
+static gboolean on_control_socket_ready(gint fd, GIOCondition condition,
+                                        gpointer p)
+{
+  struct ichabod_daemon_s* pthis = (struct ichabod_daemon_s*)p;
+  struct control_msg_s msg = { 0 };
+  while (1) {
+    int events = 0;
+    size_t events_size = sizeof(events);
+    zmq_getsockopt(pthis->control_socket, ZMQ_EVENTS, &events, &events_size);
+    if (!(events & ZMQ_POLLIN) || !recv_control_msg(pthis, &msg)) {
+      break;
+    }
+    handle_control_msg(pthis, &msg);
+    control_msg_clear(&msg);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_signal(gpointer p) {
+  struct ichabod_daemon_s* pthis = (struct ichabod_daemon_s*)p;
+  g_print("ichabod_daemon: caught signal, shutting down\n");
+  g_main_loop_quit(pthis->loop);
+  return G_SOURCE_CONTINUE;
+}
+
+static void on_collect_metrics(struct metrics_s* metrics, void* p) {
+  struct ichabod_daemon_s* pthis = (struct ichabod_daemon_s*)p;
+  metrics_add(metrics, metrics_type_gauge, "ichabod_daemon_sessions",
+              "Sessions hosted by this daemon", NULL,
+              g_hash_table_size(pthis->sessions));
+}
+
+#pragma mark - Public API
+
+void ichabod_daemon_alloc(struct ichabod_daemon_s** daemon_out) {
+  struct ichabod_daemon_s* pthis =
+  (struct ichabod_daemon_s*)calloc(1, sizeof(struct ichabod_daemon_s));
+  // pay for plugin registration once, up front, not on the first session
+  if (!gst_is_initialized()) {
+    gst_init(NULL, NULL);
+  }
+  pthis->loop = g_main_loop_new(NULL, FALSE);
+  pthis->sessions =
+  g_hash_table_new_full(g_str_hash, g_str_equal, NULL, session_free);
+  pthis->control_endpoint = strdup(ICHABOD_DAEMON_DEFAULT_CONTROL_ENDPOINT);
+  pthis->zmq_ctx = zmq_ctx_new();
+  pthis->control_socket = zmq_socket(pthis->zmq_ctx, ZMQ_REP);
+  int linger = 0;
+  zmq_setsockopt(pthis->control_socket, ZMQ_LINGER, &linger, sizeof(linger));
+  *daemon_out = pthis;
+}
+
+void ichabod_daemon_free(struct ichabod_daemon_s* pthis) {
+  g_hash_table_destroy(pthis->sessions);
+  zmq_close(pthis->control_socket);
+  zmq_ctx_destroy(pthis->zmq_ctx);
+  g_main_loop_unref(pthis->loop);
+  if (pthis->metrics) {
+    metrics_server_free(pthis->metrics);
+  }
+  free(pthis->control_endpoint);
+  free(pthis->metrics_listen);
+  free(pthis);
+}
+
+void ichabod_daemon_config(struct ichabod_daemon_s* pthis,
+                           struct ichabod_daemon_config_s* config)
+{
+  if (config->control_endpoint) {
+    free(pthis->control_endpoint);
+    pthis->control_endpoint = strdup(config->control_endpoint);
+  }
+  if (config->metrics_listen) {
+    free(pthis->metrics_listen);
+    pthis->metrics_listen = strdup(config->metrics_listen);
+  }
+}
+
+int ichabod_daemon_run(struct ichabod_daemon_s* pthis) {
+  int ret = zmq_bind(pthis->control_socket, pthis->control_endpoint);
+  if (ret) {
+    g_printerr("ichabod_daemon: failed to bind control socket %s errno %d\n",
+               pthis->control_endpoint, errno);
+    return ret;
+  }
+  if (pthis->metrics_listen && !pthis->metrics) {
+    metrics_server_alloc(&pthis->metrics);
+    if (metrics_server_listen(pthis->metrics, pthis->metrics_listen)) {
+      metrics_server_free(pthis->metrics);
+      pthis->metrics = NULL;
+      zmq_unbind(pthis->control_socket, pthis->control_endpoint);
+      return -1;
+    }
+    metrics_server_add_source(pthis->metrics, on_collect_metrics, pthis);
+  }
+  int fd;
+  size_t fd_size = sizeof(fd);
+  zmq_getsockopt(pthis->control_socket, ZMQ_FD, &fd, &fd_size);
+  pthis->control_watch_id =
+  g_unix_fd_add(fd, G_IO_IN, on_control_socket_ready, pthis);
+  guint sigint_id = g_unix_signal_add(SIGINT, on_signal, pthis);
+  guint sigterm_id = g_unix_signal_add(SIGTERM, on_signal, pthis);
+
+  g_print("ichabod_daemon: listening on %s\n", pthis->control_endpoint);
+  // requests may have queued before the watch was installed
+  on_control_socket_ready(fd, G_IO_IN, pthis);
+  g_main_loop_run(pthis->loop);
+
+  g_source_remove(pthis->control_watch_id);
+  g_source_remove(sigint_id);
+  g_source_remove(sigterm_id);
+  g_print("ichabod_daemon: stopping %d sessions\n",
+          g_hash_table_size(pthis->sessions));
+  g_hash_table_remove_all(pthis->sessions);
+  zmq_unbind(pthis->control_socket, pthis->control_endpoint);
+  return 0;
+}
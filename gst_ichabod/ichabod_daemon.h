@@ -0,0 +1,50 @@
+//
+//  ichabod_daemon.h
+//  gst_ichabod
+//
+
+/**
+ * Hosts many ichabod_bin sessions in one process. Sessions are created and
+ * destroyed over a ZMQ REP control socket and share the default main loop,
+ * so gst_init and the plugin registry scan are paid once per host instead of
+ * once per session.
+ *
+ * Requests and replies are multipart string messages:
+ *   ["create", id, key, value, ...] -> ["ok", id]
+ *     id: up to 64 of [A-Za-z0-9_-]
+ *     keys: file, rtmp, audio_device, coalesce_frames,
+ *           skip_duplicate_frames, raw_ingest, jpeg_decode_threads,
+ *           horseman_pull_endpoint, horseman_push_endpoint,
+ *           horseman_capture, x264_preset, x264_sessions_per_host,
+ *           x264_threads, x264_sliced_threads, x264_rc_lookahead,
+ *           x264_b_frames, x264_tune, video_encoder
+ *   ["destroy", id]                 -> ["ok", id]
+ *   ["list"]                        -> ["ok", id, id, ...]
+ *   ["shutdown"]                    -> ["ok"]
+ * Failures reply ["error", reason].
+ */
+
+#ifndef ichabod_daemon_h
+#define ichabod_daemon_h
+
+#define ICHABOD_DAEMON_DEFAULT_CONTROL_ENDPOINT "ipc:///tmp/ichabod-control"
+
+struct ichabod_daemon_s;
+
+struct ichabod_daemon_config_s {
+  // optional; defaults to ICHABOD_DAEMON_DEFAULT_CONTROL_ENDPOINT
+  const char* control_endpoint;
+  // optional; serve Prometheus metrics for every session here (metrics.h)
+  const char* metrics_listen;
+};
+
+void ichabod_daemon_alloc(struct ichabod_daemon_s** daemon_out);
+void ichabod_daemon_free(struct ichabod_daemon_s* daemon);
+void ichabod_daemon_config(struct ichabod_daemon_s* daemon,
+                           struct ichabod_daemon_config_s* config);
+
+// Blocks until a shutdown request or SIGINT/SIGTERM. All sessions are
+// destroyed before returning.
+int ichabod_daemon_run(struct ichabod_daemon_s* daemon);
+
+#endif /* ichabod_daemon_h */
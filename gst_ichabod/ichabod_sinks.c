@@ -5,11 +5,14 @@
 //  Created by Charley Robinson on 12/28/17.
 //
 
+#include <string.h>
 #include <gst/gst.h>
 #include <gst/rtp/rtp.h>
 #include "ichabod_sinks.h"
 
-int ichabod_attach_rtmp(struct ichabod_bin_s* bin, const char* broadcast_url) {
+int ichabod_attach_rtmp(struct ichabod_bin_s* bin, const char* broadcast_url,
+                        const char* encoder)
+{
   g_print("ichabod_sinks: attach rtmp output %s\n", broadcast_url);
   GstElement* mux = gst_element_factory_make("flvmux", NULL);
   GstElement* sink = gst_element_factory_make("rtmpsink", NULL);
@@ -29,17 +32,31 @@ int ichabod_attach_rtmp(struct ichabod_bin_s* bin, const char* broadcast_url) {
   GstPad* v_mux_sink = gst_element_get_request_pad(mux, "video");
   GstPad* a_mux_sink = gst_element_get_request_pad(mux, "audio");
 
-  ret = ichabod_bin_attach_mux_sink_pad(bin, a_mux_sink, v_mux_sink);
+  // flvmux only carries H.264; anything else falls back to x264 on attach
+  struct ichabod_encoder_profile_s profile = ichabod_encoder_profile_rtmp;
+  profile.encoder = encoder;
+  ret = ichabod_bin_attach_mux_sink_pad(bin, &profile, a_mux_sink, v_mux_sink);
   return ret;
 }
 
-int ichabod_attach_file(struct ichabod_bin_s* bin, const char* path) {
+int ichabod_attach_file(struct ichabod_bin_s* bin, const char* path,
+                        const char* encoder)
+{
   g_print("ichabod_sinks: attach file output %s\n", path);
-  GstElement* mux = gst_element_factory_make("mp4mux", NULL);
+  const struct encoder_backend_s* backend =
+  ichabod_bin_resolve_video_encoder(bin, encoder);
+  g_assert(backend);
+  // mp4 for H.264 as always; matroska for the codecs mp4mux can't take
+  char is_h264 =
+  !strcmp("video/x-h264", encoder_backend_get_media_type(backend));
+  GstElement* mux =
+  gst_element_factory_make(is_h264 ? "mp4mux" : "matroskamux", NULL);
   GstElement* sink = gst_element_factory_make("filesink", NULL);
 
   // configure multiplexer
-  g_object_set(G_OBJECT(mux), "faststart", TRUE, NULL);
+  if (is_h264) {
+    g_object_set(G_OBJECT(mux), "faststart", TRUE, NULL);
+  }
 
   // configure output sink
   g_object_set(G_OBJECT(sink), "location", path, NULL);
@@ -48,12 +65,20 @@ int ichabod_attach_file(struct ichabod_bin_s* bin, const char* path) {
 
   int ret = ichabod_bin_add_element(bin, mux);
   ret = ichabod_bin_add_element(bin, sink);
+  // link first: attaching starts the encoder (or asks it for a keyframe)
+  if (!gst_element_link(mux, sink)) {
+    g_print("ichabod_sinks: failed to link file output %s\n", path);
+    return -1;
+  }
   GstPad* apad = gst_element_get_request_pad(mux, "audio_%u");
   GstPad* vpad = gst_element_get_request_pad(mux, "video_%u");
-  g_assert(!ichabod_bin_attach_mux_sink_pad(bin, apad, vpad));
-  gboolean result = gst_element_link(mux, sink);
-
-  return !result;
+  struct ichabod_encoder_profile_s profile = ichabod_encoder_profile_file;
+  profile.encoder = encoder_backend_get_name(backend);
+  ret = ichabod_bin_attach_mux_sink_pad(bin, &profile, apad, vpad);
+  if (ret) {
+    g_print("ichabod_sinks: failed to attach file output %s\n", path);
+  }
+  return ret;
 }
 
 int ichabod_attach_rtp(struct ichabod_bin_s* bin,
@@ -10,8 +10,11 @@
 
 #include "ichabod_bin.h"
 
-int ichabod_attach_rtmp(struct ichabod_bin_s* bin, const char* broadcast_url);
-int ichabod_attach_file(struct ichabod_bin_s* bin, const char* path);
+// encoder: an encoder_backend name. NULL: the session's video_encoder.
+int ichabod_attach_rtmp(struct ichabod_bin_s* bin, const char* broadcast_url,
+                        const char* encoder);
+int ichabod_attach_file(struct ichabod_bin_s* bin, const char* path,
+                        const char* encoder);
 int ichabod_attach_rtp(struct ichabod_bin_s* bin,
                        struct rtp_relay_config_s* rtp_config);
 
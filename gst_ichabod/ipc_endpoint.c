@@ -0,0 +1,50 @@
+//
+//  ipc_endpoint.c
+//  gst_ichabod
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "ipc_endpoint.h"
+
+char* ipc_endpoint_expand(const char* endpoint_template,
+                          const char* session_id)
+{
+  const char* token = IPC_ENDPOINT_SESSION_TOKEN;
+  size_t token_len = strlen(token);
+  size_t id_len = session_id ? strlen(session_id) : 0;
+
+  // count tokens to size the output
+  size_t count = 0;
+  const char* p = endpoint_template;
+  while ((p = strstr(p, token))) {
+    count++;
+    p += token_len;
+  }
+  char* out = (char*)malloc(strlen(endpoint_template) + count * id_len + 1);
+
+  char* pos = out;
+  p = endpoint_template;
+  const char* match;
+  while ((match = strstr(p, token))) {
+    memcpy(pos, p, match - p);
+    pos += match - p;
+    memcpy(pos, session_id, id_len);
+    pos += id_len;
+    p = match + token_len;
+  }
+  strcpy(pos, p);
+  return out;
+}
+
+char* ipc_endpoint_resolve(const char* configured,
+                           const char* session_default,
+                           const char* plain_default,
+                           const char* session_id)
+{
+  const char* endpoint_template = configured;
+  if (!endpoint_template) {
+    endpoint_template = session_id ? session_default : plain_default;
+  }
+  return ipc_endpoint_expand(endpoint_template, session_id);
+}
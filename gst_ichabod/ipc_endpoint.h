@@ -0,0 +1,29 @@
+//
+//  ipc_endpoint.h
+//  gst_ichabod
+//
+
+#ifndef ipc_endpoint_h
+#define ipc_endpoint_h
+
+/* ZMQ endpoints may be given as templates, so several ichabod instances can
+ * share a host without colliding on the same ipc:// paths. Every occurrence
+ * of this token is replaced by the session id.
+ */
+#define IPC_ENDPOINT_SESSION_TOKEN "{session}"
+
+/* Returns a newly allocated endpoint string. If session_id is NULL the token
+ * is replaced with nothing.
+ */
+char* ipc_endpoint_expand(const char* endpoint_template,
+                          const char* session_id);
+
+/* Pick the configured template if there is one, otherwise the per-session
+ * default when a session id is set, otherwise the plain default. Then expand.
+ */
+char* ipc_endpoint_resolve(const char* configured,
+                           const char* session_default,
+                           const char* plain_default,
+                           const char* session_id);
+
+#endif /* ipc_endpoint_h */
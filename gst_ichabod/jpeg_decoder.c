@@ -0,0 +1,381 @@
+//
+//  jpeg_decoder.c
+//  gst_ichabod
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+#include <turbojpeg.h>
+#include "jpeg_decoder.h"
+#include "framepool.h"
+
+// Frames handed out per worker before the input thread waits
+#define JOBS_PER_THREAD 2
+// Decoded frames appsrc holds before a push blocks
+#define MAX_QUEUED_FRAMES 4
+
+struct decode_job_s {
+  GstBuffer* in;
+  // NULL if the image could not be decoded
+  GstBuffer* out;
+  GstVideoInfo info;
+  char done;
+};
+
+struct jpeg_decoder_s {
+  GstElement* bin;
+  GstElement* sink;
+  GstElement* src;
+  GThreadPool* workers;
+  int max_in_flight;
+
+  GMutex lock;
+  GCond cond;
+  // jobs in arrival order, including ones still decoding
+  GQueue jobs;
+  // one thread at a time pushes finished jobs off the head of the queue
+  char draining;
+  // caps appsrc currently has
+  char have_info;
+  GstVideoInfo info;
+  struct jpeg_decoder_stats_s stats;
+
+  // output buffers for the current info. guarded by pool_lock.
+  GMutex pool_lock;
+  GstBufferPool* pool;
+  GstVideoInfo pool_info;
+};
+
+static GstFlowReturn on_new_sample(GstAppSink* sink, gpointer p);
+static void on_eos(GstAppSink* sink, gpointer p);
+static void decode_worker(gpointer data, gpointer p);
+
+static void destroy_tj_handle(gpointer handle) {
+  tjDestroy((tjhandle)handle);
+}
+
+// libjpeg-turbo handles are not thread safe: one per worker
+static GPrivate tj_handle = G_PRIVATE_INIT(destroy_tj_handle);
+
+void jpeg_decoder_alloc(struct jpeg_decoder_s** jpeg_decoder_out) {
+  struct jpeg_decoder_s* pthis = (struct jpeg_decoder_s*)
+  calloc(1, sizeof(struct jpeg_decoder_s));
+  g_mutex_init(&pthis->lock);
+  g_cond_init(&pthis->cond);
+  g_mutex_init(&pthis->pool_lock);
+  g_queue_init(&pthis->jobs);
+
+  pthis->bin = gst_bin_new(NULL);
+  // keep our own reference; the pipeline takes another when it adopts us
+  gst_object_ref_sink(pthis->bin);
+  pthis->sink = gst_element_factory_make("appsink", NULL);
+  pthis->src = gst_element_factory_make("appsrc", NULL);
+  g_assert(pthis->sink && pthis->src);
+
+  GstCaps* caps = gst_caps_new_simple("image/jpeg", NULL);
+  gst_app_sink_set_caps(GST_APP_SINK(pthis->sink), caps);
+  gst_caps_unref(caps);
+  // only a hand-off point: no clock sync, and no preroll to wait on
+  g_object_set(G_OBJECT(pthis->sink), "sync", FALSE, "async", FALSE, NULL);
+  static GstAppSinkCallbacks callbacks = { 0 };
+  callbacks.eos = on_eos;
+  callbacks.new_sample = on_new_sample;
+  gst_app_sink_set_callbacks(GST_APP_SINK(pthis->sink), &callbacks,
+                             pthis, NULL);
+
+  gst_app_src_set_stream_type(GST_APP_SRC(pthis->src),
+                              GST_APP_STREAM_TYPE_STREAM);
+  // blocking pushes carry downstream backpressure back to the input
+  g_object_set(G_OBJECT(pthis->src), "format", GST_FORMAT_TIME,
+               "block", TRUE, NULL);
+
+  gst_bin_add_many(GST_BIN(pthis->bin), pthis->sink, pthis->src, NULL);
+  GstPad* pad = gst_element_get_static_pad(pthis->sink, "sink");
+  gst_element_add_pad(pthis->bin, gst_ghost_pad_new("sink", pad));
+  gst_object_unref(pad);
+  pad = gst_element_get_static_pad(pthis->src, "src");
+  gst_element_add_pad(pthis->bin, gst_ghost_pad_new("src", pad));
+  gst_object_unref(pad);
+
+  int threads = g_get_num_processors();
+  pthis->max_in_flight = threads * JOBS_PER_THREAD;
+  pthis->workers =
+  g_thread_pool_new(decode_worker, pthis, threads, TRUE, NULL);
+
+  *jpeg_decoder_out = pthis;
+}
+
+void jpeg_decoder_free(struct jpeg_decoder_s* pthis) {
+  // workers finish what they hold; the pipeline is down, so pushes fail fast
+  g_thread_pool_free(pthis->workers, FALSE, TRUE);
+  struct decode_job_s* job;
+  while ((job = g_queue_pop_head(&pthis->jobs))) {
+    gst_buffer_unref(job->in);
+    if (job->out) {
+      gst_buffer_unref(job->out);
+    }
+    free(job);
+  }
+  if (pthis->pool) {
+    gst_buffer_pool_set_active(pthis->pool, FALSE);
+    gst_object_unref(pthis->pool);
+  }
+  gst_object_unref(pthis->bin);
+  g_mutex_clear(&pthis->lock);
+  g_cond_clear(&pthis->cond);
+  g_mutex_clear(&pthis->pool_lock);
+  free(pthis);
+}
+
+void jpeg_decoder_config(struct jpeg_decoder_s* pthis,
+                         struct jpeg_decoder_config_s* config)
+{
+  int threads = config->threads > 0 ?
+  config->threads : (int)g_get_num_processors();
+  g_thread_pool_set_max_threads(pthis->workers, threads, NULL);
+  g_mutex_lock(&pthis->lock);
+  pthis->max_in_flight = threads * JOBS_PER_THREAD;
+  g_mutex_unlock(&pthis->lock);
+}
+
+GstElement* jpeg_decoder_get_element(struct jpeg_decoder_s* pthis) {
+  return pthis->bin;
+}
+
+void jpeg_decoder_get_stats(struct jpeg_decoder_s* pthis,
+                            struct jpeg_decoder_stats_s* stats)
+{
+  g_mutex_lock(&pthis->lock);
+  *stats = pthis->stats;
+  g_mutex_unlock(&pthis->lock);
+}
+
+#pragma mark - Decode
+
+// Keep libjpeg's native sampling when there is a matching planar format, so
+// no colorspace conversion happens here. Other layouts come out as BGRx.
+static GstVideoFormat output_format(int subsamp, int colorspace) {
+  if (TJCS_GRAY == colorspace) {
+    return GST_VIDEO_FORMAT_GRAY8;
+  }
+  if (TJCS_YCbCr != colorspace) {
+    return GST_VIDEO_FORMAT_BGRx;
+  }
+  switch (subsamp) {
+    case TJSAMP_420:
+      return GST_VIDEO_FORMAT_I420;
+    case TJSAMP_422:
+      return GST_VIDEO_FORMAT_Y42B;
+    case TJSAMP_444:
+      return GST_VIDEO_FORMAT_Y444;
+    default:
+      return GST_VIDEO_FORMAT_BGRx;
+  }
+}
+
+static GstBuffer* acquire_output(struct jpeg_decoder_s* pthis,
+                                 GstVideoInfo* info)
+{
+  g_mutex_lock(&pthis->pool_lock);
+  if (!pthis->pool || !gst_video_info_is_equal(&pthis->pool_info, info)) {
+    if (pthis->pool) {
+      // buffers still out return to the old pool and die with it
+      gst_buffer_pool_set_active(pthis->pool, FALSE);
+      gst_object_unref(pthis->pool);
+    }
+    pthis->pool = gst_frame_pool_new();
+    GstStructure* config = gst_buffer_pool_get_config(pthis->pool);
+    GstCaps* caps = gst_video_info_to_caps(info);
+    gst_buffer_pool_config_set_params(config, caps, info->size,
+                                      MAX_QUEUED_FRAMES, 0);
+    gst_caps_unref(caps);
+    gst_buffer_pool_set_config(pthis->pool, config);
+    gst_buffer_pool_set_active(pthis->pool, TRUE);
+    pthis->pool_info = *info;
+  }
+  GstBufferPool* pool = gst_object_ref(pthis->pool);
+  g_mutex_unlock(&pthis->pool_lock);
+
+  GstBuffer* buffer = NULL;
+  gst_buffer_pool_acquire_buffer(pool, &buffer, NULL);
+  gst_object_unref(pool);
+  return buffer;
+}
+
+static GstBuffer* decode_image(struct jpeg_decoder_s* pthis,
+                               tjhandle tj, const GstMapInfo* map,
+                               GstVideoInfo* info)
+{
+  int width = 0, height = 0, subsamp = 0, colorspace = 0;
+  if (tjDecompressHeader3(tj, map->data, map->size, &width, &height,
+                          &subsamp, &colorspace))
+  {
+    g_print("jpeg_decoder: bad header: %s\n", tjGetErrorStr());
+    return NULL;
+  }
+  GstVideoFormat format = output_format(subsamp, colorspace);
+  // framerate stays 0/1, as jpegdec reports for a variable rate stream
+  gst_video_info_set_format(info, format, width, height);
+
+  GstBuffer* buffer = acquire_output(pthis, info);
+  GstVideoFrame frame;
+  if (!buffer || !gst_video_frame_map(&frame, info, buffer, GST_MAP_WRITE)) {
+    if (buffer) {
+      gst_buffer_unref(buffer);
+    }
+    return NULL;
+  }
+  int ret;
+  if (GST_VIDEO_FORMAT_BGRx == format) {
+    ret = tjDecompress2(tj, map->data, map->size,
+                        GST_VIDEO_FRAME_PLANE_DATA(&frame, 0), width,
+                        GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0), height,
+                        TJPF_BGRX, 0);
+  } else {
+    unsigned char* planes[3] = { NULL };
+    int strides[3] = { 0 };
+    for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&frame); i++) {
+      planes[i] = GST_VIDEO_FRAME_PLANE_DATA(&frame, i);
+      strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, i);
+    }
+    ret = tjDecompressToYUVPlanes(tj, map->data, map->size, planes, width,
+                                  strides, height, 0);
+  }
+  gst_video_frame_unmap(&frame);
+  if (ret) {
+    g_print("jpeg_decoder: decode failed: %s\n", tjGetErrorStr());
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+static void push_job(struct jpeg_decoder_s* pthis, struct decode_job_s* job) {
+  if (job->out) {
+    if (!pthis->have_info || !gst_video_info_is_equal(&pthis->info,
+                                                      &job->info))
+    {
+      GstCaps* caps = gst_video_info_to_caps(&job->info);
+      gst_app_src_set_caps(GST_APP_SRC(pthis->src), caps);
+      gst_caps_unref(caps);
+      g_object_set(G_OBJECT(pthis->src), "max-bytes",
+                   (guint64)job->info.size * MAX_QUEUED_FRAMES, NULL);
+      pthis->info = job->info;
+      pthis->have_info = 1;
+    }
+    // takes the buffer; may block until downstream catches up
+    gst_app_src_push_buffer(GST_APP_SRC(pthis->src), job->out);
+    job->out = NULL;
+  }
+  gst_buffer_unref(job->in);
+  free(job);
+}
+
+/* Push every finished job at the head of the queue. Whoever finds the queue
+ * idle does the pushing, so order holds no matter which worker finishes
+ * first. Call with lock held.
+ */
+static void drain_jobs(struct jpeg_decoder_s* pthis) {
+  if (pthis->draining) {
+    return;
+  }
+  pthis->draining = 1;
+  struct decode_job_s* job;
+  while ((job = g_queue_peek_head(&pthis->jobs)) && job->done) {
+    g_queue_pop_head(&pthis->jobs);
+    g_mutex_unlock(&pthis->lock);
+    push_job(pthis, job);
+    g_mutex_lock(&pthis->lock);
+    pthis->stats.in_flight--;
+    g_cond_broadcast(&pthis->cond);
+  }
+  pthis->draining = 0;
+}
+
+static void decode_worker(gpointer data, gpointer p) {
+  struct jpeg_decoder_s* pthis = (struct jpeg_decoder_s*)p;
+  struct decode_job_s* job = (struct decode_job_s*)data;
+  tjhandle tj = g_private_get(&tj_handle);
+  if (!tj) {
+    tj = tjInitDecompress();
+    g_private_set(&tj_handle, tj);
+  }
+
+  GstMapInfo map;
+  if (tj && gst_buffer_map(job->in, &map, GST_MAP_READ)) {
+    job->out = decode_image(pthis, tj, &map, &job->info);
+    gst_buffer_unmap(job->in, &map);
+  }
+  if (job->out) {
+    gst_buffer_copy_into(job->out, job->in, GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+  }
+
+  g_mutex_lock(&pthis->lock);
+  job->done = 1;
+  if (job->out) {
+    pthis->stats.frames_decoded++;
+  } else {
+    pthis->stats.frames_failed++;
+  }
+  drain_jobs(pthis);
+  g_mutex_unlock(&pthis->lock);
+}
+
+#pragma mark - Input
+
+static GstFlowReturn on_new_sample(GstAppSink* sink, gpointer p) {
+  struct jpeg_decoder_s* pthis = (struct jpeg_decoder_s*)p;
+  GstSample* sample = gst_app_sink_pull_sample(sink);
+  if (!sample) {
+    return GST_FLOW_FLUSHING;
+  }
+  struct decode_job_s* job = (struct decode_job_s*)
+  calloc(1, sizeof(struct decode_job_s));
+  job->in = gst_buffer_ref(gst_sample_get_buffer(sample));
+  gst_sample_unref(sample);
+
+  GstPad* pad = gst_element_get_static_pad(GST_ELEMENT(sink), "sink");
+  GstFlowReturn ret = GST_FLOW_OK;
+  g_mutex_lock(&pthis->lock);
+  // Wait for a slot. Check for shutdown now and then: the workers we wait
+  // on may be stuck behind a downstream that is already stopped.
+  while (pthis->stats.in_flight >= (uint32_t)pthis->max_in_flight) {
+    if (GST_PAD_IS_FLUSHING(pad)) {
+      ret = GST_FLOW_FLUSHING;
+      break;
+    }
+    g_cond_wait_until(&pthis->cond, &pthis->lock,
+                      g_get_monotonic_time() + 50 * G_TIME_SPAN_MILLISECOND);
+  }
+  if (GST_FLOW_OK == ret) {
+    pthis->stats.in_flight++;
+    g_queue_push_tail(&pthis->jobs, job);
+  }
+  g_mutex_unlock(&pthis->lock);
+  gst_object_unref(pad);
+
+  if (GST_FLOW_OK != ret) {
+    gst_buffer_unref(job->in);
+    free(job);
+    return ret;
+  }
+  g_thread_pool_push(pthis->workers, job, NULL);
+  return GST_FLOW_OK;
+}
+
+static void on_eos(GstAppSink* sink, gpointer p) {
+  struct jpeg_decoder_s* pthis = (struct jpeg_decoder_s*)p;
+  GstPad* pad = gst_element_get_static_pad(GST_ELEMENT(sink), "sink");
+  // everything before EOS goes out first
+  g_mutex_lock(&pthis->lock);
+  while (pthis->stats.in_flight && !GST_PAD_IS_FLUSHING(pad)) {
+    g_cond_wait_until(&pthis->cond, &pthis->lock,
+                      g_get_monotonic_time() + 50 * G_TIME_SPAN_MILLISECOND);
+  }
+  g_mutex_unlock(&pthis->lock);
+  gst_object_unref(pad);
+  gst_app_src_end_of_stream(GST_APP_SRC(pthis->src));
+}
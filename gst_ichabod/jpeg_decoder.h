@@ -0,0 +1,46 @@
+//
+//  jpeg_decoder.h
+//  gst_ichabod
+//
+
+/**
+ * Drop-in replacement for jpegdec that decodes on a pool of worker threads.
+ * Incoming image/jpeg buffers are handed out to the workers as they arrive
+ * and decoded with libjpeg-turbo straight into pooled video buffers; results
+ * are pushed downstream strictly in arrival order, with timestamps copied
+ * from the input. Like screencast_src this is a bin of app elements rather
+ * than a registered plugin.
+ */
+
+#ifndef jpeg_decoder_h
+#define jpeg_decoder_h
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+struct jpeg_decoder_s;
+
+struct jpeg_decoder_config_s {
+  // worker threads. 0 picks one per core.
+  int threads;
+};
+
+struct jpeg_decoder_stats_s {
+  uint64_t frames_decoded;
+  // corrupt or unsupported images, dropped like jpegdec would
+  uint64_t frames_failed;
+  // handed to a worker and not yet pushed downstream
+  uint32_t in_flight;
+};
+
+void jpeg_decoder_alloc(struct jpeg_decoder_s** jpeg_decoder_out);
+void jpeg_decoder_free(struct jpeg_decoder_s* jpeg_decoder);
+// Set before the pipeline starts
+void jpeg_decoder_config(struct jpeg_decoder_s* jpeg_decoder,
+                         struct jpeg_decoder_config_s* config);
+// A bin with a "sink" and a "src" pad
+GstElement* jpeg_decoder_get_element(struct jpeg_decoder_s* jpeg_decoder);
+void jpeg_decoder_get_stats(struct jpeg_decoder_s* jpeg_decoder,
+                            struct jpeg_decoder_stats_s* stats);
+
+#endif /* jpeg_decoder_h */
@@ -0,0 +1,298 @@
+//
+//  latency.c
+//  gst_ichabod
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+#include "latency.h"
+
+// Frames in flight between appsrc and the slowest muxer
+#define LATENCY_TABLE_SIZE 256
+// videorate moves a frame by at most half its output frame interval
+#define LATENCY_MATCH_WINDOW (100 * GST_MSECOND)
+
+/* Log buckets over microseconds: 0-3us exact, then four buckets per power
+ * of two, so a percentile is never off by more than a quarter octave.
+ */
+#define HISTOGRAM_BUCKETS 148
+
+struct histogram_s {
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t max_ns;
+};
+
+struct latency_entry_s {
+  GstClockTime pts;
+  uint64_t received_ns;
+  uint64_t pushed_ns;
+  uint64_t decoded_ns;
+  uint64_t encoded_ns;
+  // bit per output that has seen this frame (videorate may duplicate it)
+  uint32_t muxed;
+};
+
+struct latency_output_s {
+  char name[48];
+  struct histogram_s mux;
+  struct histogram_s total;
+};
+
+struct latency_tracker_s {
+  GMutex lock;
+  struct latency_entry_s entries[LATENCY_TABLE_SIZE];
+  uint32_t next_entry;
+  struct histogram_s stages[latency_stage_count];
+  struct latency_output_s outputs[LATENCY_MAX_OUTPUTS];
+  int output_count;
+};
+
+static const char* stage_names[latency_stage_count] = {
+  "parse", "decode", "push", "jpegdec", "encode"
+};
+
+uint64_t latency_now_ns(void) {
+  return uv_hrtime();
+}
+
+#pragma mark - Histograms
+
+static int bucket_index(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  if (us < 4) {
+    return (int)us;
+  }
+  int msb = 63 - __builtin_clzll(us);
+  int sub = (int)((us >> (msb - 2)) & 3);
+  int index = 4 + (msb - 2) * 4 + sub;
+  return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t bucket_upper_ns(int index) {
+  if (index < 4) {
+    return (index + 1) * 1000;
+  }
+  int shift = (index - 4) / 4;
+  int sub = (index - 4) % 4;
+  return ((uint64_t)(4 + sub + 1) << shift) * 1000;
+}
+
+static void histogram_add(struct histogram_s* h, uint64_t start_ns,
+                          uint64_t end_ns)
+{
+  if (!start_ns || !end_ns) {
+    return;
+  }
+  uint64_t ns = end_ns > start_ns ? end_ns - start_ns : 0;
+  h->buckets[bucket_index(ns)]++;
+  h->count++;
+  if (ns > h->max_ns) {
+    h->max_ns = ns;
+  }
+}
+
+static uint64_t histogram_percentile(struct histogram_s* h, int percent) {
+  uint64_t rank = (h->count * percent + 99) / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t upper = bucket_upper_ns(i);
+      return upper < h->max_ns ? upper : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+static int histogram_summarize(struct histogram_s* h, const char* name,
+                               struct latency_summary_s* summary)
+{
+  if (!h->count) {
+    return 0;
+  }
+  snprintf(summary->name, sizeof(summary->name), "%s", name);
+  summary->count = h->count;
+  summary->p50_ns = histogram_percentile(h, 50);
+  summary->p99_ns = histogram_percentile(h, 99);
+  summary->max_ns = h->max_ns;
+  return 1;
+}
+
+#pragma mark - Side table
+
+static struct latency_entry_s* find_exact(struct latency_tracker_s* pthis,
+                                          GstClockTime pts)
+{
+  for (int i = 1; i <= LATENCY_TABLE_SIZE; i++) {
+    struct latency_entry_s* entry =
+    &pthis->entries[(pthis->next_entry - i) % LATENCY_TABLE_SIZE];
+    if (entry->pts == pts) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static struct latency_entry_s* find_nearest(struct latency_tracker_s* pthis,
+                                            GstClockTime pts)
+{
+  struct latency_entry_s* best = NULL;
+  GstClockTime best_distance = LATENCY_MATCH_WINDOW + 1;
+  for (int i = 0; i < LATENCY_TABLE_SIZE; i++) {
+    struct latency_entry_s* entry = &pthis->entries[i];
+    if (!GST_CLOCK_TIME_IS_VALID(entry->pts)) {
+      continue;
+    }
+    GstClockTime distance =
+    entry->pts > pts ? entry->pts - pts : pts - entry->pts;
+    if (distance < best_distance) {
+      best = entry;
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
+#pragma mark - Public API
+
+void latency_tracker_alloc(struct latency_tracker_s** tracker_out) {
+  struct latency_tracker_s* pthis =
+  (struct latency_tracker_s*)calloc(1, sizeof(struct latency_tracker_s));
+  g_mutex_init(&pthis->lock);
+  for (int i = 0; i < LATENCY_TABLE_SIZE; i++) {
+    pthis->entries[i].pts = GST_CLOCK_TIME_NONE;
+  }
+  *tracker_out = pthis;
+}
+
+void latency_tracker_free(struct latency_tracker_s* pthis) {
+  g_mutex_clear(&pthis->lock);
+  free(pthis);
+}
+
+void latency_tracker_frame_pushed(struct latency_tracker_s* pthis,
+                                  GstClockTime pts,
+                                  const struct latency_marks_s* marks)
+{
+  uint64_t now = latency_now_ns();
+  g_mutex_lock(&pthis->lock);
+  histogram_add(&pthis->stages[latency_stage_parse],
+                marks->received_ns, marks->parsed_ns);
+  histogram_add(&pthis->stages[latency_stage_decode],
+                marks->parsed_ns, marks->decoded_ns);
+  histogram_add(&pthis->stages[latency_stage_push], marks->decoded_ns, now);
+  struct latency_entry_s* entry =
+  &pthis->entries[pthis->next_entry++ % LATENCY_TABLE_SIZE];
+  memset(entry, 0, sizeof(*entry));
+  entry->pts = pts;
+  entry->received_ns = marks->received_ns;
+  entry->pushed_ns = now;
+  g_mutex_unlock(&pthis->lock);
+}
+
+void latency_tracker_frame_decoded(struct latency_tracker_s* pthis,
+                                   GstClockTime pts)
+{
+  uint64_t now = latency_now_ns();
+  g_mutex_lock(&pthis->lock);
+  struct latency_entry_s* entry = find_exact(pthis, pts);
+  if (entry && !entry->decoded_ns) {
+    entry->decoded_ns = now;
+    histogram_add(&pthis->stages[latency_stage_jpegdec],
+                  entry->pushed_ns, now);
+  }
+  g_mutex_unlock(&pthis->lock);
+}
+
+void latency_tracker_frame_encoded(struct latency_tracker_s* pthis,
+                                   GstClockTime pts)
+{
+  uint64_t now = latency_now_ns();
+  g_mutex_lock(&pthis->lock);
+  struct latency_entry_s* entry = find_nearest(pthis, pts);
+  if (entry && entry->decoded_ns && !entry->encoded_ns) {
+    entry->encoded_ns = now;
+    histogram_add(&pthis->stages[latency_stage_encode],
+                  entry->decoded_ns, now);
+  }
+  g_mutex_unlock(&pthis->lock);
+}
+
+int latency_tracker_add_output(struct latency_tracker_s* pthis,
+                               const char* name)
+{
+  g_mutex_lock(&pthis->lock);
+  int output = -1;
+  if (pthis->output_count < LATENCY_MAX_OUTPUTS) {
+    output = pthis->output_count++;
+    snprintf(pthis->outputs[output].name, sizeof(pthis->outputs[output].name),
+             "%s", name);
+  }
+  g_mutex_unlock(&pthis->lock);
+  return output;
+}
+
+void latency_tracker_frame_muxed(struct latency_tracker_s* pthis,
+                                 int output, GstClockTime pts)
+{
+  if (output < 0 || output >= LATENCY_MAX_OUTPUTS) {
+    return;
+  }
+  uint64_t now = latency_now_ns();
+  g_mutex_lock(&pthis->lock);
+  struct latency_entry_s* entry = find_nearest(pthis, pts);
+  if (entry && entry->encoded_ns && !(entry->muxed & (1u << output))) {
+    entry->muxed |= 1u << output;
+    histogram_add(&pthis->outputs[output].mux, entry->encoded_ns, now);
+    histogram_add(&pthis->outputs[output].total, entry->received_ns, now);
+  }
+  g_mutex_unlock(&pthis->lock);
+}
+
+int latency_tracker_snapshot(struct latency_tracker_s* pthis,
+                             struct latency_summary_s* summaries, int max,
+                             char reset)
+{
+  int count = 0;
+  char name[64];
+  g_mutex_lock(&pthis->lock);
+  for (int i = 0; i < latency_stage_count && count < max; i++) {
+    count += histogram_summarize(&pthis->stages[i], stage_names[i],
+                                 &summaries[count]);
+  }
+  for (int i = 0; i < pthis->output_count && count < max; i++) {
+    struct latency_output_s* output = &pthis->outputs[i];
+    snprintf(name, sizeof(name), "mux:%s", output->name);
+    count += histogram_summarize(&output->mux, name, &summaries[count]);
+    if (count < max) {
+      snprintf(name, sizeof(name), "total:%s", output->name);
+      count += histogram_summarize(&output->total, name, &summaries[count]);
+    }
+  }
+  if (reset) {
+    memset(pthis->stages, 0, sizeof(pthis->stages));
+    for (int i = 0; i < pthis->output_count; i++) {
+      memset(&pthis->outputs[i].mux, 0, sizeof(struct histogram_s));
+      memset(&pthis->outputs[i].total, 0, sizeof(struct histogram_s));
+    }
+  }
+  g_mutex_unlock(&pthis->lock);
+  return count;
+}
+
+void latency_tracker_print(struct latency_tracker_s* pthis,
+                           const char* label)
+{
+  struct latency_summary_s summaries[LATENCY_MAX_SUMMARIES];
+  int count =
+  latency_tracker_snapshot(pthis, summaries, LATENCY_MAX_SUMMARIES, 1);
+  for (int i = 0; i < count; i++) {
+    g_print("latency: %s %-16s n=%-5lu p50=%.1fms p99=%.1fms max=%.1fms\n",
+            label ? label : "-", summaries[i].name, summaries[i].count,
+            summaries[i].p50_ns / 1e6, summaries[i].p99_ns / 1e6,
+            summaries[i].max_ns / 1e6);
+  }
+}
@@ -0,0 +1,90 @@
+//
+//  latency.h
+//  gst_ichabod
+//
+
+/**
+ * Per-stage latency of screencast frames, from ZMQ receive to the muxers.
+ *
+ * Before a frame has a PTS it carries its stage times in latency_marks_s.
+ * When it is pushed into appsrc the marks go into a side table keyed by
+ * PTS, and pad probes further down look the frame up again: exactly after
+ * jpegdec, by nearest PTS after videorate (which retimes frames onto its
+ * output grid) at the encoder and at each mux input. Each stage keeps a log
+ * bucketed histogram of the time since the previous stage.
+ */
+
+#ifndef latency_h
+#define latency_h
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+enum latency_stage {
+  // receive_message -> envelope parsed
+  latency_stage_parse = 0,
+  // parsed -> payload decoded, including the wait in the dispatch queue
+  latency_stage_decode,
+  // decoded -> handed to appsrc
+  latency_stage_push,
+  // appsrc -> out of jpegdec, including the raw multiqueue
+  latency_stage_jpegdec,
+  // jpegdec -> out of the video encoder, including videorate
+  latency_stage_encode,
+  latency_stage_count
+};
+
+// Monotonic stage times in ns; see latency_now_ns. 0 if not reached.
+struct latency_marks_s {
+  uint64_t received_ns;
+  uint64_t parsed_ns;
+  uint64_t decoded_ns;
+};
+
+struct latency_summary_s {
+  // stage name, or "mux:<element>" / "total:<element>" per output
+  char name[64];
+  uint64_t count;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+};
+
+#define LATENCY_MAX_OUTPUTS 8
+#define LATENCY_MAX_SUMMARIES (latency_stage_count + 2 * LATENCY_MAX_OUTPUTS)
+
+struct latency_tracker_s;
+
+void latency_tracker_alloc(struct latency_tracker_s** tracker_out);
+void latency_tracker_free(struct latency_tracker_s* tracker);
+
+uint64_t latency_now_ns(void);
+
+// Frame entered appsrc with this PTS. Records the pre-pipeline stages.
+void latency_tracker_frame_pushed(struct latency_tracker_s* tracker,
+                                  GstClockTime pts,
+                                  const struct latency_marks_s* marks);
+void latency_tracker_frame_decoded(struct latency_tracker_s* tracker,
+                                   GstClockTime pts);
+void latency_tracker_frame_encoded(struct latency_tracker_s* tracker,
+                                   GstClockTime pts);
+
+// Returns an index for latency_tracker_frame_muxed, or -1 if full.
+int latency_tracker_add_output(struct latency_tracker_s* tracker,
+                               const char* name);
+void latency_tracker_frame_muxed(struct latency_tracker_s* tracker,
+                                 int output, GstClockTime pts);
+
+/* Fills up to max summaries, one per stage that saw frames, and returns how
+ * many. With reset, histograms start over so the next snapshot covers only
+ * the frames since this one.
+ */
+int latency_tracker_snapshot(struct latency_tracker_s* tracker,
+                             struct latency_summary_s* summaries, int max,
+                             char reset);
+
+// Log a snapshot under label and reset
+void latency_tracker_print(struct latency_tracker_s* tracker,
+                           const char* label);
+
+#endif /* latency_h */
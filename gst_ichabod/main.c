@@ -17,6 +17,8 @@
 #include <glib.h>
 #include "ichabod_bin.h"
 #include "ichabod_sinks.h"
+#include "ichabod_daemon.h"
+#include "metrics.h"
 
 #define AUDIO_PORT_OPT 1000
 #define AUDIO_HOST_OPT 1001
@@ -32,6 +34,21 @@
 #define VIDEO_RTCP_PORT_OPT 1019
 #define VIDEO_RECV_RTP_PORT_OPT 1020
 #define VIDEO_RECV_RTCP_PORT_OPT 1021
+#define COALESCE_FRAMES_OPT 1030
+#define SESSION_ID_OPT 1031
+#define HORSEMAN_PULL_ENDPOINT_OPT 1032
+#define HORSEMAN_PUSH_ENDPOINT_OPT 1033
+#define DAEMON_OPT 1034
+#define CONTROL_ENDPOINT_OPT 1035
+#define HORSEMAN_CAPTURE_OPT 1036
+#define METRICS_LISTEN_OPT 1037
+#define RAW_INGEST_OPT 1038
+#define JPEG_DECODE_THREADS_OPT 1039
+#define SKIP_DUPLICATE_FRAMES_OPT 1040
+// every --x264_<key> option goes to ichabod_x264_option_set
+#define X264_OPT 1041
+#define VIDEO_ENCODER_OPT 1042
+#define VIDEO_RTP_RECV_ENCODER_OPT 1043
 
 int main(int argc, char *argv[])
 {
@@ -43,6 +60,10 @@ int main(int argc, char *argv[])
   char* output_path = NULL;
   char* broadcast_url = NULL;
   struct rtp_relay_config_s rtp_opts = { 0 };
+  struct ichabod_bin_config_s bin_opts = { 0 };
+  struct ichabod_daemon_config_s daemon_opts = { 0 };
+  char daemon_mode = 0;
+  char* metrics_listen = NULL;
 
   static struct option long_options[] =
   {
@@ -62,6 +83,29 @@ int main(int argc, char *argv[])
     {"video_rtcp_send_port", optional_argument,         0, VIDEO_RTCP_PORT_OPT},
     {"video_rtp_recv_port", optional_argument, 0, VIDEO_RECV_RTP_PORT_OPT},
     {"video_rtcp_recv_port", optional_argument, 0, VIDEO_RECV_RTCP_PORT_OPT},
+    {"coalesce_frames", no_argument, 0, COALESCE_FRAMES_OPT},
+    {"session_id", required_argument, 0, SESSION_ID_OPT},
+    {"horseman_pull_endpoint", required_argument, 0,
+      HORSEMAN_PULL_ENDPOINT_OPT},
+    {"horseman_push_endpoint", required_argument, 0,
+      HORSEMAN_PUSH_ENDPOINT_OPT},
+    {"daemon", no_argument, 0, DAEMON_OPT},
+    {"control_endpoint", required_argument, 0, CONTROL_ENDPOINT_OPT},
+    {"horseman_capture", required_argument, 0, HORSEMAN_CAPTURE_OPT},
+    {"metrics_listen", required_argument, 0, METRICS_LISTEN_OPT},
+    {"raw_ingest", no_argument, 0, RAW_INGEST_OPT},
+    {"jpeg_decode_threads", required_argument, 0, JPEG_DECODE_THREADS_OPT},
+    {"skip_duplicate_frames", no_argument, 0, SKIP_DUPLICATE_FRAMES_OPT},
+    {"x264_preset", required_argument, 0, X264_OPT},
+    {"x264_sessions_per_host", required_argument, 0, X264_OPT},
+    {"x264_threads", required_argument, 0, X264_OPT},
+    {"x264_sliced_threads", required_argument, 0, X264_OPT},
+    {"x264_rc_lookahead", required_argument, 0, X264_OPT},
+    {"x264_b_frames", required_argument, 0, X264_OPT},
+    {"x264_tune", required_argument, 0, X264_OPT},
+    {"video_encoder", required_argument, 0, VIDEO_ENCODER_OPT},
+    {"video_rtp_recv_encoder", required_argument, 0,
+      VIDEO_RTP_RECV_ENCODER_OPT},
     {0, 0, 0, 0}
   };
   /* getopt_long stores the option index here. */
@@ -134,6 +178,73 @@ int main(int argc, char *argv[])
         rtp_opts.video_recv_rtcp_port = atoi(optarg);
         g_print("video_recv_rtcp_port=%d\n", rtp_opts.video_recv_rtcp_port);
         break;
+      case COALESCE_FRAMES_OPT:
+        bin_opts.coalesce_frames = 1;
+        g_print("coalesce_frames=1\n");
+        break;
+      case SESSION_ID_OPT:
+        bin_opts.session_id = optarg;
+        g_print("session_id=%s\n", bin_opts.session_id);
+        break;
+      case HORSEMAN_PULL_ENDPOINT_OPT:
+        bin_opts.horseman_pull_endpoint = optarg;
+        g_print("horseman_pull_endpoint=%s\n",
+                bin_opts.horseman_pull_endpoint);
+        break;
+      case HORSEMAN_PUSH_ENDPOINT_OPT:
+        bin_opts.horseman_push_endpoint = optarg;
+        g_print("horseman_push_endpoint=%s\n",
+                bin_opts.horseman_push_endpoint);
+        break;
+      case DAEMON_OPT:
+        daemon_mode = 1;
+        g_print("daemon=1\n");
+        break;
+      case CONTROL_ENDPOINT_OPT:
+        daemon_opts.control_endpoint = optarg;
+        g_print("control_endpoint=%s\n", daemon_opts.control_endpoint);
+        break;
+      case HORSEMAN_CAPTURE_OPT:
+        bin_opts.horseman_capture_path = optarg;
+        g_print("horseman_capture=%s\n", bin_opts.horseman_capture_path);
+        break;
+      case METRICS_LISTEN_OPT:
+        metrics_listen = optarg;
+        daemon_opts.metrics_listen = optarg;
+        g_print("metrics_listen=%s\n", metrics_listen);
+        break;
+      case RAW_INGEST_OPT:
+        bin_opts.raw_ingest = 1;
+        g_print("raw_ingest=1\n");
+        break;
+      case JPEG_DECODE_THREADS_OPT:
+        bin_opts.jpeg_decode_threads = atoi(optarg);
+        g_print("jpeg_decode_threads=%d\n", bin_opts.jpeg_decode_threads);
+        break;
+      case SKIP_DUPLICATE_FRAMES_OPT:
+        bin_opts.skip_duplicate_frames = 1;
+        g_print("skip_duplicate_frames=1\n");
+        break;
+      case X264_OPT:
+        if (ichabod_x264_option_set(&bin_opts.x264,
+                                    long_options[option_index].name +
+                                    strlen("x264_"),
+                                    optarg))
+        {
+          g_printerr("Unknown option `--%s'.\n",
+                     long_options[option_index].name);
+          return 1;
+        }
+        g_print("%s=%s\n", long_options[option_index].name, optarg);
+        break;
+      case VIDEO_ENCODER_OPT:
+        bin_opts.video_encoder = optarg;
+        g_print("video_encoder=%s\n", bin_opts.video_encoder);
+        break;
+      case VIDEO_RTP_RECV_ENCODER_OPT:
+        rtp_opts.video_recv_encoder = optarg;
+        g_print("video_rtp_recv_encoder=%s\n", rtp_opts.video_recv_encoder);
+        break;
       case '?':
         if (isprint(optopt))
           g_printerr("Unknown option `-%c'.\n", optopt);
@@ -145,16 +256,39 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (daemon_mode) {
+    // sessions and their outputs come from the control socket instead
+    struct ichabod_daemon_s* daemon;
+    ichabod_daemon_alloc(&daemon);
+    ichabod_daemon_config(daemon, &daemon_opts);
+    int ret = ichabod_daemon_run(daemon);
+    ichabod_daemon_free(daemon);
+    return ret ? 1 : 0;
+  }
+
+  struct metrics_server_s* metrics = NULL;
+  if (metrics_listen) {
+    if (!gst_is_initialized()) {
+      gst_init(NULL, NULL);
+    }
+    metrics_server_alloc(&metrics);
+    if (metrics_server_listen(metrics, metrics_listen)) {
+      return 1;
+    }
+    bin_opts.metrics = metrics;
+  }
+
   struct ichabod_bin_s* ichabod_bin;
   ichabod_bin_alloc(&ichabod_bin);
+  ichabod_bin_config(ichabod_bin, &bin_opts);
   int ret;
 
   if (output_path) {
-    ret = ichabod_attach_file(ichabod_bin, output_path);
+    ret = ichabod_attach_file(ichabod_bin, output_path, NULL);
   }
 
   if (broadcast_url) {
-    ret = ichabod_attach_rtmp(ichabod_bin, broadcast_url);
+    ret = ichabod_attach_rtmp(ichabod_bin, broadcast_url, NULL);
   }
 
   if (rtp_opts.video_recv_rtp_port && rtp_opts.audio_recv_rtp_port) {
@@ -180,6 +314,9 @@ int main(int argc, char *argv[])
   }
 
   ichabod_bin_start(ichabod_bin);
-  
+  if (metrics) {
+    metrics_server_free(metrics);
+  }
+
   return 0;
 }
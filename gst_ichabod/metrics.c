@@ -0,0 +1,322 @@
+//
+//  metrics.c
+//  gst_ichabod
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include "metrics.h"
+
+#define METRICS_DEFAULT_HOST "127.0.0.1"
+#define METRICS_MAX_REQUEST 4096
+
+struct metrics_family_s {
+  enum metrics_type type;
+  char* name;
+  char* help;
+  GString* samples;
+};
+
+struct metrics_s {
+  // family name -> family, and the order families were first seen in
+  GHashTable* families;
+  GPtrArray* order;
+};
+
+struct metrics_source_s {
+  guint id;
+  metrics_collect_f collect;
+  void* p;
+};
+
+struct metrics_server_s {
+  GSocketService* service;
+  char* unix_path;
+  GList* sources;
+  guint next_source_id;
+};
+
+struct metrics_conn_s {
+  struct metrics_server_s* server;
+  GSocketConnection* connection;
+  char request[METRICS_MAX_REQUEST];
+  gsize length;
+  GString* response;
+};
+
+#pragma mark - Scrape
+
+static void family_free(gpointer p) {
+  struct metrics_family_s* family = (struct metrics_family_s*)p;
+  free(family->name);
+  free(family->help);
+  g_string_free(family->samples, TRUE);
+  free(family);
+}
+
+void metrics_add(struct metrics_s* pthis, enum metrics_type type,
+                 const char* name, const char* help,
+                 const char* labels, double value)
+{
+  struct metrics_family_s* family =
+  (struct metrics_family_s*)g_hash_table_lookup(pthis->families, name);
+  if (!family) {
+    family = (struct metrics_family_s*)
+    calloc(1, sizeof(struct metrics_family_s));
+    family->type = type;
+    family->name = strdup(name);
+    family->help = strdup(help ? help : "");
+    family->samples = g_string_new(NULL);
+    g_hash_table_insert(pthis->families, family->name, family);
+    g_ptr_array_add(pthis->order, family);
+  }
+  if (labels && labels[0]) {
+    g_string_append_printf(family->samples, "%s{%s} %.17g\n",
+                           name, labels, value);
+  } else {
+    g_string_append_printf(family->samples, "%s %.17g\n", name, value);
+  }
+}
+
+char* metrics_label_append(char* labels, size_t size,
+                           const char* key, const char* value)
+{
+  size_t len = strlen(labels);
+  if (len && len + 1 < size) {
+    labels[len++] = ',';
+  }
+  len += snprintf(labels + len, len < size ? size - len : 0, "%s=\"", key);
+  for (const char* c = value; *c && len + 3 < size; c++) {
+    if ('\\' == *c || '"' == *c) {
+      labels[len++] = '\\';
+      labels[len++] = *c;
+    } else if ('\n' == *c) {
+      labels[len++] = '\\';
+      labels[len++] = 'n';
+    } else {
+      labels[len++] = *c;
+    }
+  }
+  if (len + 1 < size) {
+    labels[len++] = '"';
+  }
+  labels[len < size ? len : size - 1] = '\0';
+  return labels;
+}
+
+static GString* metrics_scrape(struct metrics_server_s* server) {
+  struct metrics_s scrape;
+  scrape.families =
+  g_hash_table_new_full(g_str_hash, g_str_equal, NULL, family_free);
+  scrape.order = g_ptr_array_new();
+  for (GList* l = server->sources; l; l = l->next) {
+    struct metrics_source_s* source = (struct metrics_source_s*)l->data;
+    source->collect(&scrape, source->p);
+  }
+
+  GString* body = g_string_new(NULL);
+  for (guint i = 0; i < scrape.order->len; i++) {
+    struct metrics_family_s* family =
+    (struct metrics_family_s*)g_ptr_array_index(scrape.order, i);
+    g_string_append_printf(body, "# HELP %s %s\n# TYPE %s %s\n%s",
+                           family->name, family->help, family->name,
+                           metrics_type_counter == family->type ?
+                           "counter" : "gauge",
+                           family->samples->str);
+  }
+  g_ptr_array_free(scrape.order, TRUE);
+  g_hash_table_destroy(scrape.families);
+  return body;
+}
+
+#pragma mark - HTTP
+
+static void conn_free(struct metrics_conn_s* conn) {
+  g_io_stream_close(G_IO_STREAM(conn->connection), NULL, NULL);
+  g_object_unref(conn->connection);
+  if (conn->response) {
+    g_string_free(conn->response, TRUE);
+  }
+  free(conn);
+}
+
+static void on_response_written(GObject* stream, GAsyncResult* result,
+                                gpointer p)
+{
+  struct metrics_conn_s* conn = (struct metrics_conn_s*)p;
+  g_output_stream_write_all_finish(G_OUTPUT_STREAM(stream), result,
+                                   NULL, NULL);
+  conn_free(conn);
+}
+
+static void send_response(struct metrics_conn_s* conn) {
+  const char* status = "404 Not Found";
+  GString* body = NULL;
+  if (!strncmp(conn->request, "GET /metrics ", 13) ||
+      !strncmp(conn->request, "GET / ", 6))
+  {
+    status = "200 OK";
+    body = metrics_scrape(conn->server);
+  } else {
+    body = g_string_new("not found\n");
+  }
+  conn->response = g_string_new(NULL);
+  g_string_printf(conn->response,
+                  "HTTP/1.0 %s\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %lu\r\n"
+                  "Connection: close\r\n\r\n",
+                  status, (unsigned long)body->len);
+  g_string_append_len(conn->response, body->str, body->len);
+  g_string_free(body, TRUE);
+
+  GOutputStream* out =
+  g_io_stream_get_output_stream(G_IO_STREAM(conn->connection));
+  g_output_stream_write_all_async(out, conn->response->str,
+                                  conn->response->len, G_PRIORITY_DEFAULT,
+                                  NULL, on_response_written, conn);
+}
+
+static void read_request(struct metrics_conn_s* conn);
+
+static void on_request_read(GObject* stream, GAsyncResult* result,
+                            gpointer p)
+{
+  struct metrics_conn_s* conn = (struct metrics_conn_s*)p;
+  gssize ret = g_input_stream_read_finish(G_INPUT_STREAM(stream), result,
+                                          NULL);
+  if (ret <= 0) {
+    conn_free(conn);
+    return;
+  }
+  conn->length += ret;
+  conn->request[conn->length] = '\0';
+  // answer once the headers are in; nothing we serve needs a body
+  if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n") ||
+      conn->length >= sizeof(conn->request) - 1)
+  {
+    send_response(conn);
+  } else {
+    read_request(conn);
+  }
+}
+
+static void read_request(struct metrics_conn_s* conn) {
+  GInputStream* in =
+  g_io_stream_get_input_stream(G_IO_STREAM(conn->connection));
+  g_input_stream_read_async(in, conn->request + conn->length,
+                            sizeof(conn->request) - 1 - conn->length,
+                            G_PRIORITY_DEFAULT, NULL, on_request_read, conn);
+}
+
+static gboolean on_incoming(GSocketService* service,
+                            GSocketConnection* connection,
+                            GObject* source_object, gpointer p)
+{
+  struct metrics_conn_s* conn =
+  (struct metrics_conn_s*)calloc(1, sizeof(struct metrics_conn_s));
+  conn->server = (struct metrics_server_s*)p;
+  conn->connection = g_object_ref(connection);
+  read_request(conn);
+  return TRUE;
+}
+
+#pragma mark - Public API
+
+void metrics_server_alloc(struct metrics_server_s** server_out) {
+  struct metrics_server_s* pthis =
+  (struct metrics_server_s*)calloc(1, sizeof(struct metrics_server_s));
+  pthis->service = g_socket_service_new();
+  g_signal_connect(pthis->service, "incoming",
+                   G_CALLBACK(on_incoming), pthis);
+  *server_out = pthis;
+}
+
+void metrics_server_free(struct metrics_server_s* pthis) {
+  g_socket_service_stop(pthis->service);
+  g_socket_listener_close(G_SOCKET_LISTENER(pthis->service));
+  g_object_unref(pthis->service);
+  if (pthis->unix_path) {
+    unlink(pthis->unix_path);
+    free(pthis->unix_path);
+  }
+  g_list_free_full(pthis->sources, free);
+  free(pthis);
+}
+
+int metrics_server_listen(struct metrics_server_s* pthis,
+                          const char* address)
+{
+  GSocketAddress* sock_addr = NULL;
+  if (g_str_has_prefix(address, "unix:")) {
+    const char* path = address + strlen("unix:");
+    // a previous run may have left its socket behind
+    unlink(path);
+    free(pthis->unix_path);
+    pthis->unix_path = strdup(path);
+    sock_addr = g_unix_socket_address_new(path);
+  } else {
+    const char* port = strrchr(address, ':');
+    char host[256];
+    size_t host_len = port ? (size_t)(port - address) : 0;
+    if (!host_len || host_len >= sizeof(host)) {
+      snprintf(host, sizeof(host), "%s", METRICS_DEFAULT_HOST);
+    } else {
+      memcpy(host, address, host_len);
+      host[host_len] = '\0';
+    }
+    sock_addr =
+    g_inet_socket_address_new_from_string(host,
+                                          atoi(port ? port + 1 : address));
+  }
+  if (!sock_addr) {
+    g_printerr("metrics: cannot parse listen address %s\n", address);
+    return -1;
+  }
+
+  GError* error = NULL;
+  gboolean ret =
+  g_socket_listener_add_address(G_SOCKET_LISTENER(pthis->service),
+                                sock_addr, G_SOCKET_TYPE_STREAM,
+                                G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+                                &error);
+  g_object_unref(sock_addr);
+  if (!ret) {
+    g_printerr("metrics: failed to listen on %s: %s\n",
+               address, error->message);
+    g_error_free(error);
+    return -1;
+  }
+  g_socket_service_start(pthis->service);
+  g_print("metrics: serving on %s\n", address);
+  return 0;
+}
+
+guint metrics_server_add_source(struct metrics_server_s* pthis,
+                                metrics_collect_f collect, void* p)
+{
+  struct metrics_source_s* source =
+  (struct metrics_source_s*)calloc(1, sizeof(struct metrics_source_s));
+  source->id = ++pthis->next_source_id;
+  source->collect = collect;
+  source->p = p;
+  pthis->sources = g_list_append(pthis->sources, source);
+  return source->id;
+}
+
+void metrics_server_remove_source(struct metrics_server_s* pthis,
+                                  guint source_id)
+{
+  for (GList* l = pthis->sources; l; l = l->next) {
+    struct metrics_source_s* source = (struct metrics_source_s*)l->data;
+    if (source->id == source_id) {
+      pthis->sources = g_list_delete_link(pthis->sources, l);
+      free(source);
+      return;
+    }
+  }
+}
@@ -0,0 +1,57 @@
+//
+//  metrics.h
+//  gst_ichabod
+//
+
+/**
+ * Prometheus text exposition over a local HTTP endpoint. Components register
+ * a collect callback; each scrape calls every callback on the main context,
+ * so collectors may read element properties and bin state without extra
+ * locking against pipeline teardown.
+ */
+
+#ifndef metrics_h
+#define metrics_h
+
+#include <stddef.h>
+#include <glib.h>
+
+enum metrics_type {
+  metrics_type_counter = 0,
+  metrics_type_gauge
+};
+
+// One scrape in progress
+struct metrics_s;
+
+/* labels is the inside of the braces (key="value",...) and may be NULL.
+ * Samples are grouped by name on output, so several collectors can report
+ * the same family under different labels.
+ */
+void metrics_add(struct metrics_s* metrics, enum metrics_type type,
+                 const char* name, const char* help,
+                 const char* labels, double value);
+
+// Appends key="value" to labels, escaping value. Returns labels.
+char* metrics_label_append(char* labels, size_t size,
+                           const char* key, const char* value);
+
+typedef void (*metrics_collect_f)(struct metrics_s* metrics, void* p);
+
+struct metrics_server_s;
+
+void metrics_server_alloc(struct metrics_server_s** server_out);
+void metrics_server_free(struct metrics_server_s* server);
+
+/* address is "host:port", ":port" (loopback) or "unix:/path". Serves
+ * GET /metrics on the thread-default main context.
+ */
+int metrics_server_listen(struct metrics_server_s* server,
+                          const char* address);
+
+guint metrics_server_add_source(struct metrics_server_s* server,
+                                metrics_collect_f collect, void* p);
+void metrics_server_remove_source(struct metrics_server_s* server,
+                                  guint source_id);
+
+#endif /* metrics_h */
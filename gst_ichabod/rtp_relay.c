@@ -5,10 +5,15 @@
 //  Created by Charley Robinson on 4/5/18.
 //
 
+#include <stdio.h>
 #include <gio/gio.h>
 #include <gst/rtp/rtp.h>
 #include "rtp_relay.h"
 #include "webrtc_relay.h"
+#include "encoder_backend.h"
+
+// what received video is re-encoded to for the webrtc relay by default
+#define RECV_VIDEO_ENCODER_DEFAULT "vp8"
 
 struct rtp_relay_s {
   struct rtp_relay_config_s config;
@@ -186,12 +191,20 @@ static GstPad* create_h264_recv_chain(struct rtp_relay_s* pthis) {
   GstElement* parser = gst_element_factory_make("h264parse", NULL);
   g_object_set(G_OBJECT(parser), "config-interval", 1, NULL);
   GstElement* decoder = gst_element_factory_make("avdec_h264", NULL);
-  GstElement* encoder = gst_element_factory_make("vp8enc", NULL);
-  g_object_set(G_OBJECT(encoder),
-               "keyframe-max-dist", 15,
-               "deadline", 1,
-               NULL);
-  GstElement* packetizer = gst_element_factory_make("rtpvp8pay", NULL);
+  const struct encoder_backend_s* backend = NULL;
+  if (pthis->config.video_recv_encoder) {
+    backend = encoder_backend_find(pthis->config.video_recv_encoder);
+  }
+  if (!backend) {
+    backend = encoder_backend_find(RECV_VIDEO_ENCODER_DEFAULT);
+  }
+  g_assert(backend);
+  // frequent keyframes so peers joining the relay start quickly
+  struct encoder_backend_settings_s settings = { 0 };
+  settings.key_int_max = 15;
+  GstElement* encoder = encoder_backend_make(backend, &settings);
+  GstElement* packetizer =
+  gst_element_factory_make(encoder_backend_get_rtp_payloader(backend), NULL);
 
   gst_bin_add_many(pthis->bin, queue, depacketizer, parser, decoder,
                    encoder, packetizer,
@@ -205,7 +218,8 @@ static GstPad* create_h264_recv_chain(struct rtp_relay_s* pthis) {
   pthis->video_send_caps =
   gst_caps_new_simple("application/x-rtp",
                       "media", G_TYPE_STRING, "video",
-                      "encoding-name", G_TYPE_STRING, "VP8",
+                      "encoding-name", G_TYPE_STRING,
+                      encoder_backend_get_rtp_encoding_name(backend),
                       "clock-rate", G_TYPE_INT, 90000,
                       "payload", G_TYPE_INT, 96,
                       NULL);
@@ -495,3 +509,126 @@ int rtp_relay_set_recv_audio_src(struct rtp_relay_s* pthis,
   return 0;
 }
 
+
+#pragma mark - Metrics
+
+static void collect_uint_stat(struct metrics_s* metrics, enum metrics_type type,
+                              const GstStructure* stats, const char* field,
+                              const char* name, const char* help,
+                              const char* labels)
+{
+  guint64 value64;
+  guint value;
+  if (gst_structure_get_uint64(stats, field, &value64)) {
+    metrics_add(metrics, type, name, help, labels, (double)value64);
+  } else if (gst_structure_get_uint(stats, field, &value)) {
+    metrics_add(metrics, type, name, help, labels, (double)value);
+  }
+}
+
+static void collect_source_stats(struct metrics_s* metrics,
+                                 const GstStructure* source,
+                                 const char* labels)
+{
+  gboolean internal = FALSE;
+  gboolean is_sender = FALSE;
+  guint ssrc = 0;
+  gst_structure_get_boolean(source, "internal", &internal);
+  gst_structure_get_boolean(source, "is-sender", &is_sender);
+  gst_structure_get_uint(source, "ssrc", &ssrc);
+
+  char source_labels[256];
+  char sz_ssrc[16];
+  snprintf(source_labels, sizeof(source_labels), "%s", labels);
+  snprintf(sz_ssrc, sizeof(sz_ssrc), "%u", ssrc);
+  metrics_label_append(source_labels, sizeof(source_labels), "ssrc", sz_ssrc);
+  metrics_label_append(source_labels, sizeof(source_labels), "direction",
+                       internal ? "send" : "recv");
+
+  if (internal) {
+    collect_uint_stat(metrics, metrics_type_counter, source, "packets-sent",
+                      "ichabod_rtp_packets_sent_total",
+                      "RTP packets sent", source_labels);
+    collect_uint_stat(metrics, metrics_type_counter, source, "octets-sent",
+                      "ichabod_rtp_octets_sent_total",
+                      "RTP payload octets sent", source_labels);
+    collect_uint_stat(metrics, metrics_type_gauge, source, "bitrate",
+                      "ichabod_rtp_send_bitrate_bps",
+                      "Estimated RTP send bitrate", source_labels);
+  } else if (is_sender) {
+    collect_uint_stat(metrics, metrics_type_counter, source,
+                      "packets-received", "ichabod_rtp_packets_received_total",
+                      "RTP packets received", source_labels);
+    collect_uint_stat(metrics, metrics_type_counter, source,
+                      "octets-received", "ichabod_rtp_octets_received_total",
+                      "RTP payload octets received", source_labels);
+    gint lost = 0;
+    if (gst_structure_get_int(source, "packets-lost", &lost)) {
+      metrics_add(metrics, metrics_type_gauge, "ichabod_rtp_packets_lost",
+                  "Cumulative RTP packets lost (may go down on duplicates)",
+                  source_labels, lost);
+    }
+    collect_uint_stat(metrics, metrics_type_gauge, source, "jitter",
+                      "ichabod_rtp_jitter_clock_units",
+                      "Interarrival jitter in RTP clock units", source_labels);
+  }
+
+  // receiver reports about this source, as seen by the far end
+  gboolean have_rb = FALSE;
+  gst_structure_get_boolean(source, "have-rb", &have_rb);
+  if (have_rb) {
+    guint round_trip = 0;
+    if (gst_structure_get_uint(source, "rb-round-trip", &round_trip)) {
+      // compact NTP, 1/65536 s
+      metrics_add(metrics, metrics_type_gauge,
+                  "ichabod_rtp_round_trip_seconds",
+                  "Round trip time from RTCP receiver reports",
+                  source_labels, round_trip / 65536.0);
+    }
+    guint fraction_lost = 0;
+    if (gst_structure_get_uint(source, "rb-fractionlost", &fraction_lost)) {
+      metrics_add(metrics, metrics_type_gauge,
+                  "ichabod_rtp_fraction_lost",
+                  "Fraction lost from the last RTCP receiver report",
+                  source_labels, fraction_lost / 256.0);
+    }
+  }
+}
+
+void rtp_relay_collect_metrics(struct rtp_relay_s* pthis,
+                               struct metrics_s* metrics, const char* labels)
+{
+  static const char* media[] = { "video", "audio" };
+  for (guint session_id = 0; session_id < G_N_ELEMENTS(media); session_id++) {
+    GObject* session = NULL;
+    g_signal_emit_by_name(pthis->rtpbin, "get-internal-session",
+                          session_id, &session);
+    if (!session) {
+      continue;
+    }
+    GstStructure* stats = NULL;
+    g_object_get(session, "stats", &stats, NULL);
+    g_object_unref(session);
+    if (!stats) {
+      continue;
+    }
+
+    char session_labels[256];
+    snprintf(session_labels, sizeof(session_labels), "%s", labels);
+    metrics_label_append(session_labels, sizeof(session_labels),
+                         "media", media[session_id]);
+
+    const GValue* value = gst_structure_get_value(stats, "source-stats");
+    if (value && G_VALUE_HOLDS(value, G_TYPE_VALUE_ARRAY)) {
+      G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+      GValueArray* sources = (GValueArray*)g_value_get_boxed(value);
+      for (guint i = 0; sources && i < sources->n_values; i++) {
+        const GstStructure* source =
+        gst_value_get_structure(g_value_array_get_nth(sources, i));
+        collect_source_stats(metrics, source, session_labels);
+      }
+      G_GNUC_END_IGNORE_DEPRECATIONS
+    }
+    gst_structure_free(stats);
+  }
+}
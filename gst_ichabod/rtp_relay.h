@@ -9,6 +9,7 @@
 #define rtp_relay_h
 
 #include <gst/gst.h>
+#include "metrics.h"
 
 struct rtp_relay_s;
 
@@ -30,6 +31,8 @@ struct rtp_relay_config_s {
   int video_recv_rtcp_port;
   unsigned long video_ssrc;
   char video_pt;
+  // encoder_backend for the received video relayed on. NULL: vp8.
+  const char* video_recv_encoder;
 };
 
 void rtp_relay_alloc(struct rtp_relay_s** rtp_relay_out);
@@ -47,4 +50,10 @@ int rtp_relay_set_recv_video_src(struct rtp_relay_s* rtp_relay,
 int rtp_relay_set_recv_audio_src(struct rtp_relay_s* rtp_relay,
                                  GstPad* src, GstCaps* caps);
 
+/* Report per-source RTP stats from rtpbin (session 0 video, 1 audio) under
+ * the given labels. Call from the main context.
+ */
+void rtp_relay_collect_metrics(struct rtp_relay_s* rtp_relay,
+                               struct metrics_s* metrics, const char* labels);
+
 #endif /* rtp_recv_h */
@@ -6,18 +6,98 @@
 //
 
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
 #include <uv.h>
+#include <turbojpeg.h>
 #include "screencast_src.h"
 #include "wallclock.h"
 #include "base64.h"
+#include "frame_hash.h"
+#include "framepool.h"
+
+/* A run of identical frames still lets one through this often. videorate
+ * only fills a gap once the next frame arrives, so without these the
+ * encoder and outputs would stall for as long as the screen stays still.
+ */
+#define DUPLICATE_REFRESH_MS 500
+
+/* Decoded frames come from a pool sized to the largest frame seen so far,
+ * plus headroom, rounded up to this.
+ */
+#define FRAME_POOL_ALIGN (64 * 1024)
+// preallocated up front; the pool grows past this if downstream holds more
+#define FRAME_POOL_MIN_BUFFERS 8
+
+// largest raw frame width or height we'll lay out
+#define RAW_FRAME_MAX_DIMENSION 16384
+/* appsrc's default max-bytes (200000) is less than one raw frame, so it
+ * would report enough_data on every push. Raw ingest queues this many.
+ */
+#define RAW_QUEUE_FRAMES 3
+// largest tile canvas width or height; the canvas is allocated up front
+#define TILE_CANVAS_MAX_DIMENSION 8192
+
+// A frame as received, before any decoding. Owns its payload.
+struct pending_frame_s {
+  uint64_t timestamp;
+  const uint8_t* data;
+  size_t length;
+  char is_base64;
+  char is_raw;
+  // a snapshot of the tile canvas; free_data is the GstBuffer itself
+  char is_canvas;
+  struct screencast_raw_frame_s raw;
+  struct latency_marks_s marks;
+  GDestroyNotify free_func;
+  gpointer free_data;
+};
 
 struct screencast_src_s {
   GstElement* element;
   GstClock* wall_clock;
+  // the pipeline clock wall_clock is calibrated against. guarded by lock.
+  GstClock* master_clock;
 
   uv_mutex_t lock;
   char allow_data;
+
+  // latest-frame-wins mode: newest frame waiting for appsrc to want data
+  char coalesce_frames;
+  struct pending_frame_s pending;
+  // serializes pushes from the horseman thread and need_data
+  uv_mutex_t push_lock;
+
+  struct screencast_src_stats_s stats;
+  struct latency_tracker_s* latency;
+
+  // skip frames identical to the last one pushed. guarded by push_lock.
+  char skip_duplicates;
+  char have_last_frame;
+  uint64_t last_hash;
+  size_t last_length;
+  uint64_t last_timestamp;
+
+  char raw_ingest;
+  // layout the appsrc caps currently describe. guarded by push_lock.
+  char have_raw_caps;
+  struct screencast_raw_frame_s raw_caps;
+
+  // base64 decode output. guarded by push_lock.
+  GstBufferPool* pool;
+  gsize pool_size;
+
+  // tile updates land here (BGRA). guarded by push_lock.
+  GstBuffer* canvas;
+  uint32_t canvas_width;
+  uint32_t canvas_height;
+  tjhandle tj;
+
+  void (*on_ready_changed)(struct screencast_src_s* screencast_src,
+                           char ready, void* p);
+  void* callback_p;
 };
 
 static void app_src_enough_data(GstAppSrc *src, gpointer p);
@@ -29,8 +109,11 @@ void screencast_src_alloc(struct screencast_src_s** screencast_src_out) {
   calloc(1, sizeof(struct screencast_src_s));
 
   uv_mutex_init(&pthis->lock);
+  uv_mutex_init(&pthis->push_lock);
 
   pthis->element = gst_element_factory_make("appsrc", NULL);
+  // keep our own reference; the pipeline takes another when it adopts us
+  gst_object_ref_sink(pthis->element);
   GstCaps* caps = gst_caps_new_simple("image/jpeg", NULL);
   gst_app_src_set_caps(pthis->element, caps);
   gst_app_src_set_size(pthis->element, -1);
@@ -49,68 +132,648 @@ void screencast_src_alloc(struct screencast_src_s** screencast_src_out) {
   *screencast_src_out = pthis;
 }
 
+void screencast_src_config(struct screencast_src_s* pthis,
+                           struct screencast_src_config_s* config)
+{
+  pthis->on_ready_changed = config->on_ready_changed;
+  pthis->callback_p = config->p;
+  pthis->coalesce_frames = config->coalesce_frames;
+  pthis->latency = config->latency;
+  pthis->skip_duplicates = config->skip_duplicates;
+  // raw caps are set from the first frame, before anything is pushed
+  pthis->raw_ingest = config->raw_ingest;
+}
+
 void screencast_src_free(struct screencast_src_s* pthis) {
   gst_object_unref(pthis->element);
   pthis->element = NULL;
   gst_object_unref(pthis->wall_clock);
   pthis->wall_clock = NULL;
+  if (pthis->master_clock) {
+    gst_object_unref(pthis->master_clock);
+  }
+  if (pthis->pending.free_func) {
+    pthis->pending.free_func(pthis->pending.free_data);
+  }
+  if (pthis->canvas) {
+    gst_buffer_unref(pthis->canvas);
+  }
+  if (pthis->pool) {
+    gst_buffer_pool_set_active(pthis->pool, FALSE);
+    gst_object_unref(pthis->pool);
+  }
+  if (pthis->tj) {
+    tjDestroy(pthis->tj);
+  }
   uv_mutex_destroy(&pthis->lock);
+  uv_mutex_destroy(&pthis->push_lock);
   free(pthis);
 }
 
-void screencast_src_push_frame(struct screencast_src_s* pthis,
-                               uint64_t timestamp, const char* frame_base64)
-{
-  uv_mutex_lock(&pthis->lock);
-  char allow_frame = pthis->allow_data;
-  uv_mutex_unlock(&pthis->lock);
-  if (!allow_frame) {
-    g_print("screencastsrc: skipping incoming frame (not ready)\n");
-    return;
-  }
-
+// Returns nonzero if we have a clock to stamp frames with
+static char screencast_src_sync_clock(struct screencast_src_s* pthis) {
   GstClock* master_clock = gst_element_get_clock(pthis->element);
   if (!master_clock) {
     g_print("screencastsrc: skip frame: no master clock to sync to\n");
-    return;
+    return 0;
   }
 
   uv_mutex_lock(&pthis->lock);
-  if (master_clock != gst_clock_get_master(pthis->wall_clock)) {
+  if (master_clock != pthis->master_clock) {
     g_print("screencastsrc: new master clock detected.\n");
-    gst_clock_set_master(pthis->wall_clock, master_clock);
-    // one-shot bootleg calibration to get timestamps adjusted immediately
-    GstClockTime internal = gst_clock_get_internal_time(pthis->wall_clock);
-    GstClockTime external = gst_clock_get_time(master_clock);
-    // just assume the clocks run at the same speed for now (should be close)
-    gst_clock_set_calibration(pthis->wall_clock, internal, external, 1, 1);
+    if (pthis->master_clock) {
+      gst_object_unref(pthis->master_clock);
+    }
+    pthis->master_clock = gst_object_ref(master_clock);
+    gst_wall_clock_reset(pthis->wall_clock);
   }
   uv_mutex_unlock(&pthis->lock);
+  /* One observation per frame keeps the fit tracking drift as it builds up.
+   * The first one alone gives an offset at 1:1, so timestamps are adjusted
+   * from the first frame on.
+   */
+  GstClockTime internal = gst_clock_get_internal_time(pthis->wall_clock);
+  GstClockTime external = gst_clock_get_time(master_clock);
+  gst_wall_clock_observe(pthis->wall_clock, internal, external);
+  gst_object_unref(master_clock);
+  return 1;
+}
 
-  // base64 decode
-  size_t b_length = 0;
-  const uint8_t* b_img =
-  base64_decode((const unsigned char*)frame_base64,
-                strlen(frame_base64),
-                &b_length);
-  // create buffer
-  GstBuffer* buf = gst_buffer_new_wrapped((gpointer)b_img, b_length);
+static void release_frame(struct pending_frame_s* frame) {
+  frame->free_func(frame->free_data);
+  frame->free_func = NULL;
+  frame->free_data = NULL;
+}
 
-  // input timestamp is in millis; convert before adjusting to GstClock
-  timestamp *= GST_MSECOND;
+static const char* raw_format_name(enum screencast_raw_format format) {
+  switch (format) {
+    case screencast_raw_format_i420:
+      return "I420";
+    case screencast_raw_format_nv12:
+      return "NV12";
+    case screencast_raw_format_bgra:
+      return "BGRA";
+  }
+  return NULL;
+}
 
-  GstClockTime ts = gst_wall_clock_adjust_safe(pthis->wall_clock, timestamp);
+static GstVideoFormat raw_video_format(enum screencast_raw_format format) {
+  switch (format) {
+    case screencast_raw_format_i420:
+      return GST_VIDEO_FORMAT_I420;
+    case screencast_raw_format_nv12:
+      return GST_VIDEO_FORMAT_NV12;
+    case screencast_raw_format_bgra:
+      return GST_VIDEO_FORMAT_BGRA;
+  }
+  return GST_VIDEO_FORMAT_UNKNOWN;
+}
+
+// Plane offsets and strides of a raw frame. Returns nonzero if the frame is
+// empty or oversized, the strides are too short for the width (or too long
+// for a gint), or the payload too short for the planes.
+static int raw_frame_layout(const struct screencast_raw_frame_s* raw,
+                            size_t length, guint* n_planes,
+                            gsize offsets[GST_VIDEO_MAX_PLANES],
+                            gint strides[GST_VIDEO_MAX_PLANES])
+{
+  if (!raw->width || !raw->height ||
+      raw->width > RAW_FRAME_MAX_DIMENSION ||
+      raw->height > RAW_FRAME_MAX_DIMENSION)
+  {
+    return -1;
+  }
+  size_t chroma_width = ((size_t)raw->width + 1) / 2;
+  size_t chroma_height = ((size_t)raw->height + 1) / 2;
+  size_t row_bytes[3] = { 0 };
+  size_t rows[3] = { 0 };
+  switch (raw->format) {
+    case screencast_raw_format_i420:
+      *n_planes = 3;
+      row_bytes[0] = raw->width;
+      row_bytes[1] = row_bytes[2] = chroma_width;
+      rows[0] = raw->height;
+      rows[1] = rows[2] = chroma_height;
+      break;
+    case screencast_raw_format_nv12:
+      *n_planes = 2;
+      row_bytes[0] = raw->width;
+      row_bytes[1] = 2 * chroma_width;
+      rows[0] = raw->height;
+      rows[1] = chroma_height;
+      break;
+    case screencast_raw_format_bgra:
+      *n_planes = 1;
+      row_bytes[0] = 4 * (size_t)raw->width;
+      rows[0] = raw->height;
+      break;
+    default:
+      return -1;
+  }
+  size_t offset = 0;
+  for (guint i = 0; i < *n_planes; i++) {
+    if (raw->strides[i] < row_bytes[i] || raw->strides[i] > INT_MAX) {
+      return -1;
+    }
+    offsets[i] = offset;
+    strides[i] = raw->strides[i];
+    offset += (size_t)raw->strides[i] * rows[i];
+  }
+  return offset <= length ? 0 : -1;
+}
+
+// frame_size is the payload size of one frame in this layout. Call with
+// push_lock held.
+static void update_raw_caps(struct screencast_src_s* pthis,
+                            const struct screencast_raw_frame_s* raw,
+                            size_t frame_size)
+{
+  if (pthis->have_raw_caps && raw->format == pthis->raw_caps.format &&
+      raw->width == pthis->raw_caps.width &&
+      raw->height == pthis->raw_caps.height)
+  {
+    return;
+  }
+  g_print("screencastsrc: raw caps %s %ux%u\n", raw_format_name(raw->format),
+          raw->width, raw->height);
+  GstCaps* caps =
+  gst_caps_new_simple("video/x-raw",
+                      "format", G_TYPE_STRING, raw_format_name(raw->format),
+                      "width", G_TYPE_INT, (int)raw->width,
+                      "height", G_TYPE_INT, (int)raw->height,
+                      "framerate", GST_TYPE_FRACTION, 0, 1,
+                      NULL);
+  gst_app_src_set_caps(GST_APP_SRC(pthis->element), caps);
+  gst_caps_unref(caps);
+  gst_app_src_set_max_bytes(GST_APP_SRC(pthis->element),
+                            RAW_QUEUE_FRAMES * frame_size);
+  pthis->raw_caps = *raw;
+  pthis->have_raw_caps = 1;
+}
+
+/* A buffer of at least size bytes from the frame pool. The pool is replaced
+ * by a larger one when a frame outgrows it; buffers from the old one go away
+ * as they come back. Call with push_lock held.
+ */
+static GstBuffer* acquire_frame_buffer(struct screencast_src_s* pthis,
+                                       gsize size)
+{
+  if (!pthis->pool || size > pthis->pool_size) {
+    gsize pool_size = (size + size / 4 + FRAME_POOL_ALIGN - 1) &
+    ~(gsize)(FRAME_POOL_ALIGN - 1);
+    if (pthis->pool) {
+      gst_buffer_pool_set_active(pthis->pool, FALSE);
+      gst_object_unref(pthis->pool);
+    }
+    pthis->pool = gst_frame_pool_new();
+    GstStructure* config = gst_buffer_pool_get_config(pthis->pool);
+    gst_buffer_pool_config_set_params(config, NULL, pool_size,
+                                      FRAME_POOL_MIN_BUFFERS, 0);
+    gst_buffer_pool_set_config(pthis->pool, config);
+    // allocates (and pre-faults) the minimum right away
+    gst_buffer_pool_set_active(pthis->pool, TRUE);
+    pthis->pool_size = pool_size;
+    g_print("screencastsrc: frame pool of %lu byte buffers\n", pool_size);
+  }
+  GstBuffer* buf = NULL;
+  if (GST_FLOW_OK !=
+      gst_buffer_pool_acquire_buffer(pthis->pool, &buf, NULL))
+  {
+    return gst_buffer_new_allocate(NULL, size, NULL);
+  }
+  return buf;
+}
+
+/* Returns nonzero if the frame is byte-for-byte the last one pushed (by
+ * hash and length) and the last push was recent. Hashing the payload as it
+ * arrived means a duplicate costs neither base64 nor JPEG decode; videorate
+ * repeats the previous decoded frame in its place. Call with push_lock held.
+ */
+static char is_duplicate_frame(struct screencast_src_s* pthis,
+                               const struct pending_frame_s* frame)
+{
+  uint64_t hash = frame_hash(frame->data, frame->length);
+  char duplicate = pthis->have_last_frame && hash == pthis->last_hash &&
+  frame->length == pthis->last_length &&
+  frame->timestamp >= pthis->last_timestamp &&
+  frame->timestamp - pthis->last_timestamp < DUPLICATE_REFRESH_MS;
+  if (!duplicate) {
+    pthis->have_last_frame = 1;
+    pthis->last_hash = hash;
+    pthis->last_length = frame->length;
+    pthis->last_timestamp = frame->timestamp;
+  }
+  return duplicate;
+}
+
+// Decode (if needed), timestamp and push. Consumes the frame.
+static void push_frame(struct screencast_src_s* pthis,
+                       struct pending_frame_s* frame)
+{
+  if (!screencast_src_sync_clock(pthis)) {
+    release_frame(frame);
+    return;
+  }
+
+  if (frame->is_raw != pthis->raw_ingest) {
+    g_print("screencastsrc: skip frame: %s frame, but ingest is %s\n",
+            frame->is_raw ? "raw" : "jpeg", pthis->raw_ingest ? "raw" : "jpeg");
+    release_frame(frame);
+    return;
+  }
+
+  if (pthis->skip_duplicates && !frame->is_canvas &&
+      is_duplicate_frame(pthis, frame))
+  {
+    __atomic_add_fetch(&pthis->stats.frames_duplicate, 1, __ATOMIC_RELAXED);
+    release_frame(frame);
+    return;
+  }
+
+  GstBuffer* buf = NULL;
+  if (frame->is_canvas) {
+    update_raw_caps(pthis, &frame->raw, frame->length);
+    // the snapshot is ours alone, so its metadata can be stamped in place
+    buf = (GstBuffer*)frame->free_data;
+    frame->free_func = NULL;
+    frame->free_data = NULL;
+  } else if (frame->is_raw) {
+    guint n_planes = 0;
+    gsize offsets[GST_VIDEO_MAX_PLANES] = { 0 };
+    gint strides[GST_VIDEO_MAX_PLANES] = { 0 };
+    if (raw_frame_layout(&frame->raw, frame->length, &n_planes,
+                         offsets, strides))
+    {
+      g_print("screencastsrc: skip frame: bad raw layout %ux%u\n",
+              frame->raw.width, frame->raw.height);
+      release_frame(frame);
+      return;
+    }
+    update_raw_caps(pthis, &frame->raw, frame->length);
+    buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+                                      (gpointer)frame->data, frame->length,
+                                      0, frame->length,
+                                      frame->free_data, frame->free_func);
+    // strides may be padded, so describe the planes rather than assume
+    gst_buffer_add_video_meta_full(buf, GST_VIDEO_FRAME_FLAG_NONE,
+                                   raw_video_format(frame->raw.format),
+                                   frame->raw.width, frame->raw.height,
+                                   n_planes, offsets, strides);
+    frame->marks.decoded_ns = frame->marks.parsed_ns;
+  } else if (frame->is_base64) {
+    // base64 decode straight into the buffer we're about to push
+    buf = acquire_frame_buffer(pthis, base64_decode_bound(frame->length));
+    GstMapInfo map;
+    if (!buf || !gst_buffer_map(buf, &map, GST_MAP_WRITE)) {
+      g_print("screencastsrc: skip frame: no buffer to decode into\n");
+      if (buf) {
+        gst_buffer_unref(buf);
+      }
+      release_frame(frame);
+      return;
+    }
+    struct base64_decoder_s decoder;
+    size_t b_length = 0;
+    base64_decoder_init(&decoder);
+    int ret = base64_decoder_update(&decoder, frame->data, frame->length,
+                                    map.data, &b_length);
+    ret |= base64_decoder_finish(&decoder);
+    gst_buffer_unmap(buf, &map);
+    release_frame(frame);
+    if (ret) {
+      g_print("screencastsrc: skip frame: bad base64 payload\n");
+      gst_buffer_unref(buf);
+      return;
+    }
+    gst_buffer_set_size(buf, b_length);
+    frame->marks.decoded_ns = latency_now_ns();
+  } else {
+    frame->marks.decoded_ns = frame->marks.parsed_ns;
+    // wrap the caller's memory rather than copying it into a new allocation
+    buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+                                      (gpointer)frame->data, frame->length,
+                                      0, frame->length,
+                                      frame->free_data, frame->free_func);
+  }
+
+  // input timestamp is in millis; convert before adjusting to GstClock
+  GstClockTime ts = frame->timestamp * GST_MSECOND;
+  ts = gst_wall_clock_adjust_safe(pthis->wall_clock, ts);
   buf->dts = ts;
   buf->pts = ts;
   g_print("screencastsrc: push pts %ld\n", buf->pts);
+  if (pthis->latency) {
+    latency_tracker_frame_pushed(pthis->latency, ts, &frame->marks);
+  }
 
   // gst_app_src_push_buffer
   gst_app_src_push_buffer(pthis->element, buf);
+  __atomic_add_fetch(&pthis->stats.frames_pushed, 1, __ATOMIC_RELAXED);
+}
+
+// Push the pending frame if appsrc is ready for it (coalesce mode), or
+// regardless when force is set. Call with push_lock held.
+static void push_pending_frame_locked(struct screencast_src_s* pthis,
+                                      char force)
+{
+  uv_mutex_lock(&pthis->lock);
+  struct pending_frame_s frame = pthis->pending;
+  char ready = (force || pthis->allow_data) && frame.free_func;
+  if (ready) {
+    memset(&pthis->pending, 0, sizeof(pthis->pending));
+  }
+  uv_mutex_unlock(&pthis->lock);
+  if (ready) {
+    push_frame(pthis, &frame);
+  }
+}
+
+static void push_pending_frame(struct screencast_src_s* pthis) {
+  uv_mutex_lock(&pthis->push_lock);
+  push_pending_frame_locked(pthis, 0);
+  uv_mutex_unlock(&pthis->push_lock);
+}
+
+static void submit_frame(struct screencast_src_s* pthis,
+                         struct pending_frame_s* frame)
+{
+  if (pthis->coalesce_frames) {
+    // latest frame wins: replace whatever is still waiting for appsrc
+    uv_mutex_lock(&pthis->lock);
+    if (pthis->pending.free_func) {
+      release_frame(&pthis->pending);
+      __atomic_add_fetch(&pthis->stats.frames_coalesced, 1,
+                         __ATOMIC_RELAXED);
+    }
+    pthis->pending = *frame;
+    uv_mutex_unlock(&pthis->lock);
+    push_pending_frame(pthis);
+    return;
+  }
+
+  uv_mutex_lock(&pthis->lock);
+  char allow_frame = pthis->allow_data;
+  uv_mutex_unlock(&pthis->lock);
+  if (!allow_frame) {
+    g_print("screencastsrc: skipping incoming frame (not ready)\n");
+    __atomic_add_fetch(&pthis->stats.frames_skipped, 1, __ATOMIC_RELAXED);
+    release_frame(frame);
+    return;
+  }
+  uv_mutex_lock(&pthis->push_lock);
+  push_frame(pthis, frame);
+  uv_mutex_unlock(&pthis->push_lock);
+}
+
+void screencast_src_push_frame(struct screencast_src_s* pthis,
+                               uint64_t timestamp, const char* frame_base64,
+                               size_t length,
+                               const struct latency_marks_s* marks,
+                               GDestroyNotify free_func, gpointer free_data)
+{
+  struct pending_frame_s frame = { 0 };
+  frame.timestamp = timestamp;
+  frame.data = (const uint8_t*)frame_base64;
+  frame.length = length;
+  frame.is_base64 = 1;
+  if (marks) {
+    frame.marks = *marks;
+  }
+  frame.free_func = free_func;
+  frame.free_data = free_data;
+  submit_frame(pthis, &frame);
+}
+
+void screencast_src_push_image(struct screencast_src_s* pthis,
+                               uint64_t timestamp,
+                               const uint8_t* data, size_t length,
+                               const struct latency_marks_s* marks,
+                               GDestroyNotify free_func, gpointer free_data)
+{
+  struct pending_frame_s frame = { 0 };
+  frame.timestamp = timestamp;
+  frame.data = data;
+  frame.length = length;
+  if (marks) {
+    frame.marks = *marks;
+  }
+  frame.free_func = free_func;
+  frame.free_data = free_data;
+  submit_frame(pthis, &frame);
+}
+
+void screencast_src_push_raw(struct screencast_src_s* pthis,
+                             uint64_t timestamp,
+                             const struct screencast_raw_frame_s* raw,
+                             const uint8_t* data, size_t length,
+                             const struct latency_marks_s* marks,
+                             GDestroyNotify free_func, gpointer free_data)
+{
+  struct pending_frame_s frame = { 0 };
+  frame.timestamp = timestamp;
+  frame.data = data;
+  frame.length = length;
+  frame.is_raw = 1;
+  frame.raw = *raw;
+  if (marks) {
+    frame.marks = *marks;
+  }
+  frame.free_func = free_func;
+  frame.free_data = free_data;
+  submit_frame(pthis, &frame);
+}
+
+#pragma mark - Tiles
+
+/* Make pthis->canvas safe to draw on. A snapshot still held downstream (or
+ * waiting to be pushed) shares its memory, in which case we draw on a copy
+ * instead. Returns nonzero, with no canvas left, if allocation fails. Call
+ * with push_lock held.
+ */
+static int prepare_canvas(struct screencast_src_s* pthis,
+                          uint32_t width, uint32_t height)
+{
+  if (pthis->canvas && width == pthis->canvas_width &&
+      height == pthis->canvas_height)
+  {
+    if (!gst_buffer_is_all_memory_writable(pthis->canvas)) {
+      GstBuffer* copy = gst_buffer_copy_deep(pthis->canvas);
+      gst_buffer_unref(pthis->canvas);
+      pthis->canvas = copy;
+    }
+    return pthis->canvas ? 0 : -1;
+  }
+  g_print("screencastsrc: new tile canvas %ux%u\n", width, height);
+  if (pthis->canvas) {
+    gst_buffer_unref(pthis->canvas);
+  }
+  size_t pixels = (size_t)width * height;
+  pthis->canvas = gst_buffer_new_allocate(NULL, pixels * 4, NULL);
+  GstMapInfo map;
+  if (!pthis->canvas || !gst_buffer_map(pthis->canvas, &map, GST_MAP_WRITE)) {
+    if (pthis->canvas) {
+      gst_buffer_unref(pthis->canvas);
+      pthis->canvas = NULL;
+    }
+    return -1;
+  }
+  // opaque black
+  uint32_t* pixel = (uint32_t*)map.data;
+  for (size_t i = 0; i < pixels; i++) {
+    pixel[i] = GUINT32_TO_LE(0xff000000);
+  }
+  gst_buffer_unmap(pthis->canvas, &map);
+  pthis->canvas_width = width;
+  pthis->canvas_height = height;
+  return 0;
+}
+
+// Draw one tile onto the mapped canvas. Returns nonzero if it doesn't fit
+// or doesn't decode.
+static int composite_tile(struct screencast_src_s* pthis, uint8_t* canvas,
+                          const struct screencast_tile_s* tile)
+{
+  if (!tile->width || !tile->height ||
+      tile->x >= pthis->canvas_width || tile->y >= pthis->canvas_height ||
+      tile->width > pthis->canvas_width - tile->x ||
+      tile->height > pthis->canvas_height - tile->y)
+  {
+    return -1;
+  }
+  size_t stride = (size_t)pthis->canvas_width * 4;
+  size_t row_bytes = (size_t)tile->width * 4;
+  uint8_t* dst = canvas + tile->y * stride + tile->x * 4;
+  switch (tile->format) {
+    case screencast_tile_format_bgra:
+      if (tile->length < row_bytes * tile->height) {
+        return -1;
+      }
+      for (uint32_t row = 0; row < tile->height; row++) {
+        memcpy(dst + row * stride, tile->data + row * row_bytes, row_bytes);
+      }
+      return 0;
+    case screencast_tile_format_jpeg: {
+      if (!pthis->tj && !(pthis->tj = tjInitDecompress())) {
+        return -1;
+      }
+      int width = 0, height = 0, subsamp = 0, colorspace = 0;
+      if (tjDecompressHeader3(pthis->tj, tile->data, tile->length,
+                              &width, &height, &subsamp, &colorspace) ||
+          (uint32_t)width != tile->width || (uint32_t)height != tile->height)
+      {
+        return -1;
+      }
+      // decode in place: the canvas row pitch skips over untouched pixels
+      return tjDecompress2(pthis->tj, tile->data, tile->length, dst,
+                           width, (int)stride, height, TJPF_BGRA, 0);
+    }
+  }
+  return -1;
+}
+
+void screencast_src_push_tiles(struct screencast_src_s* pthis,
+                               uint64_t timestamp,
+                               uint32_t canvas_width, uint32_t canvas_height,
+                               const struct screencast_tile_s* tiles,
+                               size_t count,
+                               const struct latency_marks_s* marks)
+{
+  if (!pthis->raw_ingest) {
+    g_print("screencastsrc: skip frame: tiles, but ingest is jpeg\n");
+    return;
+  }
+  if (!canvas_width || !canvas_height) {
+    g_print("screencastsrc: skip frame: empty tile canvas\n");
+    return;
+  }
+  if (canvas_width > TILE_CANVAS_MAX_DIMENSION ||
+      canvas_height > TILE_CANVAS_MAX_DIMENSION)
+  {
+    g_print("screencastsrc: skip frame: tile canvas %ux%u too large\n",
+            canvas_width, canvas_height);
+    __atomic_add_fetch(&pthis->stats.tiles_failed, count, __ATOMIC_RELAXED);
+    return;
+  }
+  uv_mutex_lock(&pthis->push_lock);
+  GstMapInfo map;
+  if (prepare_canvas(pthis, canvas_width, canvas_height) ||
+      !gst_buffer_map(pthis->canvas, &map, GST_MAP_WRITE))
+  {
+    uv_mutex_unlock(&pthis->push_lock);
+    g_print("screencastsrc: skip frame: no %ux%u tile canvas\n",
+            canvas_width, canvas_height);
+    __atomic_add_fetch(&pthis->stats.tiles_failed, count, __ATOMIC_RELAXED);
+    return;
+  }
+  uint64_t applied = 0, failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (composite_tile(pthis, map.data, &tiles[i])) {
+      failed++;
+    } else {
+      applied++;
+    }
+  }
+  gst_buffer_unmap(pthis->canvas, &map);
+  // shares the canvas memory; the next update copies before drawing
+  GstBuffer* snapshot = applied ? gst_buffer_copy(pthis->canvas) : NULL;
+  uv_mutex_unlock(&pthis->push_lock);
+
+  __atomic_add_fetch(&pthis->stats.tiles_applied, applied, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pthis->stats.tiles_failed, failed, __ATOMIC_RELAXED);
+  if (failed) {
+    g_print("screencastsrc: dropped %lu malformed tiles\n", failed);
+  }
+  if (!snapshot) {
+    // nothing changed, nothing to push
+    return;
+  }
+
+  struct pending_frame_s frame = { 0 };
+  frame.timestamp = timestamp;
+  frame.is_raw = 1;
+  frame.is_canvas = 1;
+  frame.raw.format = screencast_raw_format_bgra;
+  frame.raw.width = canvas_width;
+  frame.raw.height = canvas_height;
+  frame.raw.strides[0] = canvas_width * 4;
+  frame.length = gst_buffer_get_size(snapshot);
+  if (marks) {
+    frame.marks = *marks;
+  }
+  frame.marks.decoded_ns = latency_now_ns();
+  frame.free_func = (GDestroyNotify)gst_buffer_unref;
+  frame.free_data = snapshot;
+  submit_frame(pthis, &frame);
+}
+
+#pragma mark -
+
+void screencast_src_get_stats(struct screencast_src_s* pthis,
+                              struct screencast_src_stats_s* stats)
+{
+  stats->frames_pushed =
+  __atomic_load_n(&pthis->stats.frames_pushed, __ATOMIC_RELAXED);
+  stats->frames_skipped =
+  __atomic_load_n(&pthis->stats.frames_skipped, __ATOMIC_RELAXED);
+  stats->frames_coalesced =
+  __atomic_load_n(&pthis->stats.frames_coalesced, __ATOMIC_RELAXED);
+  stats->frames_duplicate =
+  __atomic_load_n(&pthis->stats.frames_duplicate, __ATOMIC_RELAXED);
+  stats->tiles_applied =
+  __atomic_load_n(&pthis->stats.tiles_applied, __ATOMIC_RELAXED);
+  stats->tiles_failed =
+  __atomic_load_n(&pthis->stats.tiles_failed, __ATOMIC_RELAXED);
+  stats->clock_drift_ppm = gst_wall_clock_get_drift_ppm(pthis->wall_clock);
 }
 
 void screencast_src_send_eos(struct screencast_src_s* pthis) {
   g_print("screencastsrc: received EOS\n");
+  uv_mutex_lock(&pthis->push_lock);
+  // the newest frame may still be waiting on a full appsrc; it's the last
+  // one of the stream, so queue it past the limit rather than lose it
+  push_pending_frame_locked(pthis, 1);
   gst_app_src_end_of_stream(pthis->element);
+  uv_mutex_unlock(&pthis->push_lock);
 }
 
 GstElement* screencast_src_get_element(struct screencast_src_s* pthis) {
@@ -123,6 +786,9 @@ static void app_src_enough_data(GstAppSrc *src, gpointer p) {
   uv_mutex_lock(&pthis->lock);
   pthis->allow_data = 0;
   uv_mutex_unlock(&pthis->lock);
+  if (pthis->on_ready_changed) {
+    pthis->on_ready_changed(pthis, 0, pthis->callback_p);
+  }
 }
 
 static void app_src_need_data(GstAppSrc *src, guint length, gpointer p) {
@@ -131,6 +797,12 @@ static void app_src_need_data(GstAppSrc *src, guint length, gpointer p) {
   uv_mutex_lock(&pthis->lock);
   pthis->allow_data = 1;
   uv_mutex_unlock(&pthis->lock);
+  if (pthis->on_ready_changed) {
+    pthis->on_ready_changed(pthis, 1, pthis->callback_p);
+  }
+  if (pthis->coalesce_frames) {
+    push_pending_frame(pthis);
+  }
 }
 
 static void app_src_seek_data(GstAppSrc *src, guint64 offset, gpointer p) {
@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <gst/gst.h>
+#include "latency.h"
 
 /*
  * Implements the same source element as GstHorsemanSrc, but as an appsrc
@@ -18,11 +19,119 @@
 
 struct screencast_src_s;
 
+enum screencast_raw_format {
+  screencast_raw_format_i420 = 0,
+  screencast_raw_format_nv12,
+  screencast_raw_format_bgra
+};
+
+// Layout of a raw frame: planes back to back, each strides[i] * rows bytes
+struct screencast_raw_frame_s {
+  enum screencast_raw_format format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t strides[3];
+};
+
+enum screencast_tile_format {
+  screencast_tile_format_jpeg = 0,
+  // packed, 4 * width bytes per row
+  screencast_tile_format_bgra
+};
+
+// One updated rectangle of the canvas
+struct screencast_tile_s {
+  enum screencast_tile_format format;
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+  const uint8_t* data;
+  size_t length;
+};
+
+struct screencast_src_config_s {
+  // appsrc queue filled up (ready = 0) or drained (ready = 1)
+  void (*on_ready_changed)(struct screencast_src_s* screencast_src,
+                           char ready, void* p);
+  void* p;
+  /* Latest frame wins: while appsrc has enough data, hold on to the newest
+   * frame (undecoded) and drop older ones, instead of skipping new frames.
+   */
+  char coalesce_frames;
+  /* Don't push frames identical to the previous one; downstream repeats the
+   * last decoded frame instead. One still goes through now and then so
+   * timestamps keep advancing on a static screen.
+   */
+  char skip_duplicates;
+  // optional; frames are registered here as they enter appsrc
+  struct latency_tracker_s* latency;
+  /* Produce video/x-raw (screencast_src_push_raw) instead of image/jpeg.
+   * Caps follow the format and size of the incoming frames.
+   */
+  char raw_ingest;
+};
+
+struct screencast_src_stats_s {
+  uint64_t frames_pushed;
+  // dropped because appsrc had enough data
+  uint64_t frames_skipped;
+  // replaced by a newer frame before being pushed (coalesce_frames)
+  uint64_t frames_coalesced;
+  // identical to the previous frame, not pushed (skip_duplicates)
+  uint64_t frames_duplicate;
+  // tiles composited onto the canvas, and tiles rejected as malformed
+  uint64_t tiles_applied;
+  uint64_t tiles_failed;
+  // frame timestamp clock rate against the pipeline clock, from 1:1
+  double clock_drift_ppm;
+};
+
 void screencast_src_alloc(struct screencast_src_s** screencast_src_out);
 void screencast_src_free(struct screencast_src_s* screencast_src);
+void screencast_src_config(struct screencast_src_s* screencast_src,
+                           struct screencast_src_config_s* config);
 
+/* Push functions take ownership of the payload: free_func(free_data) runs
+ * once it is no longer needed, including when the frame is skipped.
+ * Timestamps are in millis. marks (optional) carries the frame's receive and
+ * parse times for the latency tracker.
+ */
 void screencast_src_push_frame(struct screencast_src_s* screencast_src,
-                               uint64_t timestamp, const char* frame_base64);
+                               uint64_t timestamp, const char* frame_base64,
+                               size_t length,
+                               const struct latency_marks_s* marks,
+                               GDestroyNotify free_func, gpointer free_data);
+/* Push an already-decoded image (raw JPEG bytes). The buffer wraps data
+ * without copying.
+ */
+void screencast_src_push_image(struct screencast_src_s* screencast_src,
+                               uint64_t timestamp,
+                               const uint8_t* data, size_t length,
+                               const struct latency_marks_s* marks,
+                               GDestroyNotify free_func, gpointer free_data);
+/* Push raw pixels, wrapped without copying. Only accepted with raw_ingest;
+ * frames whose strides or length don't fit the layout are skipped.
+ */
+void screencast_src_push_raw(struct screencast_src_s* screencast_src,
+                             uint64_t timestamp,
+                             const struct screencast_raw_frame_s* raw,
+                             const uint8_t* data, size_t length,
+                             const struct latency_marks_s* marks,
+                             GDestroyNotify free_func, gpointer free_data);
+/* Composite tiles onto a persistent BGRA canvas (black until painted) and
+ * push the canvas if any tile landed. Tiles are decoded straight into the
+ * canvas, so the caller keeps ownership of their data. Only accepted with
+ * raw_ingest; a change of canvas size starts over from black.
+ */
+void screencast_src_push_tiles(struct screencast_src_s* screencast_src,
+                               uint64_t timestamp,
+                               uint32_t canvas_width, uint32_t canvas_height,
+                               const struct screencast_tile_s* tiles,
+                               size_t count,
+                               const struct latency_marks_s* marks);
+void screencast_src_get_stats(struct screencast_src_s* screencast_src,
+                              struct screencast_src_stats_s* stats);
 void screencast_src_send_eos(struct screencast_src_s* screencast_src);
 GstElement* screencast_src_get_element(struct screencast_src_s* screencast_src);
 
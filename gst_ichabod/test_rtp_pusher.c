@@ -238,7 +238,7 @@ int main(int argc, char** argv)
 //  GstPad* video_src = rtp_relay_video_src(rtp_recv, video_caps);
 
 
-  struct webrtc_control_config_s webrtc_config;
+  struct webrtc_control_config_s webrtc_config = { 0 };
   webrtc_config.on_create_offer = on_create_offer;
   webrtc_config.on_remote_answer = on_remote_answer;
   webrtc_config.on_remote_candidate = on_remote_candidate;
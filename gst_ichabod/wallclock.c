@@ -7,6 +7,7 @@
 
 #include "wallclock.h"
 #include <time.h>
+#include <math.h>
 
 GST_DEBUG_CATEGORY_STATIC (gst_wall_clock_debug_category);
 #define GST_CAT_DEFAULT gst_wall_clock_debug_category
@@ -20,9 +21,38 @@ GST_DEBUG_CATEGORY_STATIC (gst_wall_clock_debug_category);
 typedef struct _GstWallClock GstWallClock;
 typedef struct _GstWallClockClass GstWallClockClass;
 
+/* Observations kept for the regression. At 30 fps this spans ~17 s, long
+ * enough that per-sample jitter barely moves the slope.
+ */
+#define WALL_CLOCK_WINDOW 512
+// Slopes further than this from 1:1 are treated as a clock step, not drift
+#define WALL_CLOCK_MAX_DRIFT_PPM 1000.0
+// Fixed-point denominator for the published rate
+#define WALL_CLOCK_RATE_DENOM (G_GUINT64_CONSTANT(1) << 30)
+
+struct wall_calibration_s {
+  GstClockTime internal;
+  GstClockTime external;
+  GstClockTime num;
+  GstClockTime denom;
+};
+
 struct _GstWallClock
 {
   GstSystemClock parent;
+
+  /* observation window, guarded by lock */
+  GMutex lock;
+  GstClockTime internal[WALL_CLOCK_WINDOW];
+  GstClockTime external[WALL_CLOCK_WINDOW];
+  guint count;
+  guint next;
+
+  /* latest fit, published under a sequence lock: odd while a write is in
+   * progress. Readers retry instead of taking the mutex.
+   */
+  guint seq;
+  struct wall_calibration_s calibration;
 };
 
 struct _GstWallClockClass
@@ -69,10 +99,13 @@ static void gst_wall_clock_init(GstWallClock* clock)
 {
   GST_OBJECT_FLAG_SET(clock, GST_CLOCK_FLAG_CAN_SET_MASTER);
   //GST_OBJECT_FLAG_SET(clock, GST_CLOCK_FLAG_NEEDS_STARTUP_SYNC);
+  g_mutex_init(&clock->lock);
 }
 
 static void gst_wall_clock_finalize (GObject * object)
 {
+  GstWallClock* clock = GST_WALL_CLOCK(object);
+  g_mutex_clear(&clock->lock);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -97,14 +130,124 @@ static guint64 gst_wall_clock_get_resolution(GstClock* clock)
   return GST_TIMESPEC_TO_TIME(ts);
 }
 
+// Copy out the published fit. Returns FALSE if nothing is published yet.
+static gboolean read_calibration(GstWallClock* clock,
+                                 struct wall_calibration_s* out)
+{
+  guint seq;
+  do {
+    seq = __atomic_load_n(&clock->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      continue;
+    }
+    out->internal =
+    __atomic_load_n(&clock->calibration.internal, __ATOMIC_RELAXED);
+    out->external =
+    __atomic_load_n(&clock->calibration.external, __ATOMIC_RELAXED);
+    out->num = __atomic_load_n(&clock->calibration.num, __ATOMIC_RELAXED);
+    out->denom = __atomic_load_n(&clock->calibration.denom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&clock->seq, __ATOMIC_RELAXED));
+  return out->denom != 0;
+}
+
+// call with lock held
+static void publish_calibration(GstWallClock* clock,
+                                const struct wall_calibration_s* c)
+{
+  __atomic_store_n(&clock->seq, clock->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&clock->calibration.internal, c->internal,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&clock->calibration.external, c->external,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&clock->calibration.num, c->num, __ATOMIC_RELAXED);
+  __atomic_store_n(&clock->calibration.denom, c->denom, __ATOMIC_RELAXED);
+  __atomic_store_n(&clock->seq, clock->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Least squares fit of external over internal, centered on the window
+ * means so nanosecond epoch values keep their precision in doubles.
+ * Call with lock held.
+ */
+static void fit_calibration(GstWallClock* clock,
+                            struct wall_calibration_s* c)
+{
+  guint n = clock->count;
+  GstClockTime base_internal = clock->internal[0];
+  GstClockTime base_external = clock->external[0];
+  double mean_x = 0, mean_y = 0;
+  for (guint i = 0; i < n; i++) {
+    mean_x += (double)GST_CLOCK_DIFF(base_internal, clock->internal[i]);
+    mean_y += (double)GST_CLOCK_DIFF(base_external, clock->external[i]);
+  }
+  mean_x /= n;
+  mean_y /= n;
+  double sxx = 0, sxy = 0;
+  for (guint i = 0; i < n; i++) {
+    double dx =
+    (double)GST_CLOCK_DIFF(base_internal, clock->internal[i]) - mean_x;
+    double dy =
+    (double)GST_CLOCK_DIFF(base_external, clock->external[i]) - mean_y;
+    sxx += dx * dx;
+    sxy += dx * dy;
+  }
+  double slope = sxx > 0 ? sxy / sxx : 1.0;
+  if (fabs(slope - 1.0) * 1e6 > WALL_CLOCK_MAX_DRIFT_PPM) {
+    slope = 1.0;
+  }
+  c->internal = base_internal + (GstClockTimeDiff)mean_x;
+  c->external = base_external + (GstClockTimeDiff)mean_y;
+  c->num = (GstClockTime)(slope * WALL_CLOCK_RATE_DENOM + 0.5);
+  c->denom = WALL_CLOCK_RATE_DENOM;
+}
+
+void gst_wall_clock_observe(GstClock* clock, GstClockTime internal,
+                            GstClockTime external)
+{
+  GstWallClock* wall_clock = GST_WALL_CLOCK(clock);
+  g_mutex_lock(&wall_clock->lock);
+  if (wall_clock->count < WALL_CLOCK_WINDOW) {
+    wall_clock->count++;
+  }
+  wall_clock->internal[wall_clock->next] = internal;
+  wall_clock->external[wall_clock->next] = external;
+  wall_clock->next = (wall_clock->next + 1) % WALL_CLOCK_WINDOW;
+  struct wall_calibration_s c;
+  fit_calibration(wall_clock, &c);
+  publish_calibration(wall_clock, &c);
+  g_mutex_unlock(&wall_clock->lock);
+}
+
+void gst_wall_clock_reset(GstClock* clock)
+{
+  GstWallClock* wall_clock = GST_WALL_CLOCK(clock);
+  g_mutex_lock(&wall_clock->lock);
+  wall_clock->count = 0;
+  wall_clock->next = 0;
+  g_mutex_unlock(&wall_clock->lock);
+}
+
+double gst_wall_clock_get_drift_ppm(GstClock* clock)
+{
+  struct wall_calibration_s c;
+  if (!read_calibration(GST_WALL_CLOCK(clock), &c)) {
+    return 0;
+  }
+  return ((double)c.num / c.denom - 1.0) * 1e6;
+}
+
 GstClockTime gst_wall_clock_adjust_safe
 (GstClock* clock, GstClockTime internal)
 {
-  GstClockTime ret, cinternal, cexternal, cnum, cdenom;
-  gst_clock_get_calibration(clock, &cinternal, &cexternal, &cnum, &cdenom);
-  ret = gst_clock_adjust_with_calibration
-  (clock, internal, cinternal, cexternal, cnum, cdenom);
-  return ret;
+  struct wall_calibration_s c;
+  if (!read_calibration(GST_WALL_CLOCK(clock), &c)) {
+    // nothing observed yet: fall back to whatever GstClock was told
+    gst_clock_get_calibration(clock, &c.internal, &c.external,
+                              &c.num, &c.denom);
+  }
+  return gst_clock_adjust_with_calibration
+  (clock, internal, c.internal, c.external, c.num, c.denom);
 }
 
 GstClock* gst_wall_clock_new()
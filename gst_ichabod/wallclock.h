@@ -31,5 +31,18 @@ GstClock* gst_wall_clock_new();
 GstClockTime gst_wall_clock_adjust_safe(GstClock* clock,
                                         GstClockTime old_internal);
 
+/* Add an (internal, external) pair sampled back to back, and refit the
+ * calibration over a sliding window by linear regression. Writers are
+ * serialized; gst_wall_clock_adjust_safe reads the fit without locking.
+ */
+void gst_wall_clock_observe(GstClock* clock, GstClockTime internal,
+                            GstClockTime external);
+
+// Forget past observations, e.g. when the reference clock changes
+void gst_wall_clock_reset(GstClock* clock);
+
+// Rate of the current fit relative to 1:1, in parts per million
+double gst_wall_clock_get_drift_ppm(GstClock* clock);
+
 G_END_DECLS
 #endif /* wallclock_h */
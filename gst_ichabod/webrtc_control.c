@@ -13,16 +13,26 @@
 #include <uv.h>
 
 #include "webrtc_control.h"
+#include "ipc_endpoint.h"
+
+#define DEFAULT_PULL_ENDPOINT "ipc:///tmp/webrtc_control-right"
+#define DEFAULT_PUSH_ENDPOINT "ipc:///tmp/webrtc_control-left"
+#define SESSION_PULL_ENDPOINT "ipc:///tmp/webrtc_control-right-{session}"
+#define SESSION_PUSH_ENDPOINT "ipc:///tmp/webrtc_control-left-{session}"
 
 struct webrtc_control_s {
   void* zmq_ctx;
   void* push_socket;
   void* pull_socket;
+  char* pull_endpoint;
+  char* push_endpoint;
   char is_interrupted;
   char is_running;
   uv_thread_t zmq_thread;
-  uv_thread_t cb_thread;
+  // zmq thread runloop: wakes on pull socket readiness or a stop request
   uv_loop_t* cb_loop;
+  uv_poll_t pull_poll;
+  uv_async_t stop_async;
 
   void (*create_offer_cb)(struct webrtc_control_s* webrtc_control, void* p);
   void (*remote_answer_cb)(struct webrtc_control_s* webrtc_control,
@@ -57,17 +67,6 @@ static void clear_msg(struct ctrl_msg_s* msg) {
   }
 }
 
-static void cb_loop_main(void* p) {
-  struct webrtc_control_s* pthis = (struct webrtc_control_s*)p;
-  int ret = 0;
-  while (pthis->is_running && 0 == ret) {
-    ret = uv_run(pthis->cb_loop, UV_RUN_DEFAULT);
-    // todo: why is this not running on a poll?
-    usleep(1000);
-  }
-  printf("webrtc_control: exiting cb loop\n");
-}
-
 #define MSG_TYPE_CREATE_OFFER "create_offer"
 #define MSG_TYPE_SET_REMOTE_DESCRIPTION "set_remote_description"
 #define MSG_TYPE_ADD_CANDIDATE "add_ice_candidate"
@@ -95,8 +94,8 @@ static int recv_msg(struct webrtc_control_s* pthis, struct ctrl_msg_s* msg,
   while (1) {
     zmq_msg_t message;
     ret = zmq_msg_init (&message);
-    ret = zmq_msg_recv (&message, pthis->pull_socket, 0);
-    if (ret < 0 && EAGAIN == errno) {
+    ret = zmq_msg_recv (&message, pthis->pull_socket, ZMQ_DONTWAIT);
+    if (ret < 0) {
       *got_msg = 0;
       zmq_msg_close(&message);
       return 0;
@@ -126,37 +125,51 @@ static int recv_msg(struct webrtc_control_s* pthis, struct ctrl_msg_s* msg,
   return 0;
 }
 
+// ZMQ_FD is edge triggered: drain everything that's queued on each wakeup.
+static void on_pull_socket_ready(uv_poll_t* handle, int status, int events) {
+  struct webrtc_control_s* pthis = (struct webrtc_control_s*)handle->data;
+  char got_msg = 0;
+  struct ctrl_msg_s msg = { 0 };
+  do {
+    recv_msg(pthis, &msg, &got_msg);
+    if (got_msg) {
+      handle_msg(pthis, &msg);
+    }
+    clear_msg(&msg);
+  } while (got_msg && !pthis->is_interrupted);
+}
+
+static void on_stop_async(uv_async_t* handle) {
+  struct webrtc_control_s* pthis = (struct webrtc_control_s*)handle->data;
+  uv_close((uv_handle_t*)&pthis->pull_poll, NULL);
+  uv_close((uv_handle_t*)handle, NULL);
+}
+
 #define ONLINE_MSG "online"
 static void zmq_main(void* p) {
   printf("webrtc_control online %p\n", p);
   struct webrtc_control_s* pthis = (struct webrtc_control_s*)p;
-  // messaging runloop
-  int t = 10;
-  int ret = zmq_bind(pthis->pull_socket, "ipc:///tmp/webrtc_control-right");
+  int ret = zmq_bind(pthis->pull_socket, pthis->pull_endpoint);
   if (ret) {
-    printf("webrtc_control: failed to connect to pull socket errno %d\n",
-           errno);
-    return;
+    printf("webrtc_control: failed to bind pull socket %s errno %d\n",
+           pthis->pull_endpoint, errno);
+    // keep running the loop anyway, so webrtc_control_stop can tear down
+  } else {
+    uv_poll_start(&pthis->pull_poll, UV_READABLE, on_pull_socket_ready);
   }
-  ret = zmq_connect(pthis->push_socket, "ipc:///tmp/webrtc_control-left");
+  ret = zmq_connect(pthis->push_socket, pthis->push_endpoint);
   if (ret) {
-    printf("webrtc_control: failed to connect to push socket errno %d\n",
-           errno);
+    printf("webrtc_control: failed to connect to push socket %s errno %d\n",
+           pthis->push_endpoint, errno);
     // this isn't fatal for the runloop, but will probably cause problems.
     // how should we handle it?
   }
   size_t len = strlen(ONLINE_MSG);
   ret = zmq_send(pthis->push_socket, ONLINE_MSG, len, 0);
-  ret = zmq_setsockopt(pthis->pull_socket, ZMQ_RCVTIMEO, &t, sizeof(int));
-  char got_msg = 0;
-  struct ctrl_msg_s msg = { 0 };
-  while (!pthis->is_interrupted) {
-    ret = recv_msg(pthis, &msg, &got_msg);
-    if (got_msg) {
-      handle_msg(pthis, &msg);
-      clear_msg(&msg);
-    }
-  }
+  // catch anything that arrived before the poll was armed
+  on_pull_socket_ready(&pthis->pull_poll, 0, UV_READABLE);
+  // messaging runloop. runs until webrtc_control_stop closes our handles
+  uv_run(pthis->cb_loop, UV_RUN_DEFAULT);
   zmq_close(pthis->pull_socket);
 }
 
@@ -167,11 +180,15 @@ void webrtc_control_alloc(struct webrtc_control_s** pthis_out) {
   pthis->zmq_ctx = zmq_ctx_new();
   pthis->push_socket = zmq_socket(pthis->zmq_ctx, ZMQ_PUSH);
   pthis->pull_socket = zmq_socket(pthis->zmq_ctx, ZMQ_PULL);
+  pthis->pull_endpoint = strdup(DEFAULT_PULL_ENDPOINT);
+  pthis->push_endpoint = strdup(DEFAULT_PUSH_ENDPOINT);
 
   *pthis_out = pthis;
 }
 
 void webrtc_control_free(struct webrtc_control_s* pthis) {
+  free(pthis->pull_endpoint);
+  free(pthis->push_endpoint);
   free(pthis);
 }
 
@@ -182,13 +199,30 @@ void webrtc_control_config(struct webrtc_control_s* pthis,
   pthis->create_offer_cb = config->on_create_offer;
   pthis->remote_answer_cb = config->on_remote_answer;
   pthis->remote_candidate_cb = config->on_remote_candidate;
+
+  free(pthis->pull_endpoint);
+  free(pthis->push_endpoint);
+  pthis->pull_endpoint =
+  ipc_endpoint_resolve(config->pull_endpoint, SESSION_PULL_ENDPOINT,
+                       DEFAULT_PULL_ENDPOINT, config->session_id);
+  pthis->push_endpoint =
+  ipc_endpoint_resolve(config->push_endpoint, SESSION_PUSH_ENDPOINT,
+                       DEFAULT_PUSH_ENDPOINT, config->session_id);
 }
 
 int webrtc_control_start(struct webrtc_control_s* pthis) {
   pthis->is_interrupted = 0;
   pthis->is_running = 1;
+
+  int fd;
+  size_t fd_size = sizeof(fd);
+  zmq_getsockopt(pthis->pull_socket, ZMQ_FD, &fd, &fd_size);
+  uv_poll_init(pthis->cb_loop, &pthis->pull_poll, fd);
+  pthis->pull_poll.data = pthis;
+  uv_async_init(pthis->cb_loop, &pthis->stop_async, on_stop_async);
+  pthis->stop_async.data = pthis;
+
   int ret = uv_thread_create(&pthis->zmq_thread, zmq_main, pthis);
-  //int cbret = uv_thread_create(&pthis->cb_thread, cb_loop_main, pthis);
   return ret;
 }
 
@@ -199,13 +233,10 @@ int webrtc_control_stop(struct webrtc_control_s* pthis) {
   }
   pthis->is_interrupted = 1;
   pthis->is_running = 0;
-  do {
-    ret = uv_loop_close(pthis->cb_loop);
-  } while (UV_EBUSY == ret);
-  pthis->cb_loop = NULL;
+  uv_async_send(&pthis->stop_async);
   ret = uv_thread_join(&pthis->zmq_thread);
-  int get = uv_thread_join(&pthis->cb_thread);
-  return ret | get;
+  uv_loop_close(pthis->cb_loop);
+  return ret;
 }
 
 #define MSG_TYPE_OFFER "offer"
@@ -20,6 +20,10 @@ struct webrtc_control_config_s {
                               int8_t m_line_index, const char* candidate,
                               void* p);
   void* p;
+  // optional; endpoint templates may contain {session} (see ipc_endpoint.h)
+  const char* session_id;
+  const char* pull_endpoint;
+  const char* push_endpoint;
 };
 
 void webrtc_control_alloc(struct webrtc_control_s** webrtc_control_out);